@@ -0,0 +1,214 @@
+#include "aot.h"
+#include "codegen.h"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <unordered_set>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+
+using namespace llvm;
+
+// Copy of node with every variable the script has defined replaced by the
+// name of its current version.
+ASTNodePtr AOTCompiler::rename(const ASTNode* nd) {
+    if (auto *num = dynamic_cast<const NumberNode*>(nd))
+        return ASTNodePtr(arena.make<NumberNode>(num->getValue()));
+    if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        auto it = current.find(var->getName());
+        return ASTNodePtr(arena.make<VariableNode>(it == current.end() ? var->getName() : it->second));
+    }
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd))
+        return ASTNodePtr(arena.make<BinaryOpNode>(bin->op, rename(bin->left.get()), rename(bin->right.get())));
+    if (auto *func = dynamic_cast<const FunctionNode*>(nd))
+        return ASTNodePtr(arena.make<FunctionNode>(func->getFunc(), rename(func->getArg())));
+    if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<ASTNodePtr> args;
+        for (const ASTNodePtr& arg : call->getArgs())
+            args.push_back(rename(arg.get()));
+        return ASTNodePtr(arena.make<CallNode>(call->getDef(), std::move(args)));
+    }
+    throw std::runtime_error("Unknown AST node");
+}
+
+void AOTCompiler::define(const std::string& name, const ASTNode* expr) {
+    trees.push_back(rename(expr));
+    std::string version = name + "@" + std::to_string(redefinitions[name]++);
+    definitions[version] = trees.back().get();
+    current[name] = version;
+    for (Formula& f : exported)
+        if (f.name == name) {
+            f.version = version;
+            return;
+        }
+    exported.push_back(Formula{name, version});
+}
+
+// Free inputs of a formula, looking through the definitions it uses.
+std::vector<std::string> AOTCompiler::inputsOf(const std::string& version) const {
+    std::vector<std::string> inputs;
+    std::unordered_set<std::string> seen;
+    std::function<void(const ASTNode*)> walk = [&](const ASTNode* nd) {
+        std::vector<std::string> vars;
+        collectVariables(nd, vars);
+        for (const std::string& v : vars) {
+            if (!seen.insert(v).second)
+                continue;
+            auto def = definitions.find(v);
+            if (def != definitions.end())
+                walk(def->second);
+            else
+                inputs.push_back(v);
+        }
+    };
+    walk(definitions.at(version));
+    return inputs;
+}
+
+void AOTCompiler::emitObject(const std::string& path, int optLevel, bool fastMath,
+                             const std::string& cpu) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    std::string triple = sys::getDefaultTargetTriple();
+    std::string error;
+    const Target* T = TargetRegistry::lookupTarget(triple, error);
+    if (!T)
+        throw std::runtime_error("No target for " + triple + ": " + error);
+    std::string features;
+    std::string cpuName = cpu;
+    if (cpuName.empty()) {
+        cpuName = sys::getHostCPUName().str();
+        StringMap<bool> hostFeatures;
+        if (sys::getHostCPUFeatures(hostFeatures))
+            for (auto& f : hostFeatures)
+                features += (features.empty() ? "" : ",") + std::string(f.second ? "+" : "-")
+                            + f.first().str();
+    }
+    TargetOptions options;
+    if (fastMath) {
+        options.UnsafeFPMath = true;
+        options.NoInfsFPMath = true;
+        options.NoNaNsFPMath = true;
+        options.NoSignedZerosFPMath = true;
+    }
+    std::unique_ptr<TargetMachine> TM(T->createTargetMachine(
+        triple, cpuName, features, options, Reloc::PIC_, None,
+        optLevel == 0 ? CodeGenOpt::None : optLevel == 1 ? CodeGenOpt::Less
+                        : optLevel == 2 ? CodeGenOpt::Default : CodeGenOpt::Aggressive));
+
+    LLVMContext Context;
+    Module M("dsl_aot", Context);
+    M.setTargetTriple(triple);
+    M.setDataLayout(TM->createDataLayout());
+    IRBuilder<> Builder(Context);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+    Type *D = Builder.getDoubleTy();
+    Type *I32P = PointerType::getUnqual(Builder.getInt32Ty());
+    for (const Formula& f : exported) {
+        std::vector<std::string> inputs = inputsOf(f.version);
+        std::vector<Type*> argTys(inputs.size(), D);
+        argTys.push_back(I32P);
+        Function *F = Function::Create(FunctionType::get(D, argTys, false),
+                                       Function::ExternalLinkage, "dsl_" + f.name, M);
+        F->addFnAttr(Attribute::NoUnwind);
+        BasicBlock *Entry = BasicBlock::Create(Context, "entry", F);
+        Builder.SetInsertPoint(Entry);
+        // A null status pointer sends error codes to a local instead.
+        Argument *Status = F->getArg((unsigned)inputs.size());
+        Status->setName("status");
+        Value *Local = Builder.CreateAlloca(Builder.getInt32Ty(), nullptr, "status.local");
+        Value *StatusPtr = Builder.CreateSelect(Builder.CreateIsNull(Status), Local, Status);
+
+        ExprEmitter emitter{Context, M, Builder, StatusPtr, {}, {}};
+        emitter.definitions = &definitions;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            F->getArg((unsigned)i)->setName(inputs[i]);
+            emitter.vars[inputs[i]] = F->getArg((unsigned)i);
+        }
+        Builder.CreateRet(emitter.emit(definitions.at(f.version)));
+    }
+    if (verifyModule(M, &errs()))
+        throw std::runtime_error("Generated invalid IR");
+    runOptimizationPipeline(M, TM.get(), optLevel);
+
+    std::error_code EC;
+    raw_fd_ostream out(path, EC, sys::fs::OF_None);
+    if (EC)
+        throw std::runtime_error("Cannot write " + path + ": " + EC.message());
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, out, nullptr, CGFT_ObjectFile))
+        throw std::runtime_error("Target cannot emit object files");
+    PM.run(M);
+}
+
+void AOTCompiler::linkShared(const std::string& objectPath, const std::string& libraryPath) {
+    const char* cc = std::getenv("CC");
+    std::string command = std::string(cc && *cc ? cc : "cc") + " -shared -o '" + libraryPath
+                          + "' '" + objectPath + "' -lm";
+    if (std::system(command.c_str()) != 0)
+        throw std::runtime_error("Linking failed: " + command);
+}
+
+// Parameter name for input name in the generated header. C and C++ keywords
+// and names starting with dsl_ (the prefix of the status parameter) get a
+// dsl_in_ prefix; everything else is kept, so no two inputs can clash.
+static std::string headerParameter(const std::string& name) {
+    static const std::unordered_set<std::string> keywords = {
+        "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break",
+        "case", "catch", "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept",
+        "const", "consteval", "constexpr", "constinit", "const_cast", "continue", "co_await",
+        "co_return", "co_yield", "decltype", "default", "delete", "do", "double", "dynamic_cast",
+        "else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+        "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+        "nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+        "reinterpret_cast", "requires", "restrict", "return", "short", "signed", "sizeof",
+        "static", "static_assert", "static_cast", "struct", "switch", "template", "this",
+        "thread_local", "throw", "true", "try", "typedef", "typeid", "typename", "union",
+        "unsigned", "using", "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq",
+        "_Alignas", "_Alignof", "_Atomic", "_Bool", "_Complex", "_Generic", "_Imaginary",
+        "_Noreturn", "_Static_assert", "_Thread_local"};
+    if (keywords.count(name) || name.compare(0, 4, "dsl_") == 0)
+        return "dsl_in_" + name;
+    return name;
+}
+
+void AOTCompiler::emitHeader(const std::string& path, const std::string& source) const {
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error("Cannot write " + path);
+    std::string guard = "DSL_";
+    for (char c : path.substr(path.find_last_of('/') + 1))
+        guard += std::isalnum((unsigned char)c) ? (char)std::toupper((unsigned char)c) : '_';
+    out << "/* Generated by dsl from " << source << ". Do not edit. */\n"
+        << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+        << "/* Codes stored through dsl_status_ (which may be NULL) on a domain error;\n"
+        << "   the function then returns NaN. */\n"
+        << "#ifndef DSL_DIVISION_BY_ZERO\n"
+        << "#define DSL_DIVISION_BY_ZERO " << DivisionByZero << "\n"
+        << "#define DSL_LOG_OF_NON_POSITIVE " << LogOfNonPositive << "\n"
+        << "#define DSL_SQRT_OF_NEGATIVE " << SqrtOfNegative << "\n"
+        << "#endif\n\n"
+        << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    for (const Formula& f : exported) {
+        out << "double dsl_" << f.name << "(";
+        for (const std::string& in : inputsOf(f.version))
+            out << "double " << headerParameter(in) << ", ";
+        out << "int* dsl_status_);\n";
+    }
+    out << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+}
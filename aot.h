@@ -0,0 +1,54 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "arena.h"
+#include "ast.h"
+
+// Ahead-of-time compiler: turns the named formulas of a script (`var name =
+// expr;`) into a native object file that exports one C function per name,
+//
+//     double dsl_<name>(double <input>..., int* status);
+//
+// and a header declaring them. The object needs only libm at link time.
+// Variables the script assigns are inlined from the formula they had at that
+// point; the others are the function's inputs, in order of first use. A domain
+// error stores its code (DSL_DIVISION_BY_ZERO, ...) through status, which may
+// be null, and returns NaN. A name defined more than once exports its last
+// definition.
+class AOTCompiler {
+public:
+    void define(const std::string& name, const ASTNode* expr);
+    bool empty() const { return exported.empty(); }
+
+    // Compile every exported formula at optLevel (0-3) for cpu ("" for the
+    // host) into an object file. Throws std::runtime_error on failure.
+    void emitObject(const std::string& path, int optLevel, bool fastMath,
+                    const std::string& cpu = "");
+    // Link an object from emitObject into a shared library with the system
+    // compiler driver ($CC, default cc).
+    static void linkShared(const std::string& objectPath, const std::string& libraryPath);
+    void emitHeader(const std::string& path, const std::string& source) const;
+
+private:
+    struct Formula {
+        std::string name;     // exported as dsl_<name>
+        std::string version;  // key into definitions
+    };
+
+    std::vector<std::string> inputsOf(const std::string& version) const;
+    ASTNodePtr rename(const ASTNode* node);
+
+    Arena arena;
+    std::vector<ASTNodePtr> trees;
+    // By version, "name@N" for the Nth definition of name; unlike inputs,
+    // versions can never be shadowed by a later definition.
+    std::unordered_map<std::string, const ASTNode*> definitions;
+    std::unordered_map<std::string, std::string> current;  // name -> latest version
+    std::unordered_map<std::string, unsigned> redefinitions;
+    std::vector<Formula> exported;  // in order of first definition
+};
+
+#endif
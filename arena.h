@@ -0,0 +1,91 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator. Objects are carved out of large blocks back to back and
+// released all at once by reset(); nothing is ever freed individually.
+// Destructors are not run by the arena: whoever owns an object must destroy it
+// (see ArenaDeleter) before the memory is reset.
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 4096) : blockSize(blockSize) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(cur) + align - 1) & ~(uintptr_t)(align - 1);
+        if (!cur || p + size > reinterpret_cast<uintptr_t>(end)) {
+            newBlock(size + align);
+            p = (reinterpret_cast<uintptr_t>(cur) + align - 1) & ~(uintptr_t)(align - 1);
+        }
+        cur = reinterpret_cast<char*>(p + size);
+        used += size;
+        allocated += size;
+        return reinterpret_cast<void*>(p);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        ++made;
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Release everything at once. Memory is kept for reuse, coalesced into one
+    // block as large as everything handed out so far, so an arena that is reset
+    // after every statement stops allocating once it has seen its largest one.
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& b : blocks)
+                total += b.size;
+            blocks.clear();
+            newBlock(total);
+        } else if (!blocks.empty()) {
+            cur = blocks.front().data.get();
+            end = cur + blocks.front().size;
+        }
+        used = 0;
+    }
+
+    // Bytes handed out since the last reset.
+    size_t bytesUsed() const { return used; }
+    // Totals over the arena's life, resets included.
+    size_t bytesAllocated() const { return allocated; }
+    size_t objectsMade() const { return made; }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    void newBlock(size_t minSize) {
+        size_t size = minSize > blockSize ? minSize : blockSize;
+        blocks.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+        cur = blocks.back().data.get();
+        end = cur + size;
+    }
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    char* cur = nullptr;
+    char* end = nullptr;
+    size_t used = 0;
+    size_t allocated = 0;
+    size_t made = 0;
+};
+
+// Deleter for objects placed in an Arena: runs the destructor and leaves the
+// memory to the arena.
+struct ArenaDeleter {
+    template <typename T>
+    void operator()(T* p) const { p->~T(); }
+};
+
+#endif
@@ -1,26 +1,127 @@
 #ifndef AST_H
 #define AST_H
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <string>
 #include <memory>
 #include <unordered_map>
 #include <stdexcept>
 #include <ostream>
+#include <vector>
+#include "arena.h"
+
+// Domain errors raised by the compiled tiers (bytecode and JIT). They are bit
+// flags so that kernels evaluating many rows can accumulate them; the messages
+// match the ones evaluate() throws. NoConvergence is only reported by the
+// equation solver.
+enum DomainError : int {
+    DivisionByZero = 1,
+    LogOfNonPositive = 2,
+    SqrtOfNegative = 4,
+    NoConvergence = 8,
+};
+
+inline const char* domainErrorMessage(int status) {
+    if (status & DivisionByZero) return "Division by zero";
+    if (status & LogOfNonPositive) return "Log of non-positive";
+    if (status & SqrtOfNegative) return "Sqrt of negative";
+    if (status & NoConvergence) return "Equation solver did not converge";
+    return "Unknown domain error";
+}
+
+// Arithmetic a formula is evaluated in. Inputs and results are doubles
+// either way. F32 rounds the inputs to float and computes in float; Mixed
+// rounds the inputs (as if stored as float) but computes in double.
+enum class Precision { F64, F32, Mixed };
+
+inline const char* precisionName(Precision p) {
+    switch (p) {
+        case Precision::F64: return "f64";
+        case Precision::F32: return "f32";
+        case Precision::Mixed: return "mixed";
+    }
+    return "?";
+}
+
+// Variables live in dense slots of a contiguous value array. Names are mapped
+// to slots once, when a statement is resolved after parsing; evaluation then
+// only indexes the array.
+class SymbolTable {
+public:
+    // Slot for name, allocating an (undefined) one if it is new.
+    int slot(const std::string& name) {
+        auto it = index.emplace(name, (int)names.size());
+        if (it.second) {
+            names.push_back(name);
+            vals.push_back(0);
+            defined.push_back(false);
+        }
+        return it.first->second;
+    }
+    // Slot for name, or -1 if it has never been seen.
+    int find(const std::string& name) const {
+        auto it = index.find(name);
+        return it == index.end() ? -1 : it->second;
+    }
+    bool isDefined(int s) const { return defined[s]; }
+    void set(int s, double v) { vals[s] = v; defined[s] = true; }
+    double get(int s) const { return vals[s]; }
+    const std::string& name(int s) const { return names[s]; }
+    size_t size() const { return names.size(); }
+    // Valid until the next slot is allocated.
+    double* values() { return vals.data(); }
+    const double* values() const { return vals.data(); }
+
+private:
+    std::unordered_map<std::string, int> index;
+    std::vector<std::string> names;
+    std::vector<double> vals;
+    std::vector<bool> defined;
+};
+
+inline uint64_t hashCombine(uint64_t seed, uint64_t v) {
+    uint64_t x = seed ^ (v + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ull;
+    return x ^ (x >> 29);
+}
 
 class ASTNode {
 public:
     virtual ~ASTNode() = default;
-    virtual double evaluate(std::unordered_map<std::string, double>& symbols) const = 0;
+    // Tree interpreter. Variables read slots[slot]; call resolveSlots first.
+    virtual double evaluate(double* slots) const = 0;
+    // The same in single precision, for Precision::F32.
+    virtual float evaluateF32(float* slots) const = 0;
     virtual void print(std::ostream& out, int indent = 0) const = 0;
+    // Structural hash, computed bottom-up when the node is built: equal trees
+    // hash equal. Nodes are not modified once they have children attached.
+    uint64_t hash() const { return structuralHash; }
+
+protected:
+    uint64_t structuralHash = 0;
 };
-using ASTNodePtr = std::unique_ptr<ASTNode>;
+// Nodes are allocated in an Arena (Arena::make) and owned through ASTNodePtr,
+// which destroys the subtree but leaves the memory to the arena.
+using ASTNodePtr = std::unique_ptr<ASTNode, ArenaDeleter>;
 
 class NumberNode : public ASTNode {
     double value;
 public:
-    NumberNode(double v) : value(v) {}
-    double evaluate(std::unordered_map<std::string, double>&) const override { return value; }
+    // Constants hash by bit pattern, so 0 and -0 stay distinct.
+    NumberNode(double v) : value(v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        structuralHash = hashCombine(1, bits);
+    }
+    double getValue() const { return value; }
+    double evaluate(double*) const override { return value; }
+    float evaluateF32(float*) const override { return (float)value; }
     void print(std::ostream& out, int indent = 0) const override {
         out << (std::string(indent, ' ')) << "Number(" << value << ")\n";
     }
@@ -28,12 +129,23 @@ public:
 
 class VariableNode : public ASTNode {
     std::string name;
+    mutable int slot = -1;  // bound by resolveSlots
 public:
-    VariableNode(std::string n) : name(std::move(n)) {}
-    double evaluate(std::unordered_map<std::string, double>& symbols) const override {
-        if (symbols.find(name) != symbols.end())
-            return symbols[name];
-        throw std::runtime_error("Undefined variable: " + name);
+    VariableNode(std::string n) : name(std::move(n)) {
+        structuralHash = hashCombine(2, std::hash<std::string>()(name));
+    }
+    const std::string& getName() const { return name; }
+    int getSlot() const { return slot; }
+    void setSlot(int s) const { slot = s; }
+    double evaluate(double* slots) const override {
+        if (slot < 0)
+            throw std::runtime_error("Unresolved variable: " + name);
+        return slots[slot];
+    }
+    float evaluateF32(float* slots) const override {
+        if (slot < 0)
+            throw std::runtime_error("Unresolved variable: " + name);
+        return slots[slot];
     }
     void print(std::ostream& out, int indent = 0) const override {
         out << (std::string(indent, ' ')) << "Variable(" << name << ")\n";
@@ -45,10 +157,18 @@ public:
     char op;
     ASTNodePtr left, right;
     BinaryOpNode(char o, ASTNodePtr l, ASTNodePtr r)
-        : op(o), left(std::move(l)), right(std::move(r)) {}
-    double evaluate(std::unordered_map<std::string, double>& symbols) const override {
-        double a = left->evaluate(symbols);
-        double b = right->evaluate(symbols);
+        : op(o), left(std::move(l)), right(std::move(r)) {
+        structuralHash = hashCombine(hashCombine(hashCombine(3, (uint64_t)op), left->hash()),
+                                     right->hash());
+    }
+    double evaluate(double* slots) const override {
+        return apply(left->evaluate(slots), right->evaluate(slots));
+    }
+    float evaluateF32(float* slots) const override {
+        return apply(left->evaluateF32(slots), right->evaluateF32(slots));
+    }
+    template <typename T>
+    T apply(T a, T b) const {
         switch (op) {
             case '+': return a + b;
             case '-': return a - b;
@@ -70,9 +190,15 @@ class FunctionNode : public ASTNode {
     ASTNodePtr arg;
 public:
     FunctionNode(std::string f, ASTNodePtr a)
-        : func(std::move(f)), arg(std::move(a)) {}
-    double evaluate(std::unordered_map<std::string, double>& symbols) const override {
-        double x = arg->evaluate(symbols);
+        : func(std::move(f)), arg(std::move(a)) {
+        structuralHash = hashCombine(hashCombine(4, std::hash<std::string>()(func)), arg->hash());
+    }
+    const std::string& getFunc() const { return func; }
+    ASTNode* getArg() const { return arg.get(); }
+    double evaluate(double* slots) const override { return apply(arg->evaluate(slots)); }
+    float evaluateF32(float* slots) const override { return apply(arg->evaluateF32(slots)); }
+    template <typename T>
+    T apply(T x) const {
         if (func == "sin") return std::sin(x);
         if (func == "cos") return std::cos(x);
         if (func == "log") { if (x <= 0) throw std::runtime_error("Log of non-positive"); return std::log(x); }
@@ -85,15 +211,132 @@ public:
     }
 };
 
+// sum(expr over cols), mean, min, max and dot(a, b over cols): an aggregate of
+// expr over every row of the columns named in over. In expr those names stand
+// for the current row; its other variables are scalars, as everywhere else.
+// Reductions only run in the fused kernels built by evaluateReductions
+// (batch.h), which compute every reduction of a formula in one pass over the
+// rows; evaluate() throws. min and max skip NaN rows, and are NaN over no
+// rows (and +/-inf if every row is NaN).
+class ReductionNode : public ASTNode {
+public:
+    enum Kind { Sum, Mean, Min, Max, Dot };
+
+private:
+    Kind kind;
+    ASTNodePtr arg, arg2;  // arg2: dot's second operand
+    std::vector<std::string> over;
+
+public:
+    ReductionNode(Kind k, ASTNodePtr a, ASTNodePtr b, std::vector<std::string> cols)
+        : kind(k), arg(std::move(a)), arg2(std::move(b)), over(std::move(cols)) {
+        structuralHash = hashCombine(hashCombine(7, (uint64_t)kind), arg->hash());
+        if (arg2)
+            structuralHash = hashCombine(structuralHash, arg2->hash());
+        for (const std::string& c : over)
+            structuralHash = hashCombine(structuralHash, std::hash<std::string>()(c));
+    }
+    Kind getKind() const { return kind; }
+    ASTNode* getArg() const { return arg.get(); }
+    ASTNode* getArg2() const { return arg2.get(); }
+    const std::vector<std::string>& getOver() const { return over; }
+    bool isColumn(const std::string& name) const {
+        for (const std::string& c : over)
+            if (c == name) return true;
+        return false;
+    }
+    static const char* kindName(Kind k) {
+        static const char* names[] = {"sum", "mean", "min", "max", "dot"};
+        return names[k];
+    }
+    // sum, mean, min, max or dot; false for any other name.
+    static bool parseKind(const std::string& name, Kind& out) {
+        for (int k = Sum; k <= Dot; ++k)
+            if (name == kindName((Kind)k)) { out = (Kind)k; return true; }
+        return false;
+    }
+    double evaluate(double*) const override {
+        throw std::runtime_error(std::string(kindName(kind)) + "() runs only over columns");
+    }
+    float evaluateF32(float*) const override { return (float)evaluate(nullptr); }
+    void print(std::ostream& out, int indent = 0) const override {
+        out << (std::string(indent, ' ')) << "Reduction(" << kindName(kind) << " over";
+        for (const std::string& c : over)
+            out << " " << c;
+        out << ")\n";
+        arg->print(out, indent + 2);
+        if (arg2)
+            arg2->print(out, indent + 2);
+    }
+};
+
+// A user function, `func name(params) = body;`. The body refers only to the
+// parameters, resolved to slots 0..n-1. Definitions live as long as the
+// FunctionTable that made them, so calls can point at them; redefining a name
+// makes a new definition with a new id. Ids are unique across all tables.
+struct FunctionDef {
+    std::string name;
+    std::vector<std::string> params;
+    ASTNodePtr body;
+    unsigned id;
+};
+
+class CallNode : public ASTNode {
+    const FunctionDef* def;
+    std::vector<ASTNodePtr> args;
+public:
+    CallNode(const FunctionDef* d, std::vector<ASTNodePtr> a) : def(d), args(std::move(a)) {
+        structuralHash = hashCombine(hashCombine(6, std::hash<std::string>()(def->name)), def->id);
+        for (const ASTNodePtr& arg : args)
+            structuralHash = hashCombine(structuralHash, arg->hash());
+    }
+    const FunctionDef* getDef() const { return def; }
+    const std::vector<ASTNodePtr>& getArgs() const { return args; }
+    double evaluate(double* slots) const override { return call(slots); }
+    float evaluateF32(float* slots) const override { return call(slots); }
+    template <typename T>
+    T call(T* slots) const {
+        T small[8];
+        std::vector<T> large;
+        T* frame = small;
+        if (args.size() > 8) {
+            large.resize(args.size());
+            frame = large.data();
+        }
+        for (size_t i = 0; i < args.size(); ++i)
+            frame[i] = evaluateAs(args[i].get(), slots);
+        return evaluateAs(def->body.get(), frame);
+    }
+    static double evaluateAs(const ASTNode* node, double* slots) { return node->evaluate(slots); }
+    static float evaluateAs(const ASTNode* node, float* slots) { return node->evaluateF32(slots); }
+    void print(std::ostream& out, int indent = 0) const override {
+        out << (std::string(indent, ' ')) << "Call(" << def->name << ")\n";
+        for (const ASTNodePtr& arg : args)
+            arg->print(out, indent + 2);
+    }
+};
+
 class AssignmentNode : public ASTNode {
     std::string name;
     ASTNodePtr expr;
+    mutable int slot = -1;  // bound by resolveSlots
 public:
     AssignmentNode(std::string n, ASTNodePtr e)
-        : name(std::move(n)), expr(std::move(e)) {}
-    double evaluate(std::unordered_map<std::string, double>& symbols) const override {
-        double val = expr->evaluate(symbols);
-        symbols[name] = val;
+        : name(std::move(n)), expr(std::move(e)) {
+        structuralHash = hashCombine(hashCombine(5, std::hash<std::string>()(name)), expr->hash());
+    }
+    const std::string& getName() const { return name; }
+    ASTNode* getExpr() const { return expr.get(); }
+    int getSlot() const { return slot; }
+    void setSlot(int s) const { slot = s; }
+    double evaluate(double* slots) const override {
+        double val = expr->evaluate(slots);
+        slots[slot] = val;
+        return val;
+    }
+    float evaluateF32(float* slots) const override {
+        float val = expr->evaluateF32(slots);
+        slots[slot] = val;
         return val;
     }
     void print(std::ostream& out, int indent = 0) const override {
@@ -102,4 +345,293 @@ public:
     }
 };
 
+// Free variables of an expression in order of first appearance. Compiled tiers
+// take them, in this order, as their argument array.
+inline void collectVariables(const ASTNode* node, std::vector<std::string>& vars) {
+    if (auto *var = dynamic_cast<const VariableNode*>(node)) {
+        for (const auto& v : vars)
+            if (v == var->getName()) return;
+        vars.push_back(var->getName());
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(node)) {
+        collectVariables(bin->left.get(), vars);
+        collectVariables(bin->right.get(), vars);
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(node)) {
+        collectVariables(func->getArg(), vars);
+    } else if (auto *call = dynamic_cast<const CallNode*>(node)) {
+        for (const ASTNodePtr& arg : call->getArgs())
+            collectVariables(arg.get(), vars);
+    } else if (auto *red = dynamic_cast<const ReductionNode*>(node)) {
+        // The columns are bound by the reduction, not free.
+        std::vector<std::string> inner;
+        collectVariables(red->getArg(), inner);
+        if (red->getArg2())
+            collectVariables(red->getArg2(), inner);
+        for (const std::string& v : inner)
+            if (!red->isColumn(v) && std::find(vars.begin(), vars.end(), v) == vars.end())
+                vars.push_back(v);
+    }
+}
+
+// Bind every variable of the expression to its slot in symbols, throwing for
+// variables that have not been assigned yet. An assignment's target gets a
+// slot allocated if needed.
+inline void resolveSlots(const ASTNode* node, SymbolTable& symbols) {
+    if (auto *var = dynamic_cast<const VariableNode*>(node)) {
+        int s = symbols.find(var->getName());
+        if (s < 0 || !symbols.isDefined(s))
+            throw std::runtime_error("Undefined variable: " + var->getName());
+        var->setSlot(s);
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(node)) {
+        resolveSlots(bin->left.get(), symbols);
+        resolveSlots(bin->right.get(), symbols);
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(node)) {
+        resolveSlots(func->getArg(), symbols);
+    } else if (auto *call = dynamic_cast<const CallNode*>(node)) {
+        // The body was resolved against its parameters when it was defined.
+        for (const ASTNodePtr& arg : call->getArgs())
+            resolveSlots(arg.get(), symbols);
+    } else if (auto *assign = dynamic_cast<const AssignmentNode*>(node)) {
+        resolveSlots(assign->getExpr(), symbols);
+        assign->setSlot(symbols.slot(assign->getName()));
+    } else if (dynamic_cast<const ReductionNode*>(node)) {
+        // Reduction kernels read the scalars by name; they only need values.
+        std::vector<std::string> scalars;
+        collectVariables(node, scalars);
+        for (const std::string& v : scalars) {
+            int s = symbols.find(v);
+            if (s < 0 || !symbols.isDefined(s))
+                throw std::runtime_error("Undefined variable: " + v);
+        }
+    }
+}
+
+// Whether the expression contains a reduction, and so must be evaluated over
+// columns.
+inline bool containsReduction(const ASTNode* node) {
+    if (dynamic_cast<const ReductionNode*>(node))
+        return true;
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(node))
+        return containsReduction(bin->left.get()) || containsReduction(bin->right.get());
+    if (auto *func = dynamic_cast<const FunctionNode*>(node))
+        return containsReduction(func->getArg());
+    if (auto *call = dynamic_cast<const CallNode*>(node)) {
+        for (const ASTNodePtr& arg : call->getArgs())
+            if (containsReduction(arg.get()))
+                return true;
+    }
+    return false;
+}
+
+// Columns that the expression's reductions run over, in order of first
+// appearance.
+inline void collectColumns(const ASTNode* node, std::vector<std::string>& columns) {
+    if (auto *red = dynamic_cast<const ReductionNode*>(node)) {
+        for (const std::string& c : red->getOver())
+            if (std::find(columns.begin(), columns.end(), c) == columns.end())
+                columns.push_back(c);
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(node)) {
+        collectColumns(bin->left.get(), columns);
+        collectColumns(bin->right.get(), columns);
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(node)) {
+        collectColumns(func->getArg(), columns);
+    } else if (auto *call = dynamic_cast<const CallNode*>(node)) {
+        for (const ASTNodePtr& arg : call->getArgs())
+            collectColumns(arg.get(), columns);
+    }
+}
+
+// Slots of a resolved expression's free variables, in collectVariables order:
+// the argument binding for the compiled tiers.
+inline void collectSlots(const ASTNode* node, std::vector<int>& slots) {
+    if (auto *var = dynamic_cast<const VariableNode*>(node)) {
+        for (int s : slots)
+            if (s == var->getSlot()) return;
+        slots.push_back(var->getSlot());
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(node)) {
+        collectSlots(bin->left.get(), slots);
+        collectSlots(bin->right.get(), slots);
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(node)) {
+        collectSlots(func->getArg(), slots);
+    } else if (auto *call = dynamic_cast<const CallNode*>(node)) {
+        for (const ASTNodePtr& arg : call->getArgs())
+            collectSlots(arg.get(), slots);
+    }
+}
+
+// Tree interpreter at precision p, with the values in symbols. Below F64 it
+// works on a copy of the values, rounded to float.
+inline double evaluateAt(const ASTNode* node, SymbolTable& symbols, Precision p) {
+    if (p == Precision::F64)
+        return node->evaluate(symbols.values());
+    const double* values = symbols.values();
+    if (p == Precision::F32) {
+        std::vector<float> slots(values, values + symbols.size());
+        return node->evaluateF32(slots.data());
+    }
+    std::vector<double> slots(symbols.size());
+    for (size_t i = 0; i < slots.size(); ++i)
+        slots[i] = (float)values[i];
+    return node->evaluate(slots.data());
+}
+
+// Whether two expressions have the same structure (and so the same value for
+// the same variables). Hashes are compared first, so unequal trees are usually
+// rejected in O(1).
+inline bool sameStructure(const ASTNode* a, const ASTNode* b) {
+    if (a == b)
+        return true;
+    if (a->hash() != b->hash())
+        return false;
+    if (auto *x = dynamic_cast<const NumberNode*>(a)) {
+        auto *y = dynamic_cast<const NumberNode*>(b);
+        if (!y)
+            return false;
+        double u = x->getValue(), v = y->getValue();
+        return std::memcmp(&u, &v, sizeof u) == 0;
+    }
+    if (auto *x = dynamic_cast<const VariableNode*>(a)) {
+        auto *y = dynamic_cast<const VariableNode*>(b);
+        return y && x->getName() == y->getName();
+    }
+    if (auto *x = dynamic_cast<const BinaryOpNode*>(a)) {
+        auto *y = dynamic_cast<const BinaryOpNode*>(b);
+        return y && x->op == y->op && sameStructure(x->left.get(), y->left.get())
+               && sameStructure(x->right.get(), y->right.get());
+    }
+    if (auto *x = dynamic_cast<const FunctionNode*>(a)) {
+        auto *y = dynamic_cast<const FunctionNode*>(b);
+        return y && x->getFunc() == y->getFunc() && sameStructure(x->getArg(), y->getArg());
+    }
+    if (auto *x = dynamic_cast<const CallNode*>(a)) {
+        auto *y = dynamic_cast<const CallNode*>(b);
+        if (!y || x->getDef() != y->getDef())
+            return false;
+        for (size_t i = 0; i < x->getArgs().size(); ++i)
+            if (!sameStructure(x->getArgs()[i].get(), y->getArgs()[i].get()))
+                return false;
+        return true;
+    }
+    if (auto *x = dynamic_cast<const ReductionNode*>(a)) {
+        auto *y = dynamic_cast<const ReductionNode*>(b);
+        return y && x->getKind() == y->getKind() && x->getOver() == y->getOver()
+               && sameStructure(x->getArg(), y->getArg())
+               && (bool)x->getArg2() == (bool)y->getArg2()
+               && (!x->getArg2() || sameStructure(x->getArg2(), y->getArg2()));
+    }
+    return false;
+}
+
+// Structural key of an expression, used to cache compiled code and tier state.
+// Unlike print(), constants are written exactly so that formulas differing only
+// in a far decimal place never share code.
+inline void appendFormulaKey(const ASTNode* nd, std::string& key) {
+    if (auto *num = dynamic_cast<const NumberNode*>(nd)) {
+        char buf[32];
+        std::snprintf(buf, sizeof buf, "%a", num->getValue());
+        key += buf;
+    } else if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        key += '$';
+        key += var->getName();
+        key += ';';
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd)) {
+        key += '(';
+        key += bin->op;
+        appendFormulaKey(bin->left.get(), key);
+        key += ',';
+        appendFormulaKey(bin->right.get(), key);
+        key += ')';
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(nd)) {
+        key += func->getFunc();
+        key += '(';
+        appendFormulaKey(func->getArg(), key);
+        key += ')';
+    } else if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        // By definition, not name: a redefined function is a different formula.
+        key += '@';
+        key += call->getDef()->name;
+        key += '#';
+        key += std::to_string(call->getDef()->id);
+        key += '(';
+        for (const ASTNodePtr& arg : call->getArgs()) {
+            appendFormulaKey(arg.get(), key);
+            key += ',';
+        }
+        key += ')';
+    } else if (auto *red = dynamic_cast<const ReductionNode*>(nd)) {
+        key += '%';
+        key += ReductionNode::kindName(red->getKind());
+        key += '(';
+        appendFormulaKey(red->getArg(), key);
+        if (red->getArg2()) {
+            key += ',';
+            appendFormulaKey(red->getArg2(), key);
+        }
+        for (const std::string& c : red->getOver()) {
+            key += ' ';
+            key += c;
+        }
+        key += ')';
+    } else {
+        throw std::runtime_error("Unknown AST node");
+    }
+}
+
+// The expression in infix notation, with only the parentheses it needs, for
+// naming its code in profiles. Constants are rounded as by printf's %g.
+inline void appendFormulaText(const ASTNode* nd, std::string& text) {
+    auto precedence = [](const ASTNode* n) {
+        auto *bin = dynamic_cast<const BinaryOpNode*>(n);
+        if (!bin)
+            return 4;
+        return bin->op == '^' ? 3 : bin->op == '*' || bin->op == '/' ? 2 : 1;
+    };
+    if (auto *num = dynamic_cast<const NumberNode*>(nd)) {
+        char buf[32];
+        std::snprintf(buf, sizeof buf, "%g", num->getValue());
+        text += buf;
+    } else if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        text += var->getName();
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd)) {
+        // - and / group to the left, ^ to the right.
+        int p = precedence(bin), l = precedence(bin->left.get()), r = precedence(bin->right.get());
+        bool wrapLeft = l < p || (l == p && bin->op == '^');
+        bool wrapRight = r < p || (r == p && bin->op != '+' && bin->op != '*');
+        text += wrapLeft ? "(" : "";
+        appendFormulaText(bin->left.get(), text);
+        text += wrapLeft ? ")" : "";
+        text += p == 1 ? std::string(" ") + bin->op + " " : std::string(1, bin->op);
+        text += wrapRight ? "(" : "";
+        appendFormulaText(bin->right.get(), text);
+        text += wrapRight ? ")" : "";
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(nd)) {
+        text += func->getFunc();
+        text += '(';
+        appendFormulaText(func->getArg(), text);
+        text += ')';
+    } else if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        text += call->getDef()->name;
+        text += '(';
+        for (size_t i = 0; i < call->getArgs().size(); ++i) {
+            text += i ? ", " : "";
+            appendFormulaText(call->getArgs()[i].get(), text);
+        }
+        text += ')';
+    } else if (auto *red = dynamic_cast<const ReductionNode*>(nd)) {
+        text += ReductionNode::kindName(red->getKind());
+        text += '(';
+        appendFormulaText(red->getArg(), text);
+        if (red->getArg2()) {
+            text += ", ";
+            appendFormulaText(red->getArg2(), text);
+        }
+        for (size_t i = 0; i < red->getOver().size(); ++i) {
+            text += i ? ", " : " over ";
+            text += red->getOver()[i];
+        }
+        text += ')';
+    } else {
+        throw std::runtime_error("Unknown AST node");
+    }
+}
+
 #endif
@@ -0,0 +1,356 @@
+#include "batch.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "jit.h"
+#include "simplify.h"
+#include "stats.h"
+#include "threadpool.h"
+
+namespace {
+// Aim for the columns touched by one chunk to fit in a typical per-core L2.
+constexpr size_t ChunkBytes = 256 * 1024;
+constexpr size_t MinChunkRows = 1024;
+}
+
+const Column& findColumn(const std::vector<Column>& columns, const std::string& name) {
+    const Column* found = nullptr;
+    for (const Column& c : columns)
+        if (c.name == name) {
+            if (found)
+                throw std::runtime_error("Duplicate column for variable: " + name);
+            found = &c;
+        }
+    if (!found)
+        throw std::runtime_error("No column for variable: " + name);
+    return *found;
+}
+
+void evaluateBatch(JITSession& jit, const ASTNode* formula, const std::vector<Column>& columns,
+                   double* out, size_t rows) {
+    BatchKernelPtr kernel = jit.compileBatch(formula, columns);
+    std::vector<const void*> inputs = kernel->bind(columns);
+    statAdd(Counter::BatchRows, rows);
+    int status = (*kernel)(inputs.data(), out, 0, (int64_t)rows);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+}
+
+void evaluateBatchParallel(JITSession& jit, ThreadPool& pool, const ASTNode* formula,
+                           const std::vector<Column>& columns, double* out, size_t rows,
+                           size_t chunkRows) {
+    BatchKernelPtr kernel = jit.compileBatch(formula, columns);
+    std::vector<const void*> inputs = kernel->bind(columns);
+    statAdd(Counter::BatchRows, rows);
+    if (chunkRows == 0)
+        chunkRows = std::max(MinChunkRows, ChunkBytes / (sizeof(double) * (inputs.size() + 1)));
+    size_t chunks = (rows + chunkRows - 1) / chunkRows;
+    std::vector<int> status(chunks, 0);
+    pool.parallelFor(chunks, [&](size_t chunk) {
+        int64_t begin = (int64_t)(chunk * chunkRows);
+        int64_t end = (int64_t)std::min(rows, (chunk + 1) * chunkRows);
+        status[chunk] = (*kernel)(inputs.data(), out, begin, end);
+    });
+    int errors = 0;
+    for (int s : status)
+        errors |= s;
+    if (errors)
+        throw std::runtime_error(domainErrorMessage(errors));
+}
+
+void evaluateBatchInterpreted(const ASTNode* formula, const std::vector<Column>& columns,
+                              double* out, size_t rows, Precision precision) {
+    // Variable i of the formula gets slot i. A copy is resolved, so that the
+    // caller's slots are left alone; then the slot values are just
+    // overwritten row by row, rounded as evaluateAt does below F64.
+    std::vector<std::string> vars;
+    collectVariables(formula, vars);
+    std::vector<const Column*> bound;
+    SymbolTable symbols;
+    for (const std::string& v : vars) {
+        bound.push_back(&findColumn(columns, v));
+        symbols.set(symbols.slot(v), 0);
+    }
+    Arena arena;
+    ASTNodePtr copy = cloneAST(formula, arena);
+    resolveSlots(copy.get(), symbols);
+    double* slots = symbols.values();
+    std::vector<float> slotsF32(bound.size());
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t i = 0; i < bound.size(); ++i) {
+            const Column& c = *bound[i];
+            slots[i] = c.type == ColumnType::F64 ? static_cast<const double*>(c.data)[row]
+                                                 : static_cast<const float*>(c.data)[row];
+            if (precision != Precision::F64)
+                slots[i] = slotsF32[i] = (float)slots[i];
+        }
+        out[row] = precision == Precision::F32 ? copy->evaluateF32(slotsF32.data())
+                                               : copy->evaluate(slots);
+    }
+}
+
+size_t SweepRange::size() const {
+    if (!std::isfinite(from) || !std::isfinite(to) || !std::isfinite(step) || step == 0)
+        throw std::runtime_error("Invalid sweep range");
+    double span = (to - from) / step;
+    if (span < 0)
+        throw std::runtime_error("Sweep step moves away from the end of the range");
+    if (span >= 1e15)
+        throw std::runtime_error("Sweep has too many points");
+    // Allow for (to - from) / step landing just below a whole number of steps.
+    return (size_t)std::floor(span + 1e-9) + 1;
+}
+
+Reduction parseReduction(const std::string& name) {
+    static const std::pair<const char*, Reduction> names[] = {
+        {"sum", Reduction::Sum}, {"min", Reduction::Min}, {"max", Reduction::Max},
+        {"argmin", Reduction::ArgMin}, {"argmax", Reduction::ArgMax}};
+    for (const auto& n : names)
+        if (name == n.first)
+            return n.second;
+    throw std::runtime_error("Unknown reduction: " + name + " (expected sum, min, max, argmin or argmax)");
+}
+
+namespace {
+// The kernel's arguments: the current values of its parameters.
+std::vector<double> scalarArgs(const JITCode& kernel, const SymbolTable& symbols) {
+    std::vector<double> args;
+    for (const std::string& p : kernel.getParams()) {
+        int s = symbols.find(p);
+        if (s < 0 || !symbols.isDefined(s))
+            throw std::runtime_error("Undefined variable: " + p);
+        args.push_back(symbols.get(s));
+    }
+    return args;
+}
+
+// Points per chunk: enough to amortize a task, few enough that a chunk's
+// values stay in L2 and many chunks keep every thread busy.
+size_t sweepChunk(size_t points, ThreadPool* pool) {
+    if (!pool)
+        return points;
+    return std::max(MinChunkRows, std::min(ChunkBytes / sizeof(double), points / (4 * pool->size() + 1)));
+}
+
+// Run task(chunk, begin, end) over the chunks of [0, points), on pool if given.
+template <typename Task>
+void forEachChunk(ThreadPool* pool, size_t points, size_t chunkRows, size_t chunks, Task task) {
+    auto run = [&](size_t chunk) {
+        task(chunk, chunk * chunkRows, std::min(points, (chunk + 1) * chunkRows));
+    };
+    if (pool && chunks > 1)
+        pool->parallelFor(chunks, run);
+    else
+        for (size_t chunk = 0; chunk < chunks; ++chunk)
+            run(chunk);
+}
+
+struct Partial {
+    double value;
+    size_t index;
+    bool found = false;  // false while every value so far was NaN
+};
+
+// Sum of parts[begin, end) as a balanced tree.
+double pairwiseSum(const std::vector<double>& parts, size_t begin, size_t end) {
+    if (end - begin == 1)
+        return parts[begin];
+    if (end == begin)
+        return 0;
+    size_t mid = begin + (end - begin) / 2;
+    return pairwiseSum(parts, begin, mid) + pairwiseSum(parts, mid, end);
+}
+}
+
+void evaluateSweep(JITSession& jit, ThreadPool* pool, const ASTNode* formula, const std::string& var,
+                   const SweepRange& range, const SymbolTable& symbols, double* out) {
+    size_t points = range.size();
+    SweepKernelPtr kernel = jit.compileSweep(formula, var);
+    std::vector<double> args = scalarArgs(*kernel, symbols);
+    statAdd(Counter::BatchRows, points);
+    size_t chunkRows = sweepChunk(points, pool);
+    size_t chunks = (points + chunkRows - 1) / chunkRows;
+    std::vector<int> status(chunks, 0);
+    forEachChunk(pool, points, chunkRows, chunks, [&](size_t chunk, size_t begin, size_t end) {
+        status[chunk] = (*kernel)(args.data(), range.from, range.step, out + begin,
+                                  (int64_t)begin, (int64_t)end);
+    });
+    int errors = 0;
+    for (int s : status)
+        errors |= s;
+    if (errors)
+        throw std::runtime_error(domainErrorMessage(errors));
+}
+
+double reduceSweep(JITSession& jit, ThreadPool* pool, const ASTNode* formula, const std::string& var,
+                   const SweepRange& range, const SymbolTable& symbols, Reduction reduction,
+                   size_t* index) {
+    size_t points = range.size();
+    SweepKernelPtr kernel = jit.compileSweep(formula, var);
+    std::vector<double> args = scalarArgs(*kernel, symbols);
+    statAdd(Counter::BatchRows, points);
+    // Chunks are always bounded here, since each one's values are buffered.
+    size_t chunkRows = std::min(points, pool ? sweepChunk(points, pool) : ChunkBytes / sizeof(double));
+    size_t chunks = (points + chunkRows - 1) / chunkRows;
+    std::vector<int> status(chunks, 0);
+    std::vector<Partial> partials(chunks);
+    bool lowest = reduction == Reduction::Min || reduction == Reduction::ArgMin;
+    forEachChunk(pool, points, chunkRows, chunks, [&](size_t chunk, size_t begin, size_t end) {
+        std::vector<double> values(end - begin);
+        status[chunk] = (*kernel)(args.data(), range.from, range.step, values.data(),
+                                  (int64_t)begin, (int64_t)end);
+        Partial& p = partials[chunk];
+        if (reduction == Reduction::Sum) {
+            p = {pairwiseSum(values, 0, values.size()), begin, true};
+            return;
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            double v = values[i];
+            if (v != v)
+                continue;
+            if (!p.found || (lowest ? v < p.value : v > p.value))
+                p = {v, begin + i, true};
+        }
+    });
+    int errors = 0;
+    for (int s : status)
+        errors |= s;
+    if (errors)
+        throw std::runtime_error(domainErrorMessage(errors));
+
+    if (reduction == Reduction::Sum) {
+        std::vector<double> sums(chunks);
+        for (size_t c = 0; c < chunks; ++c)
+            sums[c] = partials[c].value;
+        return pairwiseSum(sums, 0, chunks);
+    }
+    Partial result{std::nan(""), 0};
+    for (const Partial& p : partials)
+        if (p.found && (!result.found || (lowest ? p.value < result.value : p.value > result.value)))
+            result = p;
+    if (index)
+        *index = result.index;
+    return result.value;
+}
+
+namespace {
+// The distinct reductions of formula, in evaluation order.
+void collectReductions(const ASTNode* nd, std::vector<const ReductionNode*>& out) {
+    if (auto *red = dynamic_cast<const ReductionNode*>(nd)) {
+        for (const ReductionNode* r : out)
+            if (sameStructure(r, red))
+                return;
+        out.push_back(red);
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd)) {
+        collectReductions(bin->left.get(), out);
+        collectReductions(bin->right.get(), out);
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(nd)) {
+        collectReductions(func->getArg(), out);
+    } else if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        for (const ASTNodePtr& arg : call->getArgs())
+            collectReductions(arg.get(), out);
+    }
+}
+
+// A copy of formula with each reduction replaced by its value.
+ASTNodePtr replaceReductions(const ASTNode* nd, const std::vector<const ReductionNode*>& reductions,
+                             const std::vector<double>& values, Arena& arena) {
+    if (auto *red = dynamic_cast<const ReductionNode*>(nd)) {
+        for (size_t i = 0; i < reductions.size(); ++i)
+            if (sameStructure(reductions[i], red))
+                return ASTNodePtr(arena.make<NumberNode>(values[i]));
+    }
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd))
+        return ASTNodePtr(arena.make<BinaryOpNode>(bin->op,
+                                                   replaceReductions(bin->left.get(), reductions, values, arena),
+                                                   replaceReductions(bin->right.get(), reductions, values, arena)));
+    if (auto *func = dynamic_cast<const FunctionNode*>(nd))
+        return ASTNodePtr(arena.make<FunctionNode>(
+            func->getFunc(), replaceReductions(func->getArg(), reductions, values, arena)));
+    if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<ASTNodePtr> args;
+        for (const ASTNodePtr& arg : call->getArgs())
+            args.push_back(replaceReductions(arg.get(), reductions, values, arena));
+        return ASTNodePtr(arena.make<CallNode>(call->getDef(), std::move(args)));
+    }
+    return cloneAST(nd, arena);
+}
+
+}
+
+double evaluateReductions(JITSession& jit, ThreadPool* pool, const ASTNode* formula,
+                          const std::vector<Column>& columns, size_t rows,
+                          const SymbolTable& symbols, Summation summation) {
+    std::vector<const ReductionNode*> reductions;
+    collectReductions(formula, reductions);
+    if (reductions.empty())
+        throw std::runtime_error("Expected a reduction");
+    ReductionKernelPtr kernel = jit.compileReduction(reductions, columns, summation);
+    std::vector<const void*> inputs = kernel->bind(columns);
+    std::vector<double> args = scalarArgs(*kernel, symbols);
+    statAdd(Counter::BatchRows, rows);
+
+    size_t width = 2 * reductions.size();
+    size_t chunkRows = std::max(MinChunkRows, ChunkBytes / (sizeof(double) * (inputs.size() + 1)));
+    size_t chunks = std::max<size_t>(1, (rows + chunkRows - 1) / chunkRows);
+    std::vector<int> status(chunks, 0);
+    std::vector<double> partials(chunks * width);
+    forEachChunk(pool, rows, chunkRows, chunks, [&](size_t chunk, size_t begin, size_t end) {
+        status[chunk] = (*kernel)(args.data(), inputs.data(), (int64_t)begin, (int64_t)end,
+                                  &partials[chunk * width]);
+    });
+    int errors = 0;
+    for (int s : status)
+        errors |= s;
+    if (errors)
+        throw std::runtime_error(domainErrorMessage(errors));
+
+    std::vector<double> values;
+    std::vector<double> parts(chunks);
+    for (size_t i = 0; i < reductions.size(); ++i) {
+        ReductionNode::Kind kind = reductions[i]->getKind();
+        double value;
+        if (kind == ReductionNode::Min || kind == ReductionNode::Max) {
+            value = partials[2 * i];
+            for (size_t c = 1; c < chunks; ++c) {
+                double v = partials[c * width + 2 * i];
+                value = kind == ReductionNode::Min ? std::min(value, v) : std::max(value, v);
+            }
+            if (rows == 0)
+                value = std::nan("");
+        } else if (summation == Summation::Kahan) {
+            // Each chunk's sum is s - c; keep compensating across chunks.
+            double sum = 0, comp = 0;
+            for (size_t c = 0; c < chunks; ++c) {
+                for (double v : {partials[c * width + 2 * i], -partials[c * width + 2 * i + 1]}) {
+                    double y = v - comp, t = sum + y;
+                    comp = (t - sum) - y;
+                    sum = t;
+                }
+            }
+            value = sum - comp;
+        } else {
+            for (size_t c = 0; c < chunks; ++c)
+                parts[c] = partials[c * width + 2 * i];
+            value = pairwiseSum(parts, 0, chunks);
+        }
+        if (kind == ReductionNode::Mean)
+            value /= (double)rows;
+        values.push_back(value);
+    }
+
+    // The rest of the formula is scalar and runs once, on the tree interpreter.
+    Arena arena(1024);
+    ASTNodePtr rest = replaceReductions(formula, reductions, values, arena);
+    SymbolTable scalars;
+    std::vector<std::string> names;
+    collectVariables(rest.get(), names);
+    for (const std::string& name : names) {
+        int s = symbols.find(name);
+        if (s < 0 || !symbols.isDefined(s))
+            throw std::runtime_error("Undefined variable: " + name);
+        scalars.set(scalars.slot(name), symbols.get(s));
+    }
+    resolveSlots(rest.get(), scalars);
+    return evaluateAt(rest.get(), scalars, jit.getPrecision());
+}
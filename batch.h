@@ -0,0 +1,106 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "ast.h"
+
+class JITSession;
+class ThreadPool;
+
+enum class ColumnType { F64, F32 };
+
+// A named input column: rows contiguous values of the given type. The name is
+// matched against the variables of the formula being evaluated.
+struct Column {
+    std::string name;
+    const void* data;
+    ColumnType type;
+
+    Column(std::string n, const double* d) : name(std::move(n)), data(d), type(ColumnType::F64) {}
+    Column(std::string n, const float* d) : name(std::move(n)), data(d), type(ColumnType::F32) {}
+};
+
+// The column named name, or throw std::runtime_error if there is none or more
+// than one.
+const Column& findColumn(const std::vector<Column>& columns, const std::string& name);
+
+// How sum, mean and dot add up their rows. Pairwise lets the vectorizer keep
+// several partial sums per chunk, added up as a tree at the end of the loop,
+// and adds the chunks' sums pairwise: the error grows with the log of the row
+// count. Kahan compensates every addition, which keeps the loop scalar (the
+// chunks still run in parallel) but makes the error independent of the row
+// count.
+enum class Summation { Pairwise, Kahan };
+
+// Evaluate the formula for every row, writing out[0, rows). Each variable of
+// the formula must have exactly one column; columns it does not use are ignored. out must
+// not overlap the inputs. Domain errors are reported after the whole batch has
+// run, as std::runtime_error with the same messages as ASTNode::evaluate.
+void evaluateBatch(JITSession& jit, const ASTNode* formula, const std::vector<Column>& columns,
+                   double* out, size_t rows);
+
+// Same as evaluateBatch, but the rows are split into chunks small enough for
+// their inputs and output to stay in cache, and the chunks run on every thread
+// of pool. All threads share one compiled kernel. Each chunk writes only its
+// own rows of out, so the output does not depend on scheduling. chunkRows == 0
+// picks a size from the number of columns.
+void evaluateBatchParallel(JITSession& jit, ThreadPool& pool, const ASTNode* formula,
+                           const std::vector<Column>& columns, double* out, size_t rows,
+                           size_t chunkRows = 0);
+
+// Scalar fallback through the tree interpreter, for when JIT is not available
+// or not worth it. Columns are matched by name as for evaluateBatch; formula
+// itself is not modified. Rounds and computes at precision like the compiled
+// tiers. Stops at the first row that raises a domain error.
+void evaluateBatchInterpreted(const ASTNode* formula, const std::vector<Column>& columns,
+                              double* out, size_t rows, Precision precision = Precision::F64);
+
+// Value of a formula containing reductions (sum(expr over cols), ...; see
+// ReductionNode), with their columns read from columns, rows each. Every
+// reduction is computed in one fused pass over the rows; no intermediate column
+// is stored. With a pool, the rows are split into chunks as in
+// evaluateBatchParallel, and each chunk's partial results are combined in
+// chunk order. The formula's other variables are read from symbols. Domain
+// errors are reported as for evaluateBatch.
+double evaluateReductions(JITSession& jit, ThreadPool* pool, const ASTNode* formula,
+                          const std::vector<Column>& columns, size_t rows,
+                          const SymbolTable& symbols, Summation summation = Summation::Pairwise);
+
+// The points from, from + step, ... up to to, inclusive within rounding. step
+// may be negative, but must move from towards to.
+struct SweepRange {
+    double from, to, step;
+
+    // Number of points; throws std::runtime_error for a zero, non-finite or
+    // wrongly signed step.
+    size_t size() const;
+    double at(size_t i) const { return from + (double)i * step; }
+};
+
+enum class Reduction { Sum, Min, Max, ArgMin, ArgMax };
+
+// The reduction named name (sum, min, max, argmin, argmax), or throw.
+Reduction parseReduction(const std::string& name);
+
+// Evaluate the formula at every point of range with var set to the point,
+// writing out[0, range.size()). The formula's other variables are read from
+// symbols. The formula is compiled once into a sweep kernel; with a pool, the
+// points are split into chunks as in evaluateBatchParallel. Domain errors are
+// reported as for evaluateBatch.
+void evaluateSweep(JITSession& jit, ThreadPool* pool, const ASTNode* formula, const std::string& var,
+                   const SweepRange& range, const SymbolTable& symbols, double* out);
+
+// Reduce the formula's values over range without storing them: each chunk
+// reduces its own points and the partial results are combined in chunk order,
+// so the result does not depend on scheduling. For ArgMin and ArgMax the
+// result is the value at the first point reaching the extremum, and *index
+// (when given) is that point. NaN values are skipped by Min, Max and the arg
+// reductions. Sum adds pairwise within and across chunks, as
+// evaluateReductions does by default.
+double reduceSweep(JITSession& jit, ThreadPool* pool, const ASTNode* formula, const std::string& var,
+                   const SweepRange& range, const SymbolTable& symbols, Reduction reduction,
+                   size_t* index = nullptr);
+
+#endif
@@ -0,0 +1,413 @@
+// Benchmarks over generated workloads: deep expressions, wide scripts,
+// transcendental formulas and batch columns. Lexing, parsing, codegen,
+// compilation and execution are timed separately, and the tree interpreter,
+// bytecode VM and JIT are compared on the same formulas. Results are printed
+// and, with --out, written as JSON for tracking regressions.
+//
+//   ./dsl-bench [--out=FILE] [--rows=N[,N...]] [--min-time=SECONDS] [--filter=TEXT]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ast.h"
+#include "batch.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "script.h"
+#include "simplify.h"
+#include "threadpool.h"
+#include "parser.tab.hpp"
+#include "lexer.yy.hpp"
+
+namespace {
+
+enum class Engine { Tree, VM, JIT };
+
+const char* engineName(Engine e) {
+    return e == Engine::Tree ? "tree" : e == Engine::VM ? "vm" : "jit";
+}
+
+struct Result {
+    std::string workload, phase;
+    double seconds;     // per iteration
+    size_t iterations;
+    double items;       // tokens, statements, evaluations or rows per iteration
+    const char* unit;
+};
+
+struct Options {
+    std::string out, filter;
+    std::vector<size_t> rows{1000000};
+    double minTime = 0.3;
+};
+
+Options options;
+std::vector<Result> results;
+
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool selected(const std::string& workload, const std::string& phase) {
+    return options.filter.empty() || (workload + "/" + phase).find(options.filter) != std::string::npos;
+}
+
+// Run fn until minTime has passed (at least once) and record the mean time
+// of one run. Returns null if the benchmark is filtered out.
+template <typename Fn>
+const Result* measure(const std::string& workload, const std::string& phase, double items,
+                      const char* unit, Fn fn) {
+    if (!selected(workload, phase))
+        return nullptr;
+    size_t n = 0;
+    double start = now(), elapsed = 0;
+    do {
+        fn();
+        ++n;
+        elapsed = now() - start;
+    } while (elapsed < options.minTime);
+    results.push_back({workload, phase, elapsed / n, n, items, unit});
+    const Result& r = results.back();
+    std::printf("%-28s %-14s %12.3f us %10.2f ns/%s  (%zu runs)\n", workload.c_str(), phase.c_str(),
+                r.seconds * 1e6, r.seconds * 1e9 / items, unit, n);
+    std::fflush(stdout);
+    return &r;
+}
+
+// As measure, for phases whose time is reported by the code under test.
+void record(const std::string& workload, const std::string& phase, double seconds, size_t runs,
+            double items, const char* unit) {
+    if (!selected(workload, phase))
+        return;
+    results.push_back({workload, phase, seconds, runs, items, unit});
+    std::printf("%-28s %-14s %12.3f us %10.2f ns/%s  (%zu runs)\n", workload.c_str(), phase.c_str(),
+                seconds * 1e6, seconds * 1e9 / items, unit, runs);
+    std::fflush(stdout);
+}
+
+// --- Workloads -----------------------------------------------------------
+
+// Nested to the given depth, cycling through the four arithmetic operators.
+std::string deepExpression(int depth) {
+    std::string e = "x";
+    const char* ops[] = {" + 0.5)", " * 1.0001)", " - y)", " / 1.5)"};
+    for (int i = 0; i < depth; ++i)
+        e = "(" + e + ops[i % 4];
+    return e;
+}
+
+// terms calls to each of sin, cos, log and sqrt.
+std::string transcendentalExpression(int terms) {
+    std::string e;
+    for (int i = 0; i < terms; ++i) {
+        std::string a = std::to_string(1 + i * 0.125), b = std::to_string(2 + i * 0.25);
+        e += (i ? " + " : "") + std::string("sin(x*") + a + ")*cos(y*" + a + ") + log(x*x + " + b +
+             ")*sqrt(y*y + " + b + ")";
+    }
+    return e;
+}
+
+// One assignment per variable, each reading two earlier ones.
+std::string wideScript(int vars) {
+    std::string s = "var v0 = 1;\n";
+    for (int i = 1; i < vars; ++i)
+        s += "var v" + std::to_string(i) + " = v" + std::to_string(i - 1) + " * 1.0001 + v" +
+             std::to_string(i / 2) + " / 3;\n";
+    return s;
+}
+
+// --- Script host ---------------------------------------------------------
+
+// Runs statements on one engine, or only collects their trees (capture).
+class BenchHost : public ScriptHost {
+public:
+    Engine engine = Engine::Tree;
+    JITSession* jit = nullptr;
+    // Parse only: statements are dropped, or copied to capture when it is set.
+    bool skip = false;
+    std::vector<ASTNodePtr>* capture = nullptr;
+    Arena* captureArena = nullptr;
+
+    double evaluate(Script& script, ASTNode* node) override {
+        SymbolTable& symbols = script.symbols();
+        resolveSlots(node, symbols);
+        if (engine == Engine::Tree)
+            return node->evaluate(symbols.values());
+        if (engine == Engine::VM) {
+            std::vector<int> bind;
+            collectSlots(node, bind);
+            return BytecodeProgram(node).call(symbols.values(), bind);
+        }
+        return jit->evaluate(node, symbols);
+    }
+    double gradient(Script&, ASTNode*, std::vector<std::pair<std::string, double>>&) override {
+        throw std::runtime_error("Not benchmarked");
+    }
+    double solve(Script&, ASTNode*, const std::string&, ASTNode*, ASTNode*) override {
+        throw std::runtime_error("Not benchmarked");
+    }
+    void defineFunction(Script& script, const std::string& name,
+                        const std::vector<std::string>& params, ASTNode* body) override {
+        script.functions().define(name, params, body);
+    }
+    bool compileStatement(Script&, const char*, ASTNode* node) override {
+        if (capture)
+            capture->push_back(cloneAST(node, *captureArena));
+        return skip || capture;
+    }
+    void runDirective(Script&, const char*) override {}
+};
+
+std::ostream& discard() {
+    static std::ostream null(nullptr);
+    return null;
+}
+
+// Tokens in text, scanned the way Script does but without parsing them.
+size_t lexOnly(Script& script, const std::string& text) {
+    yyscan_t scanner;
+    yylex_init_extra(&script, &scanner);
+    YY_BUFFER_STATE buffer = yy_scan_bytes(text.data(), (int)text.size(), scanner);
+    YYSTYPE value;
+    size_t tokens = 0;
+    int token;
+    while ((token = yylex(&value, scanner)) != 0) {
+        if (token == DIRECTIVE || token == STRING)
+            std::free(value.sval);
+        ++tokens;
+    }
+    yy_delete_buffer(buffer, scanner);
+    yylex_destroy(scanner);
+    return tokens;
+}
+
+// The trees of every statement in text, copied into arena.
+std::vector<ASTNodePtr> parseAll(const std::string& text, Arena& arena) {
+    BenchHost host;
+    std::vector<ASTNodePtr> trees;
+    host.capture = &trees;
+    host.captureArena = &arena;
+    Script script(host, discard(), std::cerr);
+    script.feed(text.data(), text.size());
+    if (!script.finish())
+        throw std::runtime_error("Benchmark script does not parse");
+    return trees;
+}
+
+// --- Benchmarks ----------------------------------------------------------
+
+// Front end: lexing alone, then lexing and parsing (minus the lexing).
+void benchFrontEnd(const std::string& workload, const std::string& text) {
+    BenchHost host;
+    host.skip = true;
+    Script tokens(host, discard(), discard());
+    double count = (double)lexOnly(tokens, text);
+    const Result* lex = measure(workload, "lex", count, "token", [&] { lexOnly(tokens, text); });
+    double lexSeconds = lex ? lex->seconds : 0;
+    const Result* both = measure(workload, "lex+parse", count, "token", [&] {
+        Script script(host, discard(), std::cerr);
+        script.feed(text.data(), text.size());
+        script.finish();
+    });
+    if (lex && both)
+        record(workload, "parse", std::max(0.0, both->seconds - lexSeconds), both->iterations, count,
+               "token");
+}
+
+// One formula: the JIT's compile phases in a fresh session (so nothing is
+// cached), then one evaluation on each engine.
+void benchFormula(const std::string& workload, const std::string& expression, int optLevel) {
+    std::string text = expression + ";";
+    benchFrontEnd(workload, text);
+
+    Arena arena;
+    std::vector<ASTNodePtr> trees = parseAll(text, arena);
+    ASTNodePtr formula = simplify(trees.at(0).get(), arena, false);
+    SymbolTable symbols;
+    symbols.set(symbols.slot("x"), 0.75);
+    symbols.set(symbols.slot("y"), 1.25);
+    resolveSlots(formula.get(), symbols);
+
+    // StatementTiming splits the first evaluation by phase.
+    StatementTiming total;
+    size_t runs = 0;
+    double start = now();
+    do {
+        JITSession jit;
+        jit.setOptLevel(optLevel);
+        jit.evaluate(formula.get(), symbols);
+        StatementTiming t = jit.lastTiming();
+        total.setup += t.setup;
+        total.codegen += t.codegen;
+        total.optimize += t.optimize;
+        total.compile += t.compile;
+        total.execute += t.execute;
+        ++runs;
+    } while (now() - start < options.minTime);
+    std::string O = "-O" + std::to_string(optLevel);
+    record(workload, "setup", total.setup * 1e-6 / runs, runs, 1, "stmt");
+    record(workload, "codegen", total.codegen * 1e-6 / runs, runs, 1, "stmt");
+    record(workload, "optimize" + O, total.optimize * 1e-6 / runs, runs, 1, "stmt");
+    record(workload, "compile" + O, total.compile * 1e-6 / runs, runs, 1, "stmt");
+    record(workload, "first-call", total.execute * 1e-6 / runs, runs, 1, "stmt");
+
+    // Steady state, per evaluation.
+    const size_t reps = 1000;
+    std::vector<int> bind;
+    collectSlots(formula.get(), bind);
+    volatile double sink = 0;
+    measure(workload, "eval/tree", reps, "eval", [&] {
+        for (size_t i = 0; i < reps; ++i)
+            sink = formula->evaluate(symbols.values());
+    });
+    BytecodeProgram program(formula.get());
+    measure(workload, "eval/vm", reps, "eval", [&] {
+        for (size_t i = 0; i < reps; ++i)
+            sink = program.call(symbols.values(), bind);
+    });
+    JITSession jit;
+    jit.setOptLevel(optLevel);
+    CompiledFunctionPtr fn = jit.compile(formula.get());
+    fn->call(symbols.values(), bind);
+    measure(workload, "eval/jit" + O, reps, "eval", [&] {
+        for (size_t i = 0; i < reps; ++i)
+            sink = fn->call(symbols.values(), bind);
+    });
+    (void)sink;
+}
+
+// A whole script of assignments, run start to finish on each engine.
+void benchScript(const std::string& workload, const std::string& text, size_t statements) {
+    benchFrontEnd(workload, text);
+    for (Engine e : {Engine::Tree, Engine::VM, Engine::JIT}) {
+        measure(workload, std::string("run/") + engineName(e), (double)statements, "stmt", [&] {
+            JITSession jit;
+            BenchHost host;
+            host.engine = e;
+            host.jit = &jit;
+            Script script(host, discard(), std::cerr);
+            script.feed(text.data(), text.size());
+            script.finish();
+        });
+    }
+}
+
+// A formula over columns: row by row on the tree interpreter and the VM, and
+// as a JIT batch kernel (one thread and all of them), plus a fused reduction.
+void benchBatch(const std::string& expression, size_t rows) {
+    std::string workload = "batch/" + std::to_string(rows);
+    Arena arena;
+    std::vector<ASTNodePtr> trees = parseAll(expression + ";", arena);
+    ASTNodePtr formula = simplify(trees.at(0).get(), arena, false);
+    std::vector<ASTNodePtr> sums = parseAll("sum(" + expression + " over x, y);", arena);
+
+    std::vector<double> xs(rows), ys(rows), out(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        xs[i] = 0.5 + (double)(i % 1000) / 1000;
+        ys[i] = 1.5 - (double)(i % 777) / 1000;
+    }
+    std::vector<Column> columns{Column("x", xs.data()), Column("y", ys.data())};
+
+    measure(workload, "rows/tree", (double)rows, "row", [&] {
+        evaluateBatchInterpreted(formula.get(), columns, out.data(), rows);
+    });
+    BytecodeProgram program(formula.get());
+    measure(workload, "rows/vm", (double)rows, "row", [&] {
+        double args[2];
+        int status = 0;
+        for (size_t i = 0; i < rows; ++i) {
+            args[0] = xs[i];
+            args[1] = ys[i];
+            out[i] = program.run(args, &status);
+        }
+    });
+    JITSession jit;
+    evaluateBatch(jit, formula.get(), columns, out.data(), rows);
+    measure(workload, "rows/jit", (double)rows, "row", [&] {
+        evaluateBatch(jit, formula.get(), columns, out.data(), rows);
+    });
+    ThreadPool pool;
+    measure(workload, "rows/jit-" + std::to_string(pool.size()) + "t", (double)rows, "row", [&] {
+        evaluateBatchParallel(jit, pool, formula.get(), columns, out.data(), rows);
+    });
+    SymbolTable symbols;
+    measure(workload, "sum/jit-" + std::to_string(pool.size()) + "t", (double)rows, "row", [&] {
+        evaluateReductions(jit, &pool, sums.at(0).get(), columns, rows, symbols);
+    });
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeJSON(const std::string& path) {
+    std::ofstream file(path);
+    if (!file)
+        throw std::runtime_error("Cannot write " + path);
+    file.precision(9);
+    file << "{\n  \"context\": {\"threads\": " << std::max(1u, std::thread::hardware_concurrency())
+         << ", \"min_time\": " << options.minTime << "},\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        file << "    {\"workload\": " << jsonString(r.workload) << ", \"phase\": " << jsonString(r.phase)
+             << ", \"seconds\": " << r.seconds << ", \"iterations\": " << r.iterations
+             << ", \"items\": " << r.items << ", \"unit\": " << jsonString(r.unit)
+             << ", \"ns_per_item\": " << r.seconds * 1e9 / r.items << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--out=", 6) == 0) {
+            options.out = argv[i] + 6;
+        } else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+            options.filter = argv[i] + 9;
+        } else if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+            options.minTime = std::atof(argv[i] + 11);
+        } else if (std::strncmp(argv[i], "--rows=", 7) == 0) {
+            options.rows.clear();
+            std::istringstream list(argv[i] + 7);
+            std::string item;
+            while (std::getline(list, item, ','))
+                options.rows.push_back((size_t)std::atof(item.c_str()));  // accepts 1e7
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--out=FILE] [--rows=N[,N...]] [--min-time=SECONDS] [--filter=TEXT]\n";
+            return 1;
+        }
+    }
+    try {
+        benchFormula("deep/256", deepExpression(256), 2);
+        benchFormula("deep/2048", deepExpression(2048), 0);
+        benchFormula("transcendental/16", transcendentalExpression(16), 2);
+        benchScript("wide/2000", wideScript(2000), 2000);
+        for (size_t rows : options.rows)
+            benchBatch("sin(x)*cos(y) + log(x*x + 1)*sqrt(y + 2)", rows);
+        if (!options.out.empty()) {
+            writeJSON(options.out);
+            std::cout << "Wrote " << results.size() << " results to " << options.out << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
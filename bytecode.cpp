@@ -0,0 +1,180 @@
+#include "bytecode.h"
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+BytecodeProgram::BytecodeProgram(const ASTNode* node, Precision precision)
+    : precision(precision) {
+    collectVariables(node, params);
+    result = emit(node);
+    // Only needed while flattening; the nodes may not outlive the program.
+    emitted = {};
+}
+
+uint32_t BytecodeProgram::emit(const ASTNode* nd) {
+    if (frame)
+        if (auto *var = dynamic_cast<const VariableNode*>(nd))
+            return (*frame)[var->getSlot()];
+    if (dynamic_cast<const NumberNode*>(nd) || dynamic_cast<const VariableNode*>(nd))
+        return emitNode(nd);
+    auto& seen = emitted[nd->hash()];
+    for (const auto& e : seen)
+        if (sameStructure(e.first, nd))
+            return e.second;
+    uint32_t reg = emitNode(nd);
+    seen.emplace_back(nd, reg);
+    return reg;
+}
+
+// Post-order: operands always live in lower-numbered registers.
+uint32_t BytecodeProgram::emitNode(const ASTNode* nd) {
+    Instruction ins{Opcode::Const, 0, 0};
+    if (auto *num = dynamic_cast<const NumberNode*>(nd)) {
+        ins.a = (uint32_t)consts.size();
+        consts.push_back(num->getValue());
+    } else if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        ins.op = Opcode::Load;
+        while (params[ins.a] != var->getName())
+            ++ins.a;
+    } else if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd)) {
+        ins.a = emit(bin->left.get());
+        ins.b = emit(bin->right.get());
+        switch (bin->op) {
+            case '+': ins.op = Opcode::Add; break;
+            case '-': ins.op = Opcode::Sub; break;
+            case '*': ins.op = Opcode::Mul; break;
+            case '/': ins.op = Opcode::Div; break;
+            case '^': ins.op = Opcode::Pow; break;
+            default: throw std::runtime_error("Unknown operator");
+        }
+    } else if (auto *func = dynamic_cast<const FunctionNode*>(nd)) {
+        ins.a = emit(func->getArg());
+        const std::string& f = func->getFunc();
+        if (f == "sin") ins.op = Opcode::Sin;
+        else if (f == "cos") ins.op = Opcode::Cos;
+        else if (f == "log") ins.op = Opcode::Log;
+        else if (f == "sqrt") ins.op = Opcode::Sqrt;
+        else throw std::runtime_error("Unknown function: " + f);
+    } else if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<uint32_t> regs;
+        for (const ASTNodePtr& arg : call->getArgs())
+            regs.push_back(emit(arg.get()));
+        // The body's subexpressions stand for different values at every call
+        // site, so they get a CSE map of their own.
+        auto outerEmitted = std::move(emitted);
+        const std::vector<uint32_t>* outerFrame = frame;
+        emitted = {};
+        frame = &regs;
+        uint32_t reg = emit(call->getDef()->body.get());
+        emitted = std::move(outerEmitted);
+        frame = outerFrame;
+        return reg;
+    } else {
+        throw std::runtime_error("Unknown AST node in bytecode compiler");
+    }
+    code.push_back(ins);
+    return (uint32_t)code.size() - 1;
+}
+
+double BytecodeProgram::run(const double* args, int* status) const {
+    switch (precision) {
+        case Precision::F32: return execute<float, false>(args, status);
+        case Precision::Mixed: return execute<double, true>(args, status);
+        default: return execute<double, false>(args, status);
+    }
+}
+
+// T is the register type; RoundInputs rounds loads to float first.
+template <typename T, bool RoundInputs>
+double BytecodeProgram::execute(const double* args, int* status) const {
+    // Registers live on the stack for all but very large expressions.
+    T small[64];
+    std::unique_ptr<T[]> large;
+    T* r = small;
+    if (code.size() > 64) {
+        large.reset(new T[code.size()]);
+        r = large.get();
+    }
+    const Instruction* ip = code.data();
+    const Instruction* end = ip + code.size();
+    const double* k = consts.data();
+    T* dst = r;
+
+#if defined(__GNUC__)
+    // Threaded dispatch: one indirect jump per instruction, indexed by opcode.
+    static void* const labels[] = {&&Const, &&Load, &&Add, &&Sub, &&Mul, &&Div,
+                                   &&Pow, &&Sin, &&Cos, &&Log, &&Sqrt};
+#define DISPATCH() do { if (ip == end) goto done; goto *labels[(int)ip->op]; } while (0)
+#define CASE(name) name:
+#define NEXT() do { ++ip; ++dst; DISPATCH(); } while (0)
+    DISPATCH();
+#else
+#define CASE(name) case Opcode::name:
+#define NEXT() do { ++ip; ++dst; goto loop; } while (0)
+loop:
+    if (ip == end) goto done;
+    switch (ip->op) {
+#endif
+    CASE(Const) *dst = (T)k[ip->a]; NEXT();
+    CASE(Load) *dst = RoundInputs ? (T)(float)args[ip->a] : (T)args[ip->a]; NEXT();
+    CASE(Add) *dst = r[ip->a] + r[ip->b]; NEXT();
+    CASE(Sub) *dst = r[ip->a] - r[ip->b]; NEXT();
+    CASE(Mul) *dst = r[ip->a] * r[ip->b]; NEXT();
+    CASE(Div)
+        if (r[ip->b] == 0) { *status = DivisionByZero; goto fail; }
+        *dst = r[ip->a] / r[ip->b]; NEXT();
+    CASE(Pow) *dst = std::pow(r[ip->a], r[ip->b]); NEXT();
+    CASE(Sin) *dst = std::sin(r[ip->a]); NEXT();
+    CASE(Cos) *dst = std::cos(r[ip->a]); NEXT();
+    CASE(Log)
+        if (r[ip->a] <= 0) { *status = LogOfNonPositive; goto fail; }
+        *dst = std::log(r[ip->a]); NEXT();
+    CASE(Sqrt)
+        if (r[ip->a] < 0) { *status = SqrtOfNegative; goto fail; }
+        *dst = std::sqrt(r[ip->a]); NEXT();
+#if !defined(__GNUC__)
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef DISPATCH
+done:
+    return (double)r[result];
+fail:
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+double BytecodeProgram::call(const double* slots, const std::vector<int>& bind) const {
+    double small[16];
+    std::vector<double> large;
+    double* args = small;
+    if (bind.size() > 16) {
+        large.resize(bind.size());
+        args = large.data();
+    }
+    for (size_t i = 0; i < bind.size(); ++i)
+        args[i] = slots[bind[i]];
+    int status = 0;
+    double result = run(args, &status);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+    return result;
+}
+
+void BytecodeProgram::print(std::ostream& out) const {
+    static const char* names[] = {"const", "load", "add", "sub", "mul", "div",
+                                  "pow", "sin", "cos", "log", "sqrt"};
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instruction& ins = code[i];
+        out << "r" << i << " = " << names[(int)ins.op] << " ";
+        switch (ins.op) {
+            case Opcode::Const: out << consts[ins.a]; break;
+            case Opcode::Load: out << params[ins.a]; break;
+            case Opcode::Sin: case Opcode::Cos: case Opcode::Log: case Opcode::Sqrt:
+                out << "r" << ins.a; break;
+            default: out << "r" << ins.a << ", r" << ins.b; break;
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.h"
+
+// Flat, register-based form of an expression for the non-JIT tier. Every
+// instruction writes the register with its own index, so a program is a
+// single contiguous array evaluated front to back with no tree walking,
+// virtual calls or string compares. Calls to user functions are inlined.
+enum class Opcode : uint8_t {
+    Const,  // r[i] = consts[a]
+    Load,   // r[i] = args[a]
+    Add,    // r[i] = r[a] + r[b]
+    Sub,
+    Mul,
+    Div,
+    Pow,
+    Sin,    // r[i] = sin(r[a])
+    Cos,
+    Log,
+    Sqrt,
+};
+
+struct Instruction {
+    Opcode op;
+    uint32_t a;
+    uint32_t b;
+};
+
+class BytecodeProgram {
+public:
+    // Flatten the expression. Variables are resolved to indices into the
+    // argument array, in the order of getParams(). Registers are float at
+    // Precision::F32.
+    explicit BytecodeProgram(const ASTNode* node, Precision precision = Precision::F64);
+
+    const std::vector<std::string>& getParams() const { return params; }
+    size_t size() const { return code.size(); }
+
+    // Same contract as a JIT'd function: a domain error stores its DomainError
+    // code through status and returns NaN.
+    double run(const double* args, int* status) const;
+    // Gather args[i] = slots[bind[i]] (bind as from collectSlots) and run,
+    // throwing std::runtime_error with the interpreter's messages on a domain
+    // error.
+    double call(const double* slots, const std::vector<int>& bind) const;
+
+    void print(std::ostream& out) const;
+
+private:
+    uint32_t emit(const ASTNode* node);
+    uint32_t emitNode(const ASTNode* node);
+    template <typename T, bool RoundInputs>
+    double execute(const double* args, int* status) const;
+
+    std::vector<Instruction> code;
+    std::vector<double> consts;
+    std::vector<std::string> params;
+    Precision precision;
+    uint32_t result = 0;  // register holding the value
+    // While flattening the body of a called function: the registers holding
+    // its arguments, by parameter slot.
+    const std::vector<uint32_t>* frame = nullptr;
+    // While flattening: registers already holding an operator or function
+    // node's value, by structural hash, so repeated subexpressions are
+    // computed once.
+    std::unordered_map<uint64_t, std::vector<std::pair<const ASTNode*, uint32_t>>> emitted;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include "codegen.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+
+using namespace llvm;
+
+Type* ExprEmitter::valueTy() {
+    return f32 ? Type::getFloatTy(Context) : Type::getDoubleTy(Context);
+}
+
+Value* ExprEmitter::intrinsic(Intrinsic::ID id, ArrayRef<Value*> args, const Twine& name) {
+    return Builder.CreateCall(Intrinsic::getDeclaration(&M, id, {args[0]->getType()}), args, name);
+}
+
+void ExprEmitter::domainCheck(Value* cond, int code, const char* name) {
+    if (Errors) {
+        Value *Flag = Builder.CreateSelect(cond, Builder.getInt32(code), Builder.getInt32(0));
+        Errors = Builder.CreateOr(Errors, Flag, std::string(name) + ".err");
+        return;
+    }
+    Function *F = Builder.GetInsertBlock()->getParent();
+    BasicBlock *&Fail = failBlocks[code];
+    if (!Fail) {
+        IRBuilderBase::InsertPointGuard Guard(Builder);
+        Fail = BasicBlock::Create(Context, std::string(name) + ".fail", F);
+        Builder.SetInsertPoint(Fail);
+        Builder.CreateStore(Builder.getInt32(code), Status);
+        Builder.CreateRet(ConstantFP::getNaN(F->getReturnType()));
+    }
+    BasicBlock *Ok = BasicBlock::Create(Context, std::string(name) + ".ok", F);
+    Builder.CreateCondBr(cond, Fail, Ok);
+    Builder.SetInsertPoint(Ok);
+}
+
+Value* ExprEmitter::emitIntPow(Value* X, double n) {
+    if (n == 1) return X;
+    if (n == 2) return Builder.CreateFMul(X, X, "sqtmp");
+    if (n == -1) return Builder.CreateFDiv(ConstantFP::get(valueTy(), 1.0), X, "rcptmp");
+    Value *N = Builder.getInt32((int)n);
+    return Builder.CreateCall(
+        Intrinsic::getDeclaration(&M, Intrinsic::powi, {valueTy(), Builder.getInt32Ty()}),
+        {X, N}, "powitmp");
+}
+
+Function* ExprEmitter::emitFunction(const FunctionDef* def, const std::vector<Value*>& args,
+                                   const std::string& name) {
+    std::vector<Type*> paramTys;
+    for (Value* A : args)
+        if (!isa<ConstantFP>(A))
+            paramTys.push_back(valueTy());
+    paramTys.push_back(PointerType::getUnqual(Builder.getInt32Ty()));
+    Function *F = Function::Create(FunctionType::get(valueTy(), paramTys, false),
+                                   Function::InternalLinkage, name, M);
+    F->addFnAttr(Attribute::InlineHint);
+    F->addFnAttr(Attribute::NoUnwind);
+
+    IRBuilderBase::InsertPointGuard Guard(Builder);
+    Builder.SetInsertPoint(BasicBlock::Create(Context, "entry", F));
+    ExprEmitter body{Context, M, Builder, nullptr, {}, {}};
+    body.Errors = Builder.getInt32(0);
+    body.f32 = f32;
+    unsigned next = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (isa<ConstantFP>(args[i])) {
+            body.vars[def->params[i]] = args[i];
+        } else {
+            Argument *A = F->getArg(next++);
+            A->setName(def->params[i]);
+            body.vars[def->params[i]] = A;
+        }
+    }
+    Value *Result = body.emit(def->body.get());
+    Argument *Err = F->getArg(next);
+    Err->setName("err");
+    Builder.CreateStore(body.Errors, Err);
+    Builder.CreateRet(Result);
+    return F;
+}
+
+Value* ExprEmitter::emitCall(const FunctionDef* def, const std::vector<Value*>& args) {
+    // One function per definition, plus one per pattern of constant arguments.
+    std::string name = "fn." + def->name + "." + std::to_string(def->id) + (f32 ? ".f32" : "");
+    std::string spec;
+    std::vector<Value*> passed;
+    for (Value* A : args) {
+        if (auto *C = dyn_cast<ConstantFP>(A)) {
+            double v = f32 ? C->getValueAPF().convertToFloat() : C->getValueAPF().convertToDouble();
+            uint64_t bits;
+            std::memcpy(&bits, &v, sizeof bits);
+            char buf[24];
+            std::snprintf(buf, sizeof buf, ".%llx", (unsigned long long)bits);
+            spec += buf;
+        } else {
+            spec += "._";
+            passed.push_back(A);
+        }
+    }
+    if (passed.size() < args.size())
+        name += ".spec" + spec;
+    Function *Callee = M.getFunction(name);
+    if (!Callee)
+        Callee = emitFunction(def, args, name);
+
+    Function *F = Builder.GetInsertBlock()->getParent();
+    IRBuilder<> EntryBuilder(&F->getEntryBlock(), F->getEntryBlock().begin());
+    Value *Err = EntryBuilder.CreateAlloca(Builder.getInt32Ty(), nullptr, def->name + ".err.addr");
+    passed.push_back(Err);
+    Value *Result = Builder.CreateCall(Callee, passed, def->name + ".call");
+    Value *Code = Builder.CreateLoad(Builder.getInt32Ty(), Err, def->name + ".err");
+    if (Errors) {
+        Errors = Builder.CreateOr(Errors, Code);
+        return Result;
+    }
+    // The callee's code is not known here, so each call site gets its own
+    // exit rather than a shared fail block.
+    BasicBlock *Fail = BasicBlock::Create(Context, def->name + ".fail", F);
+    BasicBlock *Ok = BasicBlock::Create(Context, def->name + ".ok", F);
+    Builder.CreateCondBr(Builder.CreateICmpNE(Code, Builder.getInt32(0)), Fail, Ok);
+    Builder.SetInsertPoint(Fail);
+    Builder.CreateStore(Code, Status);
+    Builder.CreateRet(ConstantFP::getNaN(F->getReturnType()));
+    Builder.SetInsertPoint(Ok);
+    return Result;
+}
+
+Value* ExprEmitter::emit(const ASTNode* nd) {
+    if (dynamic_cast<const NumberNode*>(nd) || dynamic_cast<const VariableNode*>(nd))
+        return emitNode(nd);
+    auto& seen = emitted[nd->hash()];
+    for (const auto& e : seen)
+        if (sameStructure(e.first, nd))
+            return e.second;
+    Value *V = emitNode(nd);
+    seen.emplace_back(nd, V);
+    return V;
+}
+
+Value* ExprEmitter::emitNode(const ASTNode* nd) {
+    if (auto *num = dynamic_cast<const NumberNode*>(nd)) {
+        return ConstantFP::get(valueTy(), num->getValue());
+    }
+    if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        auto it = vars.find(var->getName());
+        if (it != vars.end())
+            return it->second;
+        // A variable defined by another formula: emit that formula once,
+        // where it is first needed.
+        if (definitions) {
+            auto def = definitions->find(var->getName());
+            if (def != definitions->end())
+                return vars[var->getName()] = emit(def->second);
+        }
+        throw std::runtime_error("Unbound variable in codegen: " + var->getName());
+    }
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd)) {
+        if (bin->op == '^') {
+            Value *L = emit(bin->left.get());
+            if (auto *exp = dynamic_cast<const NumberNode*>(bin->right.get())) {
+                double n = exp->getValue();
+                if (n == std::floor(n) && std::fabs(n) <= 16)
+                    return emitIntPow(L, n);
+            }
+            return intrinsic(Intrinsic::pow, {L, emit(bin->right.get())}, "powtmp");
+        }
+        Value *L = emit(bin->left.get());
+        Value *R = emit(bin->right.get());
+        switch (bin->op) {
+            case '+': return Builder.CreateFAdd(L, R, "addtmp");
+            case '-': return Builder.CreateFSub(L, R, "subtmp");
+            case '*': return Builder.CreateFMul(L, R, "multmp");
+            case '/':
+                domainCheck(Builder.CreateFCmpOEQ(R, ConstantFP::get(valueTy(), 0.0)),
+                            DivisionByZero, "div");
+                return Builder.CreateFDiv(L, R, "divtmp");
+            default: throw std::runtime_error("Unknown binary operator");
+        }
+    }
+    if (auto *func = dynamic_cast<const FunctionNode*>(nd)) {
+        Value *X = emit(func->getArg());
+        const std::string& name = func->getFunc();
+        Value *Zero = ConstantFP::get(valueTy(), 0.0);
+        if (name == "sin") return intrinsic(Intrinsic::sin, {X}, "sintmp");
+        if (name == "cos") return intrinsic(Intrinsic::cos, {X}, "costmp");
+        if (name == "log") {
+            domainCheck(Builder.CreateFCmpOLE(X, Zero), LogOfNonPositive, "log");
+            return intrinsic(Intrinsic::log, {X}, "logtmp");
+        }
+        if (name == "sqrt") {
+            domainCheck(Builder.CreateFCmpOLT(X, Zero), SqrtOfNegative, "sqrt");
+            return intrinsic(Intrinsic::sqrt, {X}, "sqrttmp");
+        }
+        throw std::runtime_error("Unknown function: " + name);
+    }
+    if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<Value*> args;
+        for (const ASTNodePtr& arg : call->getArgs())
+            args.push_back(emit(arg.get()));
+        return emitCall(call->getDef(), args);
+    }
+    if (auto *red = dynamic_cast<const ReductionNode*>(nd))
+        throw std::runtime_error(std::string(ReductionNode::kindName(red->getKind())) +
+                                 "() runs only over columns");
+    throw std::runtime_error("Unknown AST node in codegen");
+}
+
+void runOptimizationPipeline(Module& M, TargetMachine* TM, int level, VectorLibrary lib) {
+    if (level <= 0)
+        return;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    // Registered ahead of the defaults, which then leave it in place.
+    TargetLibraryInfoImpl TLII(TM ? TM->getTargetTriple() : Triple(M.getTargetTriple()));
+    if (lib == VectorLibrary::LibMVec) {
+        TLII.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+        FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+    }
+    PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    const OptimizationLevel* levels[] = {&OptimizationLevel::O0, &OptimizationLevel::O1,
+                                         &OptimizationLevel::O2, &OptimizationLevel::O3};
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(*levels[std::min(level, 3)]);
+    MPM.run(M, MAM);
+}
@@ -0,0 +1,80 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include "ast.h"
+
+namespace llvm {
+class TargetMachine;
+}
+
+// Lowers an expression tree into the body of the function being built; used
+// by the JIT and the ahead-of-time compiler. Variables are read from the
+// values bound in vars or, failing that, emitted from their formula in
+// definitions. In scalar code domain errors branch to a block that stores the
+// error code through Status and returns NaN. When Errors is set instead (batch
+// loops), the codes are OR'ed into it without branching and the offending row
+// just produces NaN/inf.
+//
+// With f32 set, values are float (Precision::F32); vars must then be float
+// too, and the caller widens the result.
+//
+// A call to a user function becomes a call to an internal, inline-hinted
+// function of M, emitted on first use. Constant arguments are folded into a
+// specialized copy of the function for that combination of constants.
+struct ExprEmitter {
+    llvm::LLVMContext& Context;
+    llvm::Module& M;
+    llvm::IRBuilder<>& Builder;
+    llvm::Value* Status;
+    std::unordered_map<std::string, llvm::Value*> vars;
+    std::unordered_map<int, llvm::BasicBlock*> failBlocks;
+    llvm::Value* Errors = nullptr;
+    // Variables that stand for other formulas rather than arguments.
+    const std::unordered_map<std::string, const ASTNode*>* definitions = nullptr;
+    // Values already emitted for operator and function nodes, by structural
+    // hash, so a repeated subexpression is computed once. All code is straight
+    // line apart from the exits to fail blocks, so every earlier value
+    // dominates the rest of the function.
+    std::unordered_map<uint64_t, std::vector<std::pair<const ASTNode*, llvm::Value*>>> emitted;
+    bool f32 = false;
+
+    llvm::Value* emit(const ASTNode* nd);
+
+    // Helpers for emit().
+    llvm::Value* emitNode(const ASTNode* nd);
+    llvm::Type* valueTy();  // double, or float when f32
+    // The math intrinsics used here are all overloaded on their operand type,
+    // so they lower to the float versions (sinf, powf, ...) when f32.
+    llvm::Value* intrinsic(llvm::Intrinsic::ID id, llvm::ArrayRef<llvm::Value*> args,
+                           const llvm::Twine& name);
+    // Continue in a fresh block when cond is false; otherwise report code.
+    void domainCheck(llvm::Value* cond, int code, const char* name);
+    // x^n for an integral constant n. x^2 as x*x is exact; other small
+    // exponents go through llvm.powi, which may differ from pow in the last ulp.
+    llvm::Value* emitIntPow(llvm::Value* X, double n);
+    // T fn(params..., i32* err), T the value type: the body of def with the parameters
+    // whose argument is a constant replaced by it. Domain errors are stored
+    // through err (0 if none) instead of returning early.
+    llvm::Function* emitFunction(const FunctionDef* def, const std::vector<llvm::Value*>& args,
+                                 const std::string& name);
+    llvm::Value* emitCall(const FunctionDef* def, const std::vector<llvm::Value*>& args);
+};
+
+// Vector math library the loop vectorizer may call for sin, cos, log and pow.
+// glibc's libmvec (x86-64 only) is accurate to 4 ulp, against libm's 1.
+enum class VectorLibrary { None, LibMVec };
+
+// Run the new-PM default pipeline for level (nothing at 0), tuned for TM.
+// Beyond -O1 this includes instcombine, reassociate, GVN and the loop and SLP
+// vectorizers, which with lib can vectorize loops calling the math intrinsics.
+void runOptimizationPipeline(llvm::Module& M, llvm::TargetMachine* TM, int level,
+                             VectorLibrary lib = VectorLibrary::None);
+
+#endif
@@ -0,0 +1,207 @@
+#include "diff.h"
+#include "simplify.h"
+#include <stdexcept>
+#include <unordered_map>
+
+const char* adModeName(ADMode mode) {
+    return mode == ADMode::Forward ? "forward" : "reverse";
+}
+
+namespace {
+bool dependsOn(const ASTNode* nd, const std::string& var) {
+    std::vector<std::string> vars;
+    collectVariables(nd, vars);
+    for (const std::string& v : vars)
+        if (v == var)
+            return true;
+    return false;
+}
+
+bool hasVariables(const ASTNode* nd) {
+    std::vector<std::string> vars;
+    collectVariables(nd, vars);
+    return !vars.empty();
+}
+
+// Tree builders. A null operand stands for 1 in mul/div numerators, which is
+// how an unscaled adjoint or a derivative of exactly 1 is represented.
+struct Builder {
+    Arena& arena;
+
+    ASTNodePtr num(double v) { return ASTNodePtr(arena.make<NumberNode>(v)); }
+    ASTNodePtr copy(const ASTNode* n) { return cloneAST(n, arena); }
+    ASTNodePtr bin(char op, ASTNodePtr a, ASTNodePtr b) {
+        return ASTNodePtr(arena.make<BinaryOpNode>(op, std::move(a), std::move(b)));
+    }
+    ASTNodePtr fn(const char* f, ASTNodePtr a) {
+        return ASTNodePtr(arena.make<FunctionNode>(f, std::move(a)));
+    }
+
+    ASTNodePtr mul(ASTNodePtr a, ASTNodePtr b) {
+        if (!a) return b;
+        if (!b) return a;
+        return bin('*', std::move(a), std::move(b));
+    }
+    ASTNodePtr div(ASTNodePtr a, ASTNodePtr b) { return bin('/', a ? std::move(a) : num(1), std::move(b)); }
+    ASTNodePtr neg(ASTNodePtr a) { return a ? bin('-', num(0), std::move(a)) : num(-1); }
+    ASTNodePtr one(ASTNodePtr a) { return a ? std::move(a) : num(1); }
+
+    // Local partial of the primal a^b with respect to a: b * a^(b-1).
+    ASTNodePtr powBase(const BinaryOpNode* p) {
+        if (auto *n = dynamic_cast<const NumberNode*>(p->right.get())) {
+            double e = n->getValue();
+            if (e == 2)
+                return bin('*', num(2), copy(p->left.get()));
+            return bin('*', num(e), bin('^', copy(p->left.get()), num(e - 1)));
+        }
+        return bin('*', copy(p->right.get()),
+                   bin('^', copy(p->left.get()), bin('-', copy(p->right.get()), num(1))));
+    }
+    // With respect to b: a^b * log(a).
+    ASTNodePtr powExponent(const BinaryOpNode* p) {
+        return bin('*', copy(p), fn("log", copy(p->left.get())));
+    }
+};
+
+// Forward mode: the tangent of nd, or null when it is identically zero.
+struct Forward : Builder {
+    const std::string& var;
+
+    ASTNodePtr run(const ASTNode* nd) {
+        if (!dependsOn(nd, var))
+            return nullptr;
+        if (dynamic_cast<const VariableNode*>(nd))
+            return num(1);
+        if (auto *b = dynamic_cast<const BinaryOpNode*>(nd)) {
+            const ASTNode *l = b->left.get(), *r = b->right.get();
+            ASTNodePtr dl = run(l), dr = run(r);
+            switch (b->op) {
+                case '+':
+                    if (!dl) return dr;
+                    if (!dr) return dl;
+                    return bin('+', std::move(dl), std::move(dr));
+                case '-':
+                    if (!dr) return dl;
+                    if (!dl) return neg(std::move(dr));
+                    return bin('-', std::move(dl), std::move(dr));
+                case '*': {
+                    ASTNodePtr t1 = dl ? bin('*', std::move(dl), copy(r)) : nullptr;
+                    ASTNodePtr t2 = dr ? bin('*', copy(l), std::move(dr)) : nullptr;
+                    if (!t1) return t2;
+                    if (!t2) return t1;
+                    return bin('+', std::move(t1), std::move(t2));
+                }
+                case '/': {
+                    // (dl - (l/r)*dr) / r, reusing the primal l/r.
+                    ASTNodePtr t2 = dr ? bin('*', copy(b), std::move(dr)) : nullptr;
+                    if (!t2) return bin('/', std::move(dl), copy(r));
+                    ASTNodePtr num_ = dl ? bin('-', std::move(dl), std::move(t2)) : neg(std::move(t2));
+                    return bin('/', std::move(num_), copy(r));
+                }
+                case '^': {
+                    ASTNodePtr t1 = dl ? mul(powBase(b), std::move(dl)) : nullptr;
+                    ASTNodePtr t2 = dr ? mul(powExponent(b), std::move(dr)) : nullptr;
+                    if (!t1) return t2;
+                    if (!t2) return t1;
+                    return bin('+', std::move(t1), std::move(t2));
+                }
+            }
+            throw std::runtime_error("Unknown operator");
+        }
+        if (auto *f = dynamic_cast<const FunctionNode*>(nd)) {
+            const ASTNode *a = f->getArg();
+            ASTNodePtr da = run(a);
+            const std::string& name = f->getFunc();
+            if (name == "sin") return mul(fn("cos", copy(a)), std::move(da));
+            if (name == "cos") return mul(neg(fn("sin", copy(a))), std::move(da));
+            if (name == "log") return div(std::move(da), copy(a));
+            if (name == "sqrt") return div(std::move(da), bin('*', num(2), copy(f)));
+            throw std::runtime_error("Cannot differentiate " + name);
+        }
+        if (auto *call = dynamic_cast<const CallNode*>(nd))
+            return run(inlineCall(call, arena).get());
+        throw std::runtime_error("Unknown AST node");
+    }
+};
+
+// Reverse mode: push the adjoint of nd (null meaning 1) down to its operands
+// and sum what arrives at each variable.
+struct Reverse : Builder {
+    std::unordered_map<std::string, ASTNodePtr> grads;
+
+    void run(const ASTNode* nd, ASTNodePtr adj) {
+        if (!hasVariables(nd))
+            return;
+        auto share = [&]() { return adj ? copy(adj.get()) : nullptr; };
+        if (auto *v = dynamic_cast<const VariableNode*>(nd)) {
+            ASTNodePtr& g = grads[v->getName()];
+            g = g ? bin('+', std::move(g), one(std::move(adj))) : one(std::move(adj));
+            return;
+        }
+        if (auto *b = dynamic_cast<const BinaryOpNode*>(nd)) {
+            const ASTNode *l = b->left.get(), *r = b->right.get();
+            switch (b->op) {
+                case '+':
+                    run(l, share());
+                    run(r, std::move(adj));
+                    return;
+                case '-':
+                    run(l, share());
+                    run(r, neg(std::move(adj)));
+                    return;
+                case '*':
+                    if (hasVariables(l)) run(l, mul(share(), copy(r)));
+                    run(r, mul(std::move(adj), copy(l)));
+                    return;
+                case '/':
+                    if (hasVariables(r)) run(r, neg(mul(share(), bin('/', copy(b), copy(r)))));
+                    run(l, div(std::move(adj), copy(r)));
+                    return;
+                case '^':
+                    if (hasVariables(r)) run(r, mul(share(), powExponent(b)));
+                    run(l, mul(std::move(adj), powBase(b)));
+                    return;
+            }
+            throw std::runtime_error("Unknown operator");
+        }
+        if (auto *f = dynamic_cast<const FunctionNode*>(nd)) {
+            const ASTNode *a = f->getArg();
+            const std::string& name = f->getFunc();
+            if (name == "sin") run(a, mul(std::move(adj), fn("cos", copy(a))));
+            else if (name == "cos") run(a, mul(std::move(adj), neg(fn("sin", copy(a)))));
+            else if (name == "log") run(a, div(std::move(adj), copy(a)));
+            else if (name == "sqrt") run(a, div(std::move(adj), bin('*', num(2), copy(f))));
+            else throw std::runtime_error("Cannot differentiate " + name);
+            return;
+        }
+        if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+            run(inlineCall(call, arena).get(), std::move(adj));
+            return;
+        }
+        throw std::runtime_error("Unknown AST node");
+    }
+};
+}
+
+ASTNodePtr differentiate(const ASTNode* node, const std::string& var, Arena& arena) {
+    Forward fwd{{arena}, var};
+    ASTNodePtr d = fwd.run(node);
+    return d ? std::move(d) : fwd.num(0);
+}
+
+std::vector<ASTNodePtr> gradient(const ASTNode* node, const std::vector<std::string>& vars,
+                                 Arena& arena, ADMode mode) {
+    std::vector<ASTNodePtr> out;
+    if (mode == ADMode::Forward) {
+        for (const std::string& v : vars)
+            out.push_back(differentiate(node, v, arena));
+        return out;
+    }
+    Reverse rev{{arena}, {}};
+    rev.run(node, nullptr);
+    for (const std::string& v : vars) {
+        auto it = rev.grads.find(v);
+        out.push_back(it != rev.grads.end() ? std::move(it->second) : rev.num(0));
+    }
+    return out;
+}
@@ -0,0 +1,33 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "ast.h"
+
+// Automatic differentiation by rewriting the AST. Derivatives are ordinary
+// expression trees over the same variables, so every tier can run them; the
+// JIT compiles a formula and its gradient into one function where CSE computes
+// the shared subexpressions once (JITSession::compileGradient).
+//
+// Terms known to be zero are dropped while differentiating rather than built
+// and folded away, so d/dx (x*y) is y rather than 1*y + x*0. Calls to user
+// functions are differentiated through their inlined bodies.
+enum class ADMode {
+    Forward,  // one derivative tree per variable
+    Reverse,  // one backward sweep: adjoints flow from the root to the leaves
+};
+
+const char* adModeName(ADMode mode);
+
+// d node / d var as a new tree in arena; a 0 constant if node does not depend
+// on var.
+ASTNodePtr differentiate(const ASTNode* node, const std::string& var, Arena& arena);
+
+// The partial derivatives of node with respect to each of vars, in that order.
+// Both modes give the same trees up to the order of sums.
+std::vector<ASTNodePtr> gradient(const ASTNode* node, const std::vector<std::string>& vars,
+                                 Arena& arena, ADMode mode);
+
+#endif
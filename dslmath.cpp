@@ -0,0 +1,194 @@
+#include "dslmath.h"
+#include <stdexcept>
+#include "script.h"
+#include "simplify.h"
+#include "tiering.h"
+
+struct Formula::Tree {
+    Arena arena{256};
+    ASTNodePtr root;
+};
+
+// Runs a Session's statements: on the tiered evaluator for plain statements
+// and the shared JIT for the rest. While compile() is parsing, the expression
+// statement is captured instead of run.
+class Session::Host : public ScriptHost {
+public:
+    explicit Host(JITSession& jit) : jit(jit), tiered(jit) {}
+
+    double evaluate(Script& script, ASTNode* node) override {
+        ASTNodePtr simplified = prepare(script, node);
+        return tiered.evaluate(simplified.get(), script.symbols());
+    }
+
+    double gradient(Script& script, ASTNode* node,
+                    std::vector<std::pair<std::string, double>>& partials) override {
+        ASTNodePtr simplified = prepare(script, node);
+        GradientFunctionPtr fn = jit.compileGradient(simplified.get(), ADMode::Reverse);
+        std::vector<int> bind;
+        collectSlots(simplified.get(), bind);
+        std::vector<double> grad(bind.size());
+        double result = fn->call(script.symbols().values(), bind, grad.data());
+        partials.clear();
+        for (size_t i = 0; i < grad.size(); ++i)
+            partials.emplace_back(fn->getParams()[i], grad[i]);
+        return result;
+    }
+
+    // As the interpreter's solve statement.
+    double solve(Script& script, ASTNode* residual, const std::string& var,
+                 ASTNode* lo, ASTNode* hi) override {
+        if (capture)
+            throw std::runtime_error("Expected a single expression");
+        SymbolTable& symbols = script.symbols();
+        double bracketLo = 0, bracketHi = 0;
+        if (lo) {
+            bracketLo = evaluate(script, lo);
+            bracketHi = evaluate(script, hi);
+            if (!(bracketLo < bracketHi))
+                throw std::runtime_error("Empty bracket for " + var);
+        }
+        int s = symbols.slot(var);
+        if (!symbols.isDefined(s))
+            symbols.set(s, lo ? (bracketLo + bracketHi) / 2 : 1);
+        ASTNodePtr simplified = prepare(script, residual);
+        SolverFunctionPtr fn = jit.compileSolver(simplified.get(), var);
+        std::vector<int> bind;
+        collectSlots(simplified.get(), bind);
+        double root = fn->call(symbols.values(), bind, bracketLo, bracketHi);
+        symbols.set(s, root);
+        return root;
+    }
+
+    void defineFunction(Script& script, const std::string& name,
+                        const std::vector<std::string>& params, ASTNode* body) override {
+        ASTNodePtr simplified = simplify(body, script.arena(), jit.getFastMath());
+        script.functions().define(name, params, simplified.get());
+    }
+
+    bool compileStatement(Script& script, const char* name, ASTNode* node) override {
+        if (!capture)
+            return false;
+        if (name || *capture)
+            script.err() << "Error: Expected a single expression\n";
+        else
+            *capture = simplify(node, *captureArena, jit.getFastMath());
+        return true;
+    }
+
+    void runDirective(Script& script, const char* text) override {
+        script.err() << "Error: Directives are not supported in a session: " << text << "\n";
+    }
+
+    ASTNodePtr* capture = nullptr;
+    Arena* captureArena = nullptr;
+
+private:
+    ASTNodePtr prepare(Script& script, ASTNode* node) {
+        resolveSlots(node, script.symbols());
+        return simplify(node, script.arena(), jit.getFastMath());
+    }
+
+    JITSession& jit;
+    TieredEvaluator tiered;
+};
+
+double Formula::eval(const double* args) const {
+    int status = 0;
+    double result = (*fn)(args, &status);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+    return result;
+}
+
+double Formula::eval(const std::vector<double>& args) const {
+    if (args.size() != params().size())
+        throw std::runtime_error("Expected " + std::to_string(params().size()) + " arguments, got " +
+                                 std::to_string(args.size()));
+    return eval(args.data());
+}
+
+double Formula::eval() const {
+    const SymbolTable& symbols = session->symbols;
+    for (size_t i = 0; i < bind.size(); ++i)
+        if (!symbols.isDefined(bind[i]))
+            throw std::runtime_error("Undefined variable: " + params()[i]);
+    return fn->call(symbols.values(), bind);
+}
+
+// As evaluateBatch, at the formula's precision.
+void Formula::eval(const std::vector<Column>& columns, double* out, size_t rows) const {
+    BatchKernelPtr kernel = session->jitSession.compileBatch(tree->root.get(), columns, prec);
+    std::vector<const void*> inputs = kernel->bind(columns);
+    int status = (*kernel)(inputs.data(), out, 0, (int64_t)rows);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+}
+
+JITSession& Session::sharedJIT() {
+    static JITSession jit;
+    return jit;
+}
+
+Session::Session() : Session(sharedJIT()) {}
+
+Session::Session(JITSession& jit) : jitSession(jit), host(new Host(jit)) {}
+
+Session::~Session() = default;
+
+// Parse text as a complete script over this session's tables, throwing the
+// first error reported.
+void Session::parse(const std::string& text) {
+    errors.str("");
+    Script script(*host, symbols, functions, output, errors);
+    script.feed(text.data(), text.size());
+    bool parsed = script.finish();
+    output.str("");
+    std::string message = errors.str();
+    if (message.empty() && !parsed)
+        message = "Parse error";
+    if (message.empty())
+        return;
+    message = message.substr(0, message.find('\n'));
+    if (message.compare(0, 7, "Error: ") == 0)
+        message.erase(0, 7);
+    throw std::runtime_error(message);
+}
+
+void Session::run(const std::string& statements) {
+    parse(statements + "\n");
+}
+
+Formula Session::compile(const std::string& expression) {
+    auto tree = std::make_shared<Formula::Tree>();
+    host->capture = &tree->root;
+    host->captureArena = &tree->arena;
+    try {
+        parse(expression + ";");
+    } catch (...) {
+        host->capture = nullptr;
+        throw;
+    }
+    host->capture = nullptr;
+    if (!tree->root)
+        throw std::runtime_error("Expected an expression");
+    Formula formula;
+    formula.session = this;
+    formula.fn = jitSession.compile(tree->root.get(), optLevel, precision);
+    formula.prec = precision;
+    for (const std::string& p : formula.params())
+        formula.bind.push_back(symbols.slot(p));
+    formula.tree = std::move(tree);
+    return formula;
+}
+
+void Session::set(const std::string& name, double value) {
+    symbols.set(symbols.slot(name), value);
+}
+
+double Session::get(const std::string& name) const {
+    int s = symbols.find(name);
+    if (s < 0 || !symbols.isDefined(s))
+        throw std::runtime_error("Undefined variable: " + name);
+    return symbols.get(s);
+}
@@ -0,0 +1,99 @@
+#ifndef DSLMATH_H
+#define DSLMATH_H
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "batch.h"
+#include "functions.h"
+#include "jit.h"
+
+// Embedding API, built as libdslmath. A Session is one client's variables and
+// functions; compile() turns an expression into a Formula that can be run
+// many times. Every Session normally shares one JITSession, so a formula is
+// compiled once per process however many sessions use it.
+
+class Session;
+
+// A compiled expression. Copies share the code. The eval overloads taking
+// arguments only read the formula, so any number of threads may call them at
+// once. A Formula must not outlive its Session.
+class Formula {
+public:
+    // The expression's free variables, in argument order.
+    const std::vector<std::string>& params() const { return fn->getParams(); }
+
+    // args[i] is the value of params()[i]. Domain errors throw
+    // std::runtime_error, with the interpreter's messages.
+    double eval(const double* args) const;
+    double eval(const std::vector<double>& args) const;
+    // With the values currently assigned in the session.
+    double eval() const;
+    // Every row of columns, matched to params() by name, as evaluateBatch.
+    void eval(const std::vector<Column>& columns, double* out, size_t rows) const;
+
+    Precision precision() const { return prec; }
+
+private:
+    friend class Session;
+    struct Tree;  // the simplified expression, for batch kernels
+
+    Session* session = nullptr;
+    std::shared_ptr<const Tree> tree;
+    CompiledFunctionPtr fn;
+    std::vector<int> bind;  // params() as slots of the session's symbols
+    Precision prec = Precision::F64;
+};
+
+// One client's state. A Session is used by one thread at a time; the JIT
+// behind it is shared and thread-safe.
+class Session {
+public:
+    // Use the process-wide JIT returned by sharedJIT().
+    Session();
+    explicit Session(JITSession& jit);
+    ~Session();
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Run statements (var, func, grad, solve, expressions) against this
+    // session. The first error is thrown as std::runtime_error once they have
+    // all been tried.
+    void run(const std::string& statements);
+    // Compile an expression over the session's functions. Its variables need
+    // not exist yet.
+    Formula compile(const std::string& expression);
+
+    void set(const std::string& name, double value);
+    // Throws if name has not been assigned.
+    double get(const std::string& name) const;
+
+    // Optimization level of formulas compiled from now on (default 2).
+    void setOptLevel(int level) { optLevel = level; }
+    // Precision of formulas compiled from now on (default F64). Statements
+    // passed to run() use the JIT's.
+    void setPrecision(Precision p) { precision = p; }
+    JITSession& jit() { return jitSession; }
+
+    // Created on first use and kept for the life of the process.
+    static JITSession& sharedJIT();
+
+private:
+    class Host;
+    friend class Formula;
+
+    void parse(const std::string& text);
+
+    JITSession& jitSession;
+    SymbolTable symbols;
+    FunctionTable functions;
+    std::unique_ptr<Host> host;
+    std::ostringstream output;  // statement results, discarded
+    std::ostringstream errors;
+    int optLevel = 2;
+    Precision precision = Precision::F64;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#include "functions.h"
+#include "simplify.h"
+#include <atomic>
+#include <stdexcept>
+
+const FunctionDef* FunctionTable::define(const std::string& name,
+                                         const std::vector<std::string>& params,
+                                         const ASTNode* body) {
+    // Parameters take slots 0..n-1 of a frame; resolving the body against
+    // them also rejects any other variable.
+    SymbolTable frame;
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (frame.find(params[i]) >= 0)
+            throw std::runtime_error("Repeated parameter " + params[i] + " in function " + name);
+        frame.set(frame.slot(params[i]), 0);
+    }
+    ASTNodePtr copy = cloneAST(body, arena);
+    try {
+        resolveSlots(copy.get(), frame);
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(std::string(e.what()) + " in function " + name);
+    }
+    // Ids are unique in the process: tables of different sessions share the
+    // JIT's cache, which tells calls apart by name and id.
+    static std::atomic<unsigned> nextId{0};
+    defs.push_back(FunctionDef{name, params, std::move(copy), nextId++});
+    return byName[name] = &defs.back();
+}
+
+const FunctionDef* FunctionTable::find(const std::string& name) const {
+    auto it = byName.find(name);
+    return it == byName.end() ? nullptr : it->second;
+}
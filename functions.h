@@ -0,0 +1,30 @@
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "arena.h"
+#include "ast.h"
+
+// The script's user functions, by name. A call node points at the definition
+// that was current when it was parsed, so redefining a function never changes
+// formulas already written against the old one; all definitions live until
+// the table goes.
+class FunctionTable {
+public:
+    // Copy body into the table. Throws std::runtime_error if a parameter is
+    // repeated or the body uses a variable that is not a parameter.
+    const FunctionDef* define(const std::string& name, const std::vector<std::string>& params,
+                              const ASTNode* body);
+    // Current definition of name, or null.
+    const FunctionDef* find(const std::string& name) const;
+
+private:
+    Arena arena;
+    std::deque<FunctionDef> defs;
+    std::unordered_map<std::string, const FunctionDef*> byName;
+};
+
+#endif
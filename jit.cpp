@@ -0,0 +1,1146 @@
+#include "jit.h"
+#include "codegen.h"
+#include "objcache.h"
+#include "perfmap.h"
+#include "simplify.h"
+#include "stats.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double elapsedUs(Clock::time_point since) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - since).count();
+}
+
+// Turn an ORC error into the runtime_error the rest of the interpreter reports.
+void check(Error Err, const char* what) {
+    if (Err)
+        throw std::runtime_error(std::string(what) + ": " + toString(std::move(Err)));
+}
+
+template <typename T>
+T check(Expected<T> Val, const char* what) {
+    if (!Val)
+        throw std::runtime_error(std::string(what) + ": " + toString(Val.takeError()));
+    return std::move(*Val);
+}
+
+long long elapsedNs(Clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count();
+}
+
+// This thread's last statement timing, and its lazy optimize/compile totals.
+thread_local StatementTiming threadTiming;
+thread_local long long threadOptimizeNs = 0;
+thread_local long long threadNativeNs = 0;
+
+// Wraps the JIT's IR compiler to account for the time spent emitting objects.
+class TimedCompiler : public IRCompileLayer::IRCompiler {
+public:
+    explicit TimedCompiler(std::unique_ptr<IRCompiler> Inner)
+        : IRCompiler(Inner->getManglingOptions()), Inner(std::move(Inner)) {}
+
+    Expected<std::unique_ptr<MemoryBuffer>> operator()(Module& M) override {
+        auto Start = Clock::now();
+        auto Obj = (*Inner)(M);
+        long long ns = elapsedNs(Start);
+        threadNativeNs += ns;
+        statTime(Phase::Native, ns);
+        if (Obj)
+            statAdd(Counter::ObjectBytes, (*Obj)->getBufferSize());
+        return Obj;
+    }
+
+private:
+    std::unique_ptr<IRCompiler> Inner;
+};
+
+std::string formulaText(const ASTNode* node) {
+    std::string text;
+    appendFormulaText(node, text);
+    return text;
+}
+
+// Function attribute carrying the -O level a formula was compiled under, so the
+// lazily run transform uses that level even if it has changed since.
+const char* OptLevelAttr = "dsl-opt-level";
+
+}
+
+JITCode::JITCode(std::vector<std::string> params, ResourceTrackerSP tracker)
+    : params(std::move(params)), tracker(std::move(tracker)) {}
+
+JITCode::~JITCode() {
+    if (tracker)
+        consumeError(tracker->remove());
+}
+
+CompiledFunction::CompiledFunction(EntryPoint fn, std::vector<std::string> params,
+                                   ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn) {}
+
+GradientFunction::GradientFunction(EntryPoint fn, std::vector<std::string> params,
+                                   ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn) {}
+
+SolverFunction::SolverFunction(EntryPoint fn, std::vector<std::string> params, size_t unknown,
+                               ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn), unknown(unknown) {}
+
+BatchKernel::BatchKernel(EntryPoint fn, std::vector<std::string> params,
+                         std::vector<ColumnType> types, ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn), types(std::move(types)) {}
+
+SweepKernel::SweepKernel(EntryPoint fn, std::vector<std::string> params, ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn) {}
+
+ReductionKernel::ReductionKernel(EntryPoint fn, std::vector<std::string> params,
+                                 std::vector<std::string> columns, std::vector<ColumnType> types,
+                                 ResourceTrackerSP tracker)
+    : JITCode(std::move(params), std::move(tracker)), fn(fn), columns(std::move(columns)),
+      types(std::move(types)) {}
+
+// The data of the column named names[i], checked against types[i].
+static std::vector<const void*> bindColumns(const std::vector<std::string>& names,
+                                            const std::vector<ColumnType>& types,
+                                            const std::vector<Column>& columns) {
+    std::vector<const void*> inputs;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const Column& found = findColumn(columns, names[i]);
+        if (found.type != types[i])
+            throw std::runtime_error("Column type changed since compilation: " + names[i]);
+        inputs.push_back(found.data);
+    }
+    return inputs;
+}
+
+std::vector<const void*> BatchKernel::bind(const std::vector<Column>& columns) const {
+    return bindColumns(params, types, columns);
+}
+
+std::vector<const void*> ReductionKernel::bind(const std::vector<Column>& inputs) const {
+    return bindColumns(columns, types, inputs);
+}
+
+double CompiledFunction::call(const double* slots, const std::vector<int>& bind) const {
+    double small[16];
+    std::vector<double> large;
+    double* args = small;
+    if (bind.size() > 16) {
+        large.resize(bind.size());
+        args = large.data();
+    }
+    for (size_t i = 0; i < bind.size(); ++i)
+        args[i] = slots[bind[i]];
+    int status = 0;
+    double result = fn(args, &status);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+    return result;
+}
+
+double GradientFunction::call(const double* slots, const std::vector<int>& bind,
+                              double* grad) const {
+    std::vector<double> args(bind.size());
+    for (size_t i = 0; i < bind.size(); ++i)
+        args[i] = slots[bind[i]];
+    int status = 0;
+    double result = fn(args.data(), grad, &status);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+    return result;
+}
+
+double SolverFunction::call(const double* slots, const std::vector<int>& bind,
+                            double lo, double hi) const {
+    std::vector<double> args(bind.size());
+    for (size_t i = 0; i < bind.size(); ++i)
+        args[i] = slots[bind[i]];
+    int status = 0;
+    double root = fn(args.data(), lo, hi, &status);
+    if (status)
+        throw std::runtime_error(domainErrorMessage(status));
+    return root;
+}
+
+JITSession::JITSession() : TSCtx(std::make_unique<ThreadSafeContext>(std::make_unique<LLVMContext>())) {}
+
+// Compiled functions hold resource trackers into the JIT, so release them first.
+JITSession::~JITSession() {
+    cache.clear();
+}
+
+// The JIT is built on the first statement so that its cost shows up in that
+// statement's timing instead of being hidden in startup.
+void JITSession::createJIT() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    auto JTMB = check(JITTargetMachineBuilder::detectHost(), "JIT initialization failed");
+    JTMB.setCodeGenOptLevel(optLevel == 0 ? CodeGenOpt::None
+                            : optLevel == 1 ? CodeGenOpt::Less
+                            : optLevel == 2 ? CodeGenOpt::Default
+                            : CodeGenOpt::Aggressive);
+    OptTM = check(JTMB.createTargetMachine(), "JIT initialization failed");
+    if (objectCache)
+        objectCache->setTarget(JTMB.getTargetTriple().str() + " " + JTMB.getCPU() + " "
+                               + JTMB.getFeatures().getString() + " O" + std::to_string(optLevel)
+                               + (vectorLibrary == VectorLibrary::LibMVec ? " libmvec" : ""));
+    J = check(LLLazyJITBuilder()
+                  .setJITTargetMachineBuilder(JTMB)
+                  .setCompileFunctionCreator(
+                      [this](JITTargetMachineBuilder JTMB)
+                          -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+                          auto TM = JTMB.createTargetMachine();
+                          if (!TM)
+                              return TM.takeError();
+                          return std::make_unique<TimedCompiler>(
+                              std::make_unique<TMOwningSimpleCompiler>(std::move(*TM), objectCache));
+                      })
+                  .create(),
+              "JIT initialization failed");
+    J->getIRTransformLayer().setTransform(
+        [this](ThreadSafeModule TSM, MaterializationResponsibility&) -> Expected<ThreadSafeModule> {
+            TSM.withModuleDo([this](Module& M) {
+                // A cached object replaces the compiled module; skip optimizing it.
+                if (!objectCache || !objectCache->tag(M))
+                    optimize(M);
+            });
+            return std::move(TSM);
+        });
+    if (!eventListeners.empty()) {
+        auto* Linker = dyn_cast<RTDyldObjectLinkingLayer>(&J->getObjLinkingLayer());
+        if (!Linker)
+            throw std::runtime_error("JIT event listeners need the RuntimeDyld linker");
+        for (JITEventListener* Listener : eventListeners)
+            Linker->registerJITEventListener(*Listener);
+    }
+    // Let JIT'd code resolve libm and other host symbols.
+    J->getMainJITDylib().addGenerator(check(
+        DynamicLibrarySearchGenerator::GetForCurrentProcess(J->getDataLayout().getGlobalPrefix()),
+        "JIT initialization failed"));
+}
+
+void JITSession::setObjectCache(DiskObjectCache* cache) {
+    if (J)
+        throw std::runtime_error("Object cache must be set before compiling");
+    objectCache = cache;
+}
+
+void JITSession::addEventListener(JITEventListener* listener) {
+    if (J)
+        throw std::runtime_error("JIT event listeners must be added before compiling");
+    eventListeners.push_back(listener);
+}
+
+void JITSession::setPerfMap(PerfMapListener* map) {
+    addEventListener(map);
+    perfMap = map;
+}
+
+void JITSession::setVectorLibrary(VectorLibrary lib) {
+    if (J)
+        throw std::runtime_error("Vector library must be set before compiling");
+    // The JIT resolves the vector functions among the process's symbols.
+    std::string error;
+    if (lib == VectorLibrary::LibMVec &&
+        sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1", &error))
+        throw std::runtime_error("Cannot load libmvec: " + error);
+    vectorLibrary = lib;
+}
+
+void JITSession::setOptLevel(int level) {
+    if (level < 0 || level > 3)
+        throw std::runtime_error("Optimization level must be 0-3");
+    optLevel = level;
+}
+
+// Run the default pipeline for the level recorded on the module's functions.
+void JITSession::optimize(Module& M) {
+    auto Start = Clock::now();
+    int level = 0;
+    for (Function& F : M)
+        if (F.hasFnAttribute(OptLevelAttr))
+            F.getFnAttribute(OptLevelAttr).getValueAsString().getAsInteger(10, level);
+    runOptimizationPipeline(M, OptTM.get(), level, vectorLibrary);
+    long long ns = elapsedNs(Start);
+    threadOptimizeNs += ns;
+    statTime(Phase::Optimize, ns);
+}
+
+// Entries are found by structural hash; the full key only confirms the hit.
+std::shared_ptr<const JITCode> JITSession::lookupCache(uint64_t hash, const std::string& key) {
+    auto hit = cache.find(hash);
+    if (hit == cache.end() || hit->second.key != key) {
+        statAdd(Counter::JitCacheMisses);
+        return nullptr;
+    }
+    statAdd(Counter::JitCacheHits);
+    return hit->second.code;
+}
+
+// Evicting a formula only drops the cache's reference; callers still holding
+// it keep its code alive.
+// On a hash collision the newer formula takes the entry over.
+void JITSession::insertCache(uint64_t hash, std::string key, std::shared_ptr<const JITCode> code) {
+    auto hit = cache.find(hash);
+    if (hit != cache.end()) {
+        hit->second = CacheEntry{std::move(key), std::move(code)};
+        return;
+    }
+    if (cacheCapacity && cache.size() >= cacheCapacity) {
+        cache.erase(cacheOrder.front());
+        cacheOrder.pop_front();
+    }
+    cache.emplace(hash, CacheEntry{std::move(key), std::move(code)});
+    cacheOrder.push_back(hash);
+}
+
+// Functions are named after the formula's hash, so the same formula produces
+// the same IR in every run (which the object cache relies on). A suffix keeps
+// names unique when a formula is compiled again while its old code is still
+// alive, or two formulas collide.
+std::string JITSession::functionName(const char* prefix, uint64_t hash) {
+    char buf[64];
+    std::snprintf(buf, sizeof buf, "%s_%016llx", prefix, (unsigned long long)hash);
+    unsigned uses = functionNames[buf]++;
+    return uses ? std::string(buf) + "_" + std::to_string(uses) : std::string(buf);
+}
+
+// Perf map names are "dsl: <what> @ <source location>", with very long formulas
+// cut short.
+void JITSession::labelCode(const std::string& FnName, std::string what) {
+    if (what.size() > 200)
+        what = what.substr(0, 197) + "...";
+    perfMap->label(FnName, "dsl: " + what + (location.empty() ? "" : " @ " + location));
+}
+
+// Callers hold TSCtx's lock while they build the module and pass it on to
+// addModule: lazy modules compile on whichever thread first calls them, in the
+// same context, and that compile takes the lock too.
+std::unique_ptr<Module> JITSession::newModule(const std::string& name) {
+    if (!J)
+        createJIT();
+    auto M = std::make_unique<Module>(name, *TSCtx->getContext());
+    M->setDataLayout(J->getDataLayout());
+    moduleStart = Clock::now();
+    return M;
+}
+
+// Dump, verify and hand a finished module to the JIT under a fresh resource
+// tracker. Lazy modules only compile a function when it is first called. The
+// lazy layer compiles each function on its own, so a module with user function
+// helpers (the only internal functions) goes in eagerly to let them be inlined.
+// contextLock is released on return, before the caller looks the code up: the
+// lookup may wait for another thread that is materializing code in the same
+// context, which needs the lock.
+ResourceTrackerSP JITSession::addModule(std::unique_ptr<Module> M, bool lazy,
+                                        ThreadSafeContext::Lock contextLock) {
+    for (Function& F : *M)
+        if (lazy && !F.isDeclaration() && F.hasLocalLinkage())
+            lazy = false;
+    statTime(Phase::Codegen, elapsedNs(moduleStart));
+    statAdd(Counter::JitModules);
+    if (irDump) {
+        std::string text;
+        raw_string_ostream out(text);
+        M->print(out, nullptr);
+        irDump->write(out.str());
+    }
+    if (verifyModule(*M, &errs()))
+        throw std::runtime_error("Generated invalid IR");
+    ResourceTrackerSP RT = J->getMainJITDylib().createResourceTracker();
+    ThreadSafeModule TSM(std::move(M), *TSCtx);
+    if (lazy)
+        check(J->getCompileOnDemandLayer().add(RT, std::move(TSM)), "Failed to add module to JIT");
+    else
+        check(J->addIRModule(RT, std::move(TSM)), "Failed to add module to JIT");
+    return RT;
+}
+
+// Cache key component. F64 adds nothing, so double formulas keep their keys.
+static const char* precisionTag(Precision precision) {
+    switch (precision) {
+        case Precision::F32: return "s";
+        case Precision::Mixed: return "m";
+        default: return "";
+    }
+}
+
+// A double input as the emitter wants it at precision.
+static Value* loadInput(IRBuilder<>& Builder, Value* V, Precision precision) {
+    if (precision == Precision::F64)
+        return V;
+    Value *F = Builder.CreateFPTrunc(V, Builder.getFloatTy(), V->getName() + ".f32");
+    return precision == Precision::F32 ? F : Builder.CreateFPExt(F, V->getType(), V->getName() + ".r");
+}
+
+CompiledFunctionPtr JITSession::compile(const ASTNode* node, int level, Precision precision) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    if (level < 0)
+        level = optLevel;
+    threadTiming = StatementTiming();
+    auto Start = Clock::now();
+    std::string key = "O" + std::to_string(level) + (fastMath ? "f" : "") + precisionTag(precision) + ":";
+    uint64_t hash = hashCombine(node->hash(), std::hash<std::string>()(key));
+    appendFormulaKey(node, key);
+    if (auto hit = lookupCache(hash, key)) {
+        threadTiming.cacheHit = true;
+        threadTiming.setup = elapsedUs(Start);
+        return std::static_pointer_cast<const CompiledFunction>(hit);
+    }
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("expr_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("expr", hash);
+    if (perfMap)
+        labelCode(FnName, formulaText(node));
+    IRBuilder<> Builder(Context);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+    threadTiming.setup = elapsedUs(Start);
+
+    // double exprN(const double* args, int* status): each free variable is
+    // loaded from its slot in the argument array at entry.
+    Start = Clock::now();
+    std::vector<std::string> params;
+    collectVariables(node, params);
+    Type *D = Type::getDoubleTy(Context);
+    FunctionType *FT = FunctionType::get(
+        D, {PointerType::getUnqual(D), PointerType::getUnqual(Builder.getInt32Ty())}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Args = F->getArg(0);
+    Args->setName("args");
+    F->getArg(1)->setName("status");
+    F->addFnAttr(OptLevelAttr, std::to_string(level));
+    BasicBlock *BB = BasicBlock::Create(Context, "entry", F);
+    Builder.SetInsertPoint(BB);
+
+    ExprEmitter emitter{Context, *ModulePtr, Builder, F->getArg(1), {}, {}};
+    emitter.f32 = precision == Precision::F32;
+    for (size_t i = 0; i < params.size(); ++i) {
+        Value *Slot = Builder.CreateConstInBoundsGEP1_64(D, Args, i);
+        emitter.vars[params[i]] = loadInput(Builder, Builder.CreateLoad(D, Slot, params[i]), precision);
+    }
+    Value *Result = emitter.emit(node);
+    Builder.CreateRet(emitter.f32 ? Builder.CreateFPExt(Result, D, "result") : Result);
+    threadTiming.codegen = elapsedUs(Start);
+
+    // The module goes in lazily: lookup only hands back a stub, and the body is
+    // compiled the first time the stub is called.
+    Start = Clock::now();
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), true, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto fn = std::make_shared<const CompiledFunction>(
+        (CompiledFunction::EntryPoint)Sym.getAddress(), std::move(params), RT);
+    threadTiming.compile = elapsedUs(Start);
+
+    Start = Clock::now();
+    insertCache(hash, std::move(key), fn);
+    threadTiming.teardown = elapsedUs(Start);
+    return fn;
+}
+
+GradientFunctionPtr JITSession::compileGradient(const ASTNode* node, ADMode mode) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    threadTiming = StatementTiming();
+    auto Start = Clock::now();
+    std::string key = std::string("G") + adModeName(mode)[0] + std::to_string(optLevel)
+                      + (fastMath ? "f:" : ":");
+    uint64_t hash = hashCombine(node->hash(), std::hash<std::string>()(key));
+    appendFormulaKey(node, key);
+    if (auto hit = lookupCache(hash, key)) {
+        threadTiming.cacheHit = true;
+        threadTiming.setup = elapsedUs(Start);
+        return std::static_pointer_cast<const GradientFunction>(hit);
+    }
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("grad_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("grad", hash);
+    if (perfMap)
+        labelCode(FnName, "grad " + formulaText(node));
+    IRBuilder<> Builder(Context);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+    threadTiming.setup = elapsedUs(Start);
+
+    // double gradN(const double* args, double* grad, int* status)
+    Start = Clock::now();
+    std::vector<std::string> params;
+    collectVariables(node, params);
+    Arena arena;
+    std::vector<ASTNodePtr> partials = gradient(node, params, arena, mode);
+    for (ASTNodePtr& p : partials)
+        p = simplify(p.get(), arena, fastMath);
+
+    Type *D = Type::getDoubleTy(Context);
+    Type *DP = PointerType::getUnqual(D);
+    FunctionType *FT = FunctionType::get(
+        D, {DP, DP, PointerType::getUnqual(Builder.getInt32Ty())}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Args = F->getArg(0), *Grad = F->getArg(1);
+    Args->setName("args");
+    Grad->setName("grad");
+    Grad->addAttr(Attribute::NoAlias);
+    F->getArg(2)->setName("status");
+    F->addFnAttr(OptLevelAttr, std::to_string(optLevel));
+    BasicBlock *BB = BasicBlock::Create(Context, "entry", F);
+    Builder.SetInsertPoint(BB);
+
+    // One emitter for the value and every partial, so its CSE map shares the
+    // primal subexpressions the derivative trees were copied from.
+    ExprEmitter emitter{Context, *ModulePtr, Builder, F->getArg(2), {}, {}};
+    for (size_t i = 0; i < params.size(); ++i) {
+        Value *Slot = Builder.CreateConstInBoundsGEP1_64(D, Args, i);
+        emitter.vars[params[i]] = Builder.CreateLoad(D, Slot, params[i]);
+    }
+    Value *Result = emitter.emit(node);
+    std::vector<Value*> values;
+    for (const ASTNodePtr& p : partials)
+        values.push_back(emitter.emit(p.get()));
+    // Stores go last: a domain error in any partial leaves grad untouched.
+    for (size_t i = 0; i < values.size(); ++i)
+        Builder.CreateStore(values[i], Builder.CreateConstInBoundsGEP1_64(D, Grad, i));
+    Builder.CreateRet(Result);
+    threadTiming.codegen = elapsedUs(Start);
+
+    Start = Clock::now();
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), true, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto fn = std::make_shared<const GradientFunction>(
+        (GradientFunction::EntryPoint)Sym.getAddress(), std::move(params), RT);
+    threadTiming.compile = elapsedUs(Start);
+    insertCache(hash, std::move(key), fn);
+    return fn;
+}
+
+SolverFunctionPtr JITSession::compileSolver(const ASTNode* residual, const std::string& var) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    threadTiming = StatementTiming();
+    auto Start = Clock::now();
+    std::vector<std::string> params;
+    collectVariables(residual, params);
+    size_t unknown = std::find(params.begin(), params.end(), var) - params.begin();
+    if (unknown == params.size())
+        throw std::runtime_error(var + " does not appear in the equation");
+    std::string key = "S" + std::to_string(optLevel) + (fastMath ? "f" : "") + "/" + var + ":";
+    uint64_t hash = hashCombine(residual->hash(), std::hash<std::string>()(key));
+    appendFormulaKey(residual, key);
+    if (auto hit = lookupCache(hash, key)) {
+        threadTiming.cacheHit = true;
+        threadTiming.setup = elapsedUs(Start);
+        return std::static_pointer_cast<const SolverFunction>(hit);
+    }
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("solve_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("solve", hash);
+    if (perfMap)
+        labelCode(FnName, "solve " + formulaText(residual) + " = 0 for " + var);
+    IRBuilder<> Builder(Context);
+    // Fast-math applies to the residual only: the loop's NaN and infinity
+    // tests must not be folded away.
+    FastMathFlags FMF;
+    if (fastMath)
+        FMF.setFast();
+    threadTiming.setup = elapsedUs(Start);
+
+    Start = Clock::now();
+    Arena arena;
+    ASTNodePtr slope = differentiate(residual, var, arena);
+    slope = simplify(slope.get(), arena, fastMath);
+
+    // double solveN(const double* args, double lo, double hi, int* status)
+    Type *D = Type::getDoubleTy(Context);
+    Type *I32 = Builder.getInt32Ty();
+    FunctionType *FT = FunctionType::get(
+        D, {PointerType::getUnqual(D), D, D, PointerType::getUnqual(I32)}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Args = F->getArg(0), *Lo = F->getArg(1), *Hi = F->getArg(2), *Status = F->getArg(3);
+    Args->setName("args");
+    Lo->setName("lo");
+    Hi->setName("hi");
+    Status->setName("status");
+    F->addFnAttr(OptLevelAttr, std::to_string(optLevel));
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(Context, "loop", F);
+    BasicBlock *Check = BasicBlock::Create(Context, "check", F);
+    BasicBlock *Latch = BasicBlock::Create(Context, "latch", F);
+    BasicBlock *Done = BasicBlock::Create(Context, "done", F);
+    BasicBlock *Fail = BasicBlock::Create(Context, "fail", F);
+    Builder.SetInsertPoint(Entry);
+
+    // Domain errors are accumulated rather than branched on, so that a bad
+    // iterate can be recovered from. Values emitted for one x are not valid
+    // for another, hence the CSE map is cleared whenever x changes.
+    ExprEmitter emitter{Context, *ModulePtr, Builder, nullptr, {}, {}};
+    Value *Guess = nullptr;
+    for (size_t i = 0; i < params.size(); ++i) {
+        Value *V = Builder.CreateLoad(D, Builder.CreateConstInBoundsGEP1_64(D, Args, i), params[i]);
+        if (i == unknown)
+            Guess = V;
+        else
+            emitter.vars[params[i]] = V;
+    }
+    auto at = [&](Value* X) {
+        emitter.vars[var] = X;
+        emitter.emitted.clear();
+        emitter.Errors = Builder.getInt32(0);
+    };
+    auto emit = [&](const ASTNode* nd) {
+        Builder.setFastMathFlags(FMF);
+        Value *V = emitter.emit(nd);
+        Builder.clearFastMathFlags();
+        return V;
+    };
+    auto fabs = [&](Value* V) { return emitter.intrinsic(Intrinsic::fabs, {V}, "abstmp"); };
+    Value *Zero = ConstantFP::get(D, 0.0), *Half = ConstantFP::get(D, 0.5);
+
+    // The bracket is used when it is non-empty and the residual changes sign
+    // over it; a guess outside of it starts from the midpoint.
+    at(Lo);
+    Value *FLo = emit(residual);
+    Value *EndErrors = emitter.Errors;
+    at(Hi);
+    Value *FHi = emit(residual);
+    EndErrors = Builder.CreateOr(EndErrors, emitter.Errors);
+    Value *Bracketed = Builder.CreateAnd(
+        Builder.CreateAnd(Builder.CreateFCmpOLT(Lo, Hi), Builder.CreateICmpEQ(EndErrors, Builder.getInt32(0))),
+        Builder.CreateFCmpOLE(Builder.CreateFMul(FLo, FHi), Zero), "bracketed");
+    Value *Inside = Builder.CreateAnd(Builder.CreateFCmpOGT(Guess, Lo), Builder.CreateFCmpOLT(Guess, Hi));
+    Value *Mid = Builder.CreateFMul(Builder.CreateFAdd(Lo, Hi), Half);
+    Value *X0 = Builder.CreateSelect(Builder.CreateAnd(Bracketed, Builder.CreateNot(Inside)), Mid, Guess);
+    BasicBlock *EntryEnd = Builder.GetInsertBlock();
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *X = Builder.CreatePHI(D, 2, "x");
+    PHINode *A = Builder.CreatePHI(D, 2, "a");
+    PHINode *B = Builder.CreatePHI(D, 2, "b");
+    PHINode *Iter = Builder.CreatePHI(I32, 2, "iter");
+    X->addIncoming(X0, EntryEnd);
+    A->addIncoming(Lo, EntryEnd);
+    B->addIncoming(Hi, EntryEnd);
+    Iter->addIncoming(Builder.getInt32(0), EntryEnd);
+    at(X);
+    Value *R = emit(residual);
+    Value *Slope = emit(slope.get());
+    Value *Errors = emitter.Errors;
+    Value *Finite = Builder.CreateAnd(Builder.CreateICmpEQ(Errors, Builder.getInt32(0)),
+                                      Builder.CreateFCmpORD(R, R), "finite");
+    // Shrink the bracket to the half that keeps the sign change.
+    Value *Update = Builder.CreateAnd(Bracketed, Finite);
+    Value *SameSide = Builder.CreateFCmpOGT(Builder.CreateFMul(R, FLo), Zero);
+    Value *A1 = Builder.CreateSelect(Builder.CreateAnd(Update, SameSide), X, A, "a.next");
+    Value *B1 = Builder.CreateSelect(Builder.CreateAnd(Update, Builder.CreateNot(SameSide)), X, B, "b.next");
+    // A Newton step is taken when it is finite and, with a bracket, stays
+    // strictly inside it; a zero slope gives an infinite step.
+    Value *Newton = Builder.CreateFSub(X, Builder.CreateFDiv(R, Slope), "newton");
+    Value *NewtonOk = Builder.CreateAnd(
+        Finite, Builder.CreateFCmpONE(fabs(Newton), ConstantFP::getInfinity(D)));
+    Value *InBracket = Builder.CreateAnd(Builder.CreateFCmpOGT(Newton, A1), Builder.CreateFCmpOLT(Newton, B1));
+    NewtonOk = Builder.CreateSelect(Bracketed, Builder.CreateAnd(NewtonOk, InBracket), NewtonOk);
+    Value *Next = Builder.CreateSelect(NewtonOk, Newton,
+                                       Builder.CreateFMul(Builder.CreateFAdd(A1, B1), Half), "x.next");
+    Value *FailCode = Builder.CreateSelect(Builder.CreateICmpNE(Errors, Builder.getInt32(0)), Errors,
+                                           Builder.getInt32(NoConvergence));
+    BasicBlock *LoopEnd = Builder.GetInsertBlock();
+    // Without a bracket there is nothing to fall back on.
+    Builder.CreateCondBr(Builder.CreateOr(NewtonOk, Bracketed), Check, Fail);
+
+    // Converged on an exact root, or once the step is below 2e-12 absolute
+    // plus four ulps relative.
+    Builder.SetInsertPoint(Check);
+    Value *Exact = Builder.CreateFCmpOEQ(R, Zero);
+    Value *Tol = Builder.CreateFAdd(ConstantFP::get(D, 2e-12),
+                                    Builder.CreateFMul(ConstantFP::get(D, 4 * 2.220446049250313e-16), fabs(X)));
+    Value *Small = Builder.CreateFCmpOLE(fabs(Builder.CreateFSub(Next, X)), Tol);
+    Value *Converged = Builder.CreateAnd(Finite, Builder.CreateOr(Exact, Small));
+    Value *Root = Builder.CreateSelect(Exact, X, Next, "root");
+    Builder.CreateCondBr(Converged, Done, Latch);
+
+    Builder.SetInsertPoint(Latch);
+    Value *IterNext = Builder.CreateAdd(Iter, Builder.getInt32(1), "iter.next");
+    X->addIncoming(Next, Latch);
+    A->addIncoming(A1, Latch);
+    B->addIncoming(B1, Latch);
+    Iter->addIncoming(IterNext, Latch);
+    Builder.CreateCondBr(Builder.CreateICmpULT(IterNext, Builder.getInt32(100)), Loop, Fail);
+
+    Builder.SetInsertPoint(Done);
+    Builder.CreateRet(Root);
+
+    Builder.SetInsertPoint(Fail);
+    PHINode *Code = Builder.CreatePHI(I32, 2, "code");
+    Code->addIncoming(FailCode, LoopEnd);
+    Code->addIncoming(Builder.getInt32(NoConvergence), Latch);
+    Builder.CreateStore(Code, Status);
+    Builder.CreateRet(ConstantFP::getNaN(D));
+    threadTiming.codegen = elapsedUs(Start);
+
+    Start = Clock::now();
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), true, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto fn = std::make_shared<const SolverFunction>(
+        (SolverFunction::EntryPoint)Sym.getAddress(), std::move(params), unknown, RT);
+    threadTiming.compile = elapsedUs(Start);
+    insertCache(hash, std::move(key), fn);
+    return fn;
+}
+
+BatchKernelPtr JITSession::compileBatch(const ASTNode* node, const std::vector<Column>& columns,
+                                        Precision precision) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    std::vector<std::string> params;
+    collectVariables(node, params);
+    std::vector<ColumnType> types;
+    for (const std::string& p : params)
+        types.push_back(findColumn(columns, p).type);
+
+    int level = std::max(optLevel, 2);
+    std::string key = "B" + std::to_string(level) + (fastMath ? "f" : "") + precisionTag(precision);
+    for (ColumnType t : types)
+        key += t == ColumnType::F64 ? 'd' : 'f';
+    key += ':';
+    uint64_t hash = hashCombine(node->hash(), std::hash<std::string>()(key));
+    appendFormulaKey(node, key);
+    if (auto hit = lookupCache(hash, key))
+        return std::static_pointer_cast<const BatchKernel>(hit);
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("batch_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("batch", hash);
+    if (perfMap)
+        labelCode(FnName, "batch " + formulaText(node));
+    IRBuilder<> Builder(Context);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+
+    // int batchN(const void* const* columns, double* noalias out, i64 begin, i64 end)
+    Type *D = Type::getDoubleTy(Context);
+    Type *I64 = Builder.getInt64Ty();
+    Type *I8P = Builder.getInt8PtrTy();
+    FunctionType *FT = FunctionType::get(
+        Builder.getInt32Ty(), {PointerType::getUnqual(I8P), PointerType::getUnqual(D), I64, I64}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Cols = F->getArg(0), *Out = F->getArg(1), *Begin = F->getArg(2), *End = F->getArg(3);
+    Cols->setName("columns");
+    Out->setName("out");
+    Begin->setName("begin");
+    End->setName("end");
+    Out->addAttr(Attribute::NoAlias);
+    F->addFnAttr(OptLevelAttr, std::to_string(level));
+
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(Context, "loop", F);
+    BasicBlock *Exit = BasicBlock::Create(Context, "exit", F);
+    Builder.SetInsertPoint(Entry);
+    std::vector<Value*> colPtrs;
+    std::vector<Type*> colTys;
+    for (size_t i = 0; i < params.size(); ++i) {
+        Type *ElemTy = types[i] == ColumnType::F64 ? D : Builder.getFloatTy();
+        Value *Raw = Builder.CreateLoad(I8P, Builder.CreateConstInBoundsGEP1_64(I8P, Cols, i));
+        colPtrs.push_back(Builder.CreateBitCast(Raw, PointerType::getUnqual(ElemTy), params[i] + ".col"));
+        colTys.push_back(ElemTy);
+    }
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Row = Builder.CreatePHI(I64, 2, "row");
+    PHINode *Acc = Builder.CreatePHI(Builder.getInt32Ty(), 2, "errors");
+    Row->addIncoming(Begin, Entry);
+    Acc->addIncoming(Builder.getInt32(0), Entry);
+    ExprEmitter emitter{Context, *ModulePtr, Builder, nullptr, {}, {}};
+    emitter.Errors = Acc;
+    emitter.f32 = precision == Precision::F32;
+    for (size_t i = 0; i < params.size(); ++i) {
+        // Float columns are used as they are at F32 and widened otherwise.
+        Value *V = Builder.CreateLoad(colTys[i], Builder.CreateInBoundsGEP(colTys[i], colPtrs[i], Row));
+        if (colTys[i] == D)
+            V = loadInput(Builder, V, precision);
+        else if (!emitter.f32)
+            V = Builder.CreateFPExt(V, D);
+        emitter.vars[params[i]] = V;
+    }
+    Value *Result = emitter.emit(node);
+    if (emitter.f32)
+        Result = Builder.CreateFPExt(Result, D);
+    Builder.CreateStore(Result, Builder.CreateInBoundsGEP(D, Out, Row));
+    Value *Next = Builder.CreateAdd(Row, ConstantInt::get(I64, 1), "row.next", true, true);
+    BasicBlock *Latch = Builder.GetInsertBlock();
+    Row->addIncoming(Next, Latch);
+    Acc->addIncoming(emitter.Errors, Latch);
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Next, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Exit);
+    PHINode *Status = Builder.CreatePHI(Builder.getInt32Ty(), 2, "status");
+    Status->addIncoming(Builder.getInt32(0), Entry);
+    Status->addIncoming(emitter.Errors, Latch);
+    Builder.CreateRet(Status);
+
+    // Kernels are compiled now rather than on first call, so the code is
+    // complete before anyone runs it.
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), false, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto kernel = std::make_shared<const BatchKernel>(
+        (BatchKernel::EntryPoint)Sym.getAddress(), std::move(params), std::move(types), RT);
+    insertCache(hash, std::move(key), kernel);
+    return kernel;
+}
+
+ReductionKernelPtr JITSession::compileReduction(const std::vector<const ReductionNode*>& reductions,
+                                                const std::vector<Column>& columns,
+                                                Summation summation) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    std::vector<std::string> params, names;
+    for (const ReductionNode* red : reductions) {
+        if (containsReduction(red->getArg()) || (red->getArg2() && containsReduction(red->getArg2())))
+            throw std::runtime_error("Nested reductions are not supported");
+        collectVariables(red, params);
+        collectColumns(red, names);
+    }
+    for (const std::string& p : params)
+        if (std::find(names.begin(), names.end(), p) != names.end())
+            throw std::runtime_error(p + " is both a column and a scalar");
+    std::vector<ColumnType> types;
+    for (const std::string& name : names)
+        types.push_back(findColumn(columns, name).type);
+
+    int level = std::max(optLevel, 2);
+    bool kahan = summation == Summation::Kahan;
+    std::string key = "R" + std::to_string(level) + (fastMath ? "f" : "") + precisionTag(precision) +
+                      (kahan ? "k" : "");
+    for (ColumnType t : types)
+        key += t == ColumnType::F64 ? 'd' : 'f';
+    key += ':';
+    uint64_t hash = std::hash<std::string>()(key);
+    for (const ReductionNode* red : reductions) {
+        hash = hashCombine(hash, red->hash());
+        appendFormulaKey(red, key);
+    }
+    if (auto hit = lookupCache(hash, key))
+        return std::static_pointer_cast<const ReductionKernel>(hit);
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("reduce_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("reduce", hash);
+    if (perfMap) {
+        std::string text;
+        for (const ReductionNode* r : reductions)
+            text += (text.empty() ? "" : ", ") + formulaText(r);
+        labelCode(FnName, text);
+    }
+    IRBuilder<> Builder(Context);
+    FastMathFlags FMF;
+    if (fastMath) {
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+
+    // int reduceN(const double* args, const void* const* columns, i64 begin, i64 end,
+    //             double* noalias partials)
+    Type *D = Type::getDoubleTy(Context);
+    Type *I64 = Builder.getInt64Ty();
+    Type *I8P = Builder.getInt8PtrTy();
+    Type *DP = PointerType::getUnqual(D);
+    FunctionType *FT = FunctionType::get(
+        Builder.getInt32Ty(), {DP, PointerType::getUnqual(I8P), I64, I64, DP}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Args = F->getArg(0), *Cols = F->getArg(1), *Begin = F->getArg(2), *End = F->getArg(3),
+             *Partials = F->getArg(4);
+    Args->setName("args");
+    Cols->setName("columns");
+    Begin->setName("begin");
+    End->setName("end");
+    Partials->setName("partials");
+    Partials->addAttr(Attribute::NoAlias);
+    F->addFnAttr(OptLevelAttr, std::to_string(level));
+
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(Context, "loop", F);
+    BasicBlock *Exit = BasicBlock::Create(Context, "exit", F);
+    Builder.SetInsertPoint(Entry);
+    ExprEmitter emitter{Context, *ModulePtr, Builder, nullptr, {}, {}};
+    emitter.f32 = precision == Precision::F32;
+    for (size_t i = 0; i < params.size(); ++i) {
+        Value *V = Builder.CreateLoad(D, Builder.CreateConstInBoundsGEP1_64(D, Args, i), params[i]);
+        emitter.vars[params[i]] = loadInput(Builder, V, precision);
+    }
+    std::vector<Value*> colPtrs;
+    std::vector<Type*> colTys;
+    for (size_t i = 0; i < names.size(); ++i) {
+        Type *ElemTy = types[i] == ColumnType::F64 ? D : Builder.getFloatTy();
+        Value *Raw = Builder.CreateLoad(I8P, Builder.CreateConstInBoundsGEP1_64(I8P, Cols, i));
+        colPtrs.push_back(Builder.CreateBitCast(Raw, PointerType::getUnqual(ElemTy), names[i] + ".col"));
+        colTys.push_back(ElemTy);
+    }
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Row = Builder.CreatePHI(I64, 2, "row");
+    PHINode *Acc = Builder.CreatePHI(Builder.getInt32Ty(), 2, "errors");
+    Row->addIncoming(Begin, Entry);
+    Acc->addIncoming(Builder.getInt32(0), Entry);
+    emitter.Errors = Acc;
+    // Sums start from 0, min from +inf and max from -inf.
+    std::vector<PHINode*> sums, comps;
+    std::vector<Value*> initial;
+    for (const ReductionNode* red : reductions) {
+        bool extremum = red->getKind() == ReductionNode::Min || red->getKind() == ReductionNode::Max;
+        initial.push_back(extremum ? ConstantFP::getInfinity(D, red->getKind() == ReductionNode::Max)
+                                   : ConstantFP::get(D, 0.0));
+        sums.push_back(Builder.CreatePHI(D, 2, ReductionNode::kindName(red->getKind())));
+        sums.back()->addIncoming(initial.back(), Entry);
+        comps.push_back(nullptr);
+        if (kahan && !extremum) {
+            comps.back() = Builder.CreatePHI(D, 2, "comp");
+            comps.back()->addIncoming(ConstantFP::get(D, 0.0), Entry);
+        }
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+        Value *V = Builder.CreateLoad(colTys[i], Builder.CreateInBoundsGEP(colTys[i], colPtrs[i], Row));
+        if (colTys[i] == D)
+            V = loadInput(Builder, V, precision);
+        else if (!emitter.f32)
+            V = Builder.CreateFPExt(V, D);
+        emitter.vars[names[i]] = V;
+    }
+    std::vector<Value*> nextSums, nextComps;
+    for (size_t i = 0; i < reductions.size(); ++i) {
+        const ReductionNode* red = reductions[i];
+        Value *V = emitter.emit(red->getArg());
+        if (red->getArg2())
+            V = Builder.CreateFMul(V, emitter.emit(red->getArg2()), "dottmp");
+        if (emitter.f32)
+            V = Builder.CreateFPExt(V, D);
+        // The accumulation has flags of its own: reassociation alone lets
+        // the vectorizer split the sum, and Kahan's steps must stay exact.
+        Builder.clearFastMathFlags();
+        Value *Sum = sums[i], *Comp = comps[i];
+        if (red->getKind() == ReductionNode::Min || red->getKind() == ReductionNode::Max) {
+            // NaN rows become the starting value, so the reduction itself
+            // never sees a NaN and can be vectorized under nnan.
+            bool max = red->getKind() == ReductionNode::Max;
+            V = Builder.CreateSelect(Builder.CreateFCmpUNO(V, V), initial[i], V);
+            FastMathFlags NoNaNs;
+            NoNaNs.setNoNaNs();
+            NoNaNs.setNoSignedZeros();
+            Builder.setFastMathFlags(NoNaNs);
+            Sum = emitter.intrinsic(max ? Intrinsic::maxnum : Intrinsic::minnum, {Sum, V},
+                                    max ? "max.next" : "min.next");
+            Builder.clearFastMathFlags();
+        } else if (Comp) {
+            Value *Y = Builder.CreateFSub(V, Comp, "y");
+            Value *T = Builder.CreateFAdd(Sum, Y, "t");
+            Comp = Builder.CreateFSub(Builder.CreateFSub(T, Sum), Y, "comp.next");
+            Sum = T;
+        } else {
+            FastMathFlags Reassoc;
+            Reassoc.setAllowReassoc();
+            Builder.setFastMathFlags(Reassoc);
+            Sum = Builder.CreateFAdd(Sum, V, "sum.next");
+            Builder.clearFastMathFlags();
+        }
+        Builder.setFastMathFlags(FMF);
+        nextSums.push_back(Sum);
+        nextComps.push_back(Comp);
+    }
+    Value *Next = Builder.CreateAdd(Row, ConstantInt::get(I64, 1), "row.next", true, true);
+    BasicBlock *Latch = Builder.GetInsertBlock();
+    Row->addIncoming(Next, Latch);
+    Acc->addIncoming(emitter.Errors, Latch);
+    for (size_t i = 0; i < reductions.size(); ++i) {
+        sums[i]->addIncoming(nextSums[i], Latch);
+        if (comps[i])
+            comps[i]->addIncoming(nextComps[i], Latch);
+    }
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Next, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Exit);
+    PHINode *Status = Builder.CreatePHI(Builder.getInt32Ty(), 2, "status");
+    Status->addIncoming(Builder.getInt32(0), Entry);
+    Status->addIncoming(emitter.Errors, Latch);
+    std::vector<Value*> results;
+    for (size_t i = 0; i < reductions.size(); ++i) {
+        PHINode *Sum = Builder.CreatePHI(D, 2);
+        Sum->addIncoming(initial[i], Entry);
+        Sum->addIncoming(nextSums[i], Latch);
+        results.push_back(Sum);
+        Value *Comp = ConstantFP::get(D, 0.0);
+        if (comps[i]) {
+            PHINode *P = Builder.CreatePHI(D, 2);
+            P->addIncoming(Comp, Entry);
+            P->addIncoming(nextComps[i], Latch);
+            Comp = P;
+        }
+        results.push_back(Comp);
+    }
+    for (size_t i = 0; i < results.size(); ++i)
+        Builder.CreateStore(results[i], Builder.CreateConstInBoundsGEP1_64(D, Partials, i));
+    Builder.CreateRet(Status);
+
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), false, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto kernel = std::make_shared<const ReductionKernel>(
+        (ReductionKernel::EntryPoint)Sym.getAddress(), std::move(params), std::move(names),
+        std::move(types), RT);
+    insertCache(hash, std::move(key), kernel);
+    return kernel;
+}
+
+SweepKernelPtr JITSession::compileSweep(const ASTNode* node, const std::string& var) {
+    std::lock_guard<std::mutex> lock(compileMutex);
+    std::vector<std::string> params;
+    collectVariables(node, params);
+    params.erase(std::remove(params.begin(), params.end(), var), params.end());
+
+    int level = std::max(optLevel, 2);
+    std::string key = "W" + std::to_string(level) + (fastMath ? "f" : "") + precisionTag(precision) +
+                      "/" + var + ':';
+    uint64_t hash = hashCombine(node->hash(), std::hash<std::string>()(key));
+    appendFormulaKey(node, key);
+    if (auto hit = lookupCache(hash, key))
+        return std::static_pointer_cast<const SweepKernel>(hit);
+
+    auto contextLock = TSCtx->getLock();
+    auto ModulePtr = newModule("sweep_module");
+    LLVMContext& Context = ModulePtr->getContext();
+    std::string FnName = functionName("sweep", hash);
+    if (perfMap)
+        labelCode(FnName, "sweep " + var + ": " + formulaText(node));
+    IRBuilder<> Builder(Context);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+
+    // int sweepN(const double* args, double from, double step, double* noalias out,
+    //            i64 begin, i64 end)
+    Type *D = Type::getDoubleTy(Context);
+    Type *I64 = Builder.getInt64Ty();
+    Type *DP = PointerType::getUnqual(D);
+    FunctionType *FT = FunctionType::get(Builder.getInt32Ty(), {DP, D, D, DP, I64, I64}, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, ModulePtr.get());
+    Argument *Args = F->getArg(0), *From = F->getArg(1), *Step = F->getArg(2), *Out = F->getArg(3),
+             *Begin = F->getArg(4), *End = F->getArg(5);
+    Args->setName("args");
+    From->setName("from");
+    Step->setName("step");
+    Out->setName("out");
+    Begin->setName("begin");
+    End->setName("end");
+    Out->addAttr(Attribute::NoAlias);
+    F->addFnAttr(OptLevelAttr, std::to_string(level));
+
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock *Loop = BasicBlock::Create(Context, "loop", F);
+    BasicBlock *Exit = BasicBlock::Create(Context, "exit", F);
+    Builder.SetInsertPoint(Entry);
+    ExprEmitter emitter{Context, *ModulePtr, Builder, nullptr, {}, {}};
+    emitter.f32 = precision == Precision::F32;
+    for (size_t i = 0; i < params.size(); ++i) {
+        Value *V = Builder.CreateLoad(D, Builder.CreateConstInBoundsGEP1_64(D, Args, i), params[i]);
+        emitter.vars[params[i]] = loadInput(Builder, V, precision);
+    }
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Row = Builder.CreatePHI(I64, 2, "row");
+    PHINode *Acc = Builder.CreatePHI(Builder.getInt32Ty(), 2, "errors");
+    Row->addIncoming(Begin, Entry);
+    Acc->addIncoming(Builder.getInt32(0), Entry);
+    emitter.Errors = Acc;
+    // Computed as from + i*step in double, not by accumulating step, so every
+    // point is the same whichever chunk it falls in.
+    // No contraction into an fma either, whatever the fast-math setting.
+    Builder.clearFastMathFlags();
+    Value *X = Builder.CreateFAdd(From, Builder.CreateFMul(Builder.CreateSIToFP(Row, D), Step), var);
+    if (fastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        Builder.setFastMathFlags(FMF);
+    }
+    emitter.vars[var] = loadInput(Builder, X, precision);
+    Value *Result = emitter.emit(node);
+    if (emitter.f32)
+        Result = Builder.CreateFPExt(Result, D);
+    Builder.CreateStore(Result, Builder.CreateInBoundsGEP(D, Out, Builder.CreateSub(Row, Begin)));
+    Value *Next = Builder.CreateAdd(Row, ConstantInt::get(I64, 1), "row.next", true, true);
+    BasicBlock *Latch = Builder.GetInsertBlock();
+    Row->addIncoming(Next, Latch);
+    Acc->addIncoming(emitter.Errors, Latch);
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Next, End), Loop, Exit);
+
+    Builder.SetInsertPoint(Exit);
+    PHINode *Status = Builder.CreatePHI(Builder.getInt32Ty(), 2, "status");
+    Status->addIncoming(Builder.getInt32(0), Entry);
+    Status->addIncoming(emitter.Errors, Latch);
+    Builder.CreateRet(Status);
+
+    ResourceTrackerSP RT = addModule(std::move(ModulePtr), false, std::move(contextLock));
+    auto Sym = check(J->lookup(FnName), "Function not found in JIT");
+    auto kernel = std::make_shared<const SweepKernel>(
+        (SweepKernel::EntryPoint)Sym.getAddress(), std::move(params), RT);
+    insertCache(hash, std::move(key), kernel);
+    return kernel;
+}
+
+StatementTiming JITSession::lastTiming() const {
+    return threadTiming;
+}
+
+double JITSession::evaluate(const ASTNode* node, SymbolTable& symbols) {
+    CompiledFunctionPtr fn = compile(node);
+    std::vector<int> bind;
+    collectSlots(node, bind);
+    // The first call also optimizes and compiles the body; split that out.
+    long long optBefore = threadOptimizeNs, nativeBefore = threadNativeNs;
+    auto Start = Clock::now();
+    double result = fn->call(symbols.values(), bind);
+    double total = elapsedUs(Start);
+    threadTiming.optimize = (threadOptimizeNs - optBefore) / 1000.0;
+    double native = (threadNativeNs - nativeBefore) / 1000.0;
+    threadTiming.compile += native;
+    threadTiming.execute = total - threadTiming.optimize - native;
+    return result;
+}
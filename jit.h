@@ -0,0 +1,350 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.h"
+#include "batch.h"
+#include "codegen.h"
+#include "diff.h"
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+
+namespace llvm {
+class JITEventListener;
+class Module;
+class TargetMachine;
+namespace orc {
+class LLLazyJIT;
+}
+}
+
+class DiskObjectCache;
+class PerfMapListener;
+class TraceSink;
+
+// Per-statement breakdown of where evaluateAST spent its time, in microseconds.
+struct StatementTiming {
+    double setup = 0;     // target init / JIT creation / module creation
+    double codegen = 0;   // IR building and verification
+    double optimize = 0;  // running the pass pipeline
+    double compile = 0;   // adding the module, looking up its symbol and emitting native code
+    double execute = 0;   // calling the JIT'd function, excluding the lazy optimize/compile
+                          // (the first call still pays for JIT linking)
+    double teardown = 0;  // releasing the statement's code
+    bool cacheHit = false; // the formula was already compiled; codegen/compile were skipped
+};
+
+// Native code owned by the JIT. Its parameters are the free variables of the
+// formula in order of first appearance. Dropping the last reference frees the
+// code.
+class JITCode {
+public:
+    JITCode(std::vector<std::string> params, llvm::orc::ResourceTrackerSP tracker);
+    virtual ~JITCode();
+    JITCode(const JITCode&) = delete;
+    JITCode& operator=(const JITCode&) = delete;
+
+    const std::vector<std::string>& getParams() const { return params; }
+
+protected:
+    std::vector<std::string> params;
+
+private:
+    llvm::orc::ResourceTrackerSP tracker;
+};
+
+// A formula compiled to native code. Its free variables are not baked in: they
+// are passed through the argument array in the order given by params, so the
+// same function can be re-invoked with new inputs. A domain error stores its
+// DomainError code through status and makes the function return NaN.
+class CompiledFunction : public JITCode {
+public:
+    using EntryPoint = double (*)(const double* args, int* status);
+
+    CompiledFunction(EntryPoint fn, std::vector<std::string> params,
+                     llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+
+    double operator()(const double* args, int* status) const { return fn(args, status); }
+    // Gather args[i] = slots[bind[i]] (bind as from collectSlots) and call the
+    // function, throwing std::runtime_error on a domain error.
+    double call(const double* slots, const std::vector<int>& bind) const;
+
+private:
+    EntryPoint fn;
+};
+using CompiledFunctionPtr = std::shared_ptr<const CompiledFunction>;
+
+// A formula fused with its gradient: one function returns the value and
+// stores d/dparams[i] in grad[i], computing the subexpressions the value and
+// the partials share only once. Errors are reported as for CompiledFunction;
+// a partial can fail where the value does not (d/dx sqrt(x) at 0).
+class GradientFunction : public JITCode {
+public:
+    using EntryPoint = double (*)(const double* args, double* grad, int* status);
+
+    GradientFunction(EntryPoint fn, std::vector<std::string> params,
+                     llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+
+    // As CompiledFunction::call; grad receives one partial per parameter.
+    double call(const double* slots, const std::vector<int>& bind, double* grad) const;
+
+private:
+    EntryPoint fn;
+};
+using GradientFunctionPtr = std::shared_ptr<const GradientFunction>;
+
+// Solver for residual(x) = 0 in one of the residual's parameters, the unknown.
+// The Newton iteration, with the derivative from differentiate(), runs inside
+// the native function. Given a bracket lo < hi over which the residual changes
+// sign, steps that leave the bracket (or hit a domain error) fall back to
+// bisection, which always converges; otherwise the iteration is pure Newton
+// from the guess and reports its failure. The guess is passed in the unknown's
+// slot of args; params includes it. The root is returned, or NaN with
+// NoConvergence or the domain error of the failing step stored through status.
+class SolverFunction : public JITCode {
+public:
+    using EntryPoint = double (*)(const double* args, double lo, double hi, int* status);
+
+    SolverFunction(EntryPoint fn, std::vector<std::string> params, size_t unknown,
+                   llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+    size_t getUnknown() const { return unknown; }  // index into params
+
+    double operator()(const double* args, double lo, double hi, int* status) const {
+        return fn(args, lo, hi, status);
+    }
+    // As CompiledFunction::call, starting from the unknown's current value.
+    double call(const double* slots, const std::vector<int>& bind, double lo, double hi) const;
+
+private:
+    EntryPoint fn;
+    size_t unknown;
+};
+using SolverFunctionPtr = std::shared_ptr<const SolverFunction>;
+
+// A formula compiled into a loop over rows. Each parameter is read from its
+// own column, using the element type fixed at compile time. Rows [begin, end)
+// are written to the same positions of out, and the DomainError flags of all
+// rows are OR'ed into the return value, so the loop has no early exit and can
+// be vectorized.
+class BatchKernel : public JITCode {
+public:
+    using EntryPoint = int (*)(const void* const* columns, double* out,
+                               int64_t begin, int64_t end);
+
+    BatchKernel(EntryPoint fn, std::vector<std::string> params, std::vector<ColumnType> types,
+                llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+    const std::vector<ColumnType>& getColumnTypes() const { return types; }
+
+    int operator()(const void* const* columns, double* out, int64_t begin, int64_t end) const {
+        return fn(columns, out, begin, end);
+    }
+
+    // Pick this kernel's inputs out of columns, in parameter order. Throws if a
+    // parameter has no column or the column's type differs from the compiled one.
+    std::vector<const void*> bind(const std::vector<Column>& columns) const;
+
+private:
+    EntryPoint fn;
+    std::vector<ColumnType> types;
+};
+using BatchKernelPtr = std::shared_ptr<const BatchKernel>;
+
+// The reductions of a formula fused into one loop over rows [begin, end): each
+// row loads its columns once and feeds every reduction. Reduction i leaves its
+// partial result in partials[2i] (a sum, minimum or maximum) and, under Kahan
+// summation, the running compensation in partials[2i + 1]. Scalars are passed
+// through args in params order; columns are picked by bind(). Errors are
+// OR'ed into the return value as for BatchKernel.
+class ReductionKernel : public JITCode {
+public:
+    using EntryPoint = int (*)(const double* args, const void* const* columns,
+                               int64_t begin, int64_t end, double* partials);
+
+    ReductionKernel(EntryPoint fn, std::vector<std::string> params, std::vector<std::string> columns,
+                    std::vector<ColumnType> types, llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+    const std::vector<std::string>& getColumns() const { return columns; }
+
+    int operator()(const double* args, const void* const* inputs, int64_t begin, int64_t end,
+                   double* partials) const {
+        return fn(args, inputs, begin, end, partials);
+    }
+
+    // As BatchKernel::bind, for getColumns().
+    std::vector<const void*> bind(const std::vector<Column>& inputs) const;
+
+private:
+    EntryPoint fn;
+    std::vector<std::string> columns;
+    std::vector<ColumnType> types;
+};
+using ReductionKernelPtr = std::shared_ptr<const ReductionKernel>;
+
+// A formula compiled into a loop over the points of a range: row i sets the
+// swept variable to from + i*step. The other parameters are loop invariant and
+// passed through args, in the order of params, which leaves the swept variable
+// out. Rows [begin, end) are written to out[0, end - begin), so a caller can
+// hand each chunk its own buffer. Errors are OR'ed into the return value as
+// for BatchKernel.
+class SweepKernel : public JITCode {
+public:
+    using EntryPoint = int (*)(const double* args, double from, double step, double* out,
+                               int64_t begin, int64_t end);
+
+    SweepKernel(EntryPoint fn, std::vector<std::string> params, llvm::orc::ResourceTrackerSP tracker);
+
+    EntryPoint getEntryPoint() const { return fn; }
+
+    int operator()(const double* args, double from, double step, double* out,
+                   int64_t begin, int64_t end) const {
+        return fn(args, from, step, out, begin, end);
+    }
+
+private:
+    EntryPoint fn;
+};
+using SweepKernelPtr = std::shared_ptr<const SweepKernel>;
+
+// Long-lived ORC JIT shared by every statement of a script. The context and the
+// LLLazyJIT are created once and keep a single JITDylib for the session. Each
+// formula is added as its own module under a resource tracker, so its functions
+// compile only when first called. Compiled formulas are cached by their
+// structure; the oldest are evicted (and their code freed) once the cache is full.
+// Before native codegen every module goes through the new-PM default pipeline
+// for the selected optimization level (none at -O0). The compile functions may
+// be called from several threads, also while other threads make the first
+// calls to lazily compiled code; the code they return is immutable and safe to
+// run concurrently.
+class JITSession {
+public:
+    JITSession();
+    ~JITSession();
+    JITSession(const JITSession&) = delete;
+    JITSession& operator=(const JITSession&) = delete;
+
+    // Compile the expression as a function of its free variables, or return the
+    // cached function if the same formula was compiled before. level overrides
+    // the session's optimization level when not negative.
+    CompiledFunctionPtr compile(const ASTNode* node, int level = -1) {
+        return compile(node, level, precision);
+    }
+    CompiledFunctionPtr compile(const ASTNode* node, int level, Precision precision);
+
+    // Compile the expression and its gradient, derived in the given mode, into
+    // one function. Cached like compile.
+    GradientFunctionPtr compileGradient(const ASTNode* node, ADMode mode);
+
+    // Compile a solver for residual = 0 in var, which must be one of the
+    // residual's free variables. Cached like compile.
+    SolverFunctionPtr compileSolver(const ASTNode* residual, const std::string& var);
+
+    // Compile the expression as a batch kernel over the given columns. Batch
+    // kernels are compiled eagerly and at no less than -O2, since they exist to
+    // run hot loops.
+    BatchKernelPtr compileBatch(const ASTNode* node, const std::vector<Column>& columns) {
+        return compileBatch(node, columns, precision);
+    }
+    BatchKernelPtr compileBatch(const ASTNode* node, const std::vector<Column>& columns,
+                                Precision precision);
+
+    // Compile reductions (distinct, none nested in another) into one kernel
+    // over the given columns. A name may not be a column of one reduction and
+    // a scalar of another. Compiled like compileBatch, at the session's
+    // precision; the sums are accumulated in double.
+    ReductionKernelPtr compileReduction(const std::vector<const ReductionNode*>& reductions,
+                                        const std::vector<Column>& columns, Summation summation);
+
+    // Compile the expression as a sweep kernel over var, which need not occur
+    // in it. Compiled like compileBatch, at the session's precision.
+    SweepKernelPtr compileSweep(const ASTNode* node, const std::string& var);
+
+    // Compile the expression and run it against the current symbol values.
+    // The expression must have been resolved against symbols.
+    double evaluate(const ASTNode* node, SymbolTable& symbols);
+
+    // Phase times of the last compile or evaluate on the calling thread, on
+    // whichever session. Each thread has its own record.
+    StatementTiming lastTiming() const;
+    void setCacheCapacity(size_t n) { cacheCapacity = n; }
+
+    // 0-3, as for -O0..-O3. Affects formulas compiled from now on.
+    void setOptLevel(int level);
+    int getOptLevel() const { return optLevel; }
+    // Allow reassociation and the other fast-math rewrites in new formulas.
+    void setFastMath(bool on) { fastMath = on; }
+    bool getFastMath() const { return fastMath; }
+    // Arithmetic of new formulas and batch kernels (see Precision). Gradients
+    // and solvers always use double.
+    void setPrecision(Precision p) { precision = p; }
+    Precision getPrecision() const { return precision; }
+    // Load and store native code through cache (null: off). Must be set
+    // before the first formula is compiled.
+    void setObjectCache(DiskObjectCache* cache);
+    // Let the vectorizer call a vector math library, loading it into the
+    // process. Must be set before the first formula is compiled.
+    void setVectorLibrary(VectorLibrary lib);
+    VectorLibrary getVectorLibrary() const { return vectorLibrary; }
+    // Append the IR of every module added from now on to sink (null: off).
+    void setIRDump(TraceSink* sink) { irDump = sink; }
+    // Report every object the JIT loads to listener, for debuggers and
+    // profilers (gdb, VTune, ...). Must be added before the first formula is
+    // compiled.
+    void addEventListener(llvm::JITEventListener* listener);
+    // As addEventListener, and name each formula's code in the perf map after
+    // its infix text and the source location current when it was compiled.
+    void setPerfMap(PerfMapListener* map);
+    // Where the formulas compiled from now on come from, such as "model.dsl:12".
+    void setSourceLocation(std::string where) { location = std::move(where); }
+
+private:
+    void createJIT();
+    void optimize(llvm::Module& M);
+    std::string functionName(const char* prefix, uint64_t hash);
+    std::unique_ptr<llvm::Module> newModule(const std::string& key);
+    void labelCode(const std::string& FnName, std::string what);
+    llvm::orc::ResourceTrackerSP addModule(std::unique_ptr<llvm::Module> M, bool lazy,
+                                           llvm::orc::ThreadSafeContext::Lock contextLock);
+    std::shared_ptr<const JITCode> lookupCache(uint64_t hash, const std::string& key);
+    void insertCache(uint64_t hash, std::string key, std::shared_ptr<const JITCode> code);
+
+    std::unique_ptr<llvm::orc::ThreadSafeContext> TSCtx;
+    std::unique_ptr<llvm::orc::LLLazyJIT> J;
+    std::unique_ptr<llvm::TargetMachine> OptTM; // target info for the pass pipeline
+    std::mutex compileMutex;
+    struct CacheEntry {
+        std::string key;  // options + appendFormulaKey, to confirm a hash match
+        std::shared_ptr<const JITCode> code;
+    };
+    std::unordered_map<uint64_t, CacheEntry> cache;
+    std::deque<uint64_t> cacheOrder;
+    size_t cacheCapacity = 4096;
+    std::unordered_map<std::string, unsigned> functionNames;
+    DiskObjectCache* objectCache = nullptr;
+    int optLevel = 0;
+    bool fastMath = false;
+    Precision precision = Precision::F64;
+    VectorLibrary vectorLibrary = VectorLibrary::None;
+    std::chrono::steady_clock::time_point moduleStart;  // of the module being built
+    TraceSink* irDump = nullptr;
+    std::vector<llvm::JITEventListener*> eventListeners;
+    PerfMapListener* perfMap = nullptr;
+    std::string location;
+};
+
+#endif
@@ -2,118 +2,835 @@
 #include <stdexcept>
 #include <memory>
 #include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include "aot.h"
 #include "ast.h"
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/ExecutionEngine/SectionMemoryManager.h>
-#include <llvm/Support/TargetSelect.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Verifier.h>
-#include <llvm/Support/raw_ostream.h>
-#include <llvm/Support/FileSystem.h>
-
-using namespace llvm;
-
-// Forward declarations from Bison
-extern int yyparse();
-extern std::unique_ptr<ASTNode> root;
-extern std::unordered_map<std::string, double> symbol_table;
-
-// Generate LLVM IR for the AST and execute it via JIT, returning the result.
-double evaluateAST(ASTNode* node, std::unordered_map<std::string, double>& symbols) {
-    LLVMContext Context;
-    auto ModulePtr = std::make_unique<Module>("expr_module", Context);
-    IRBuilder<> Builder(Context);
-
-    FunctionType *FT = FunctionType::get(Type::getDoubleTy(Context), false);
-    Function *F = Function::Create(FT, Function::ExternalLinkage, "expr", ModulePtr.get());
-    BasicBlock *BB = BasicBlock::Create(Context, "entry", F);
-    Builder.SetInsertPoint(BB);
-
-    std::function<Value*(ASTNode*)> emit = [&](ASTNode* nd) -> Value* {
-        if (auto *num = dynamic_cast<NumberNode*>(nd)) {
-            return ConstantFP::get(Context, APFloat(num->evaluate(symbols)));
-        }
-        if (auto *var = dynamic_cast<VariableNode*>(nd)) {
-            double v = var->evaluate(symbols);
-            return ConstantFP::get(Context, APFloat(v));
-        }
-        if (auto *bin = dynamic_cast<BinaryOpNode*>(nd)) {
-            if (bin->op == '^') {
-                double aval = bin->left->evaluate(symbols);
-                double bval = bin->right->evaluate(symbols);
-                double res = std::pow(aval, bval);
-                return ConstantFP::get(Context, APFloat(res));
+#include "batch.h"
+#include "jit.h"
+#include "objcache.h"
+#include "perfmap.h"
+#include "reactive.h"
+#include "bytecode.h"
+#include "diff.h"
+#include "functions.h"
+#include "script.h"
+#include "simplify.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "tiering.h"
+#include "trace.h"
+
+// The JIT session lives for the whole run of main(); every statement of the
+// script is compiled into it.
+static JITSession* session = nullptr;
+static TieredEvaluator* tiered = nullptr;
+static bool reportTiming = false;
+static bool simplifyAST = true;
+static std::unique_ptr<TraceSink> irDump;
+static std::unique_ptr<DiskObjectCache> objectCache;
+// --perf-map, and the script's name for its entries.
+static std::unique_ptr<PerfMapListener> perfMap;
+static std::string sourceName = "stdin";
+// Runs sweeps, reductions and reactive updates worth splitting across cores;
+// created by the first one.
+static std::unique_ptr<ThreadPool> workPool;
+// The formulas behind each variable, in reactive mode (--reactive, :reactive).
+static std::unique_ptr<DependencyGraph> dependencies;
+// Columns loaded by :load, for reductions.
+static std::vector<std::pair<std::string, std::vector<double>>> dataColumns;
+static Summation summation = Summation::Pairwise;
+// Set when compiling ahead of time: statements are collected, not run.
+static AOTCompiler* aot = nullptr;
+
+// Which tier runs each statement: picked per formula by execution count, or
+// always the JIT, the bytecode VM or the tree interpreter.
+enum class Engine { Tiered, JIT, VM, Tree };
+static Engine engine = Engine::Tiered;
+static ADMode adMode = ADMode::Reverse;
+
+static bool parseADMode(const std::string& name, ADMode& out) {
+    if (name == "forward") out = ADMode::Forward;
+    else if (name == "reverse") out = ADMode::Reverse;
+    else return false;
+    return true;
+}
+
+static bool parsePrecision(const std::string& name, Precision& out) {
+    if (name == "f64") out = Precision::F64;
+    else if (name == "f32") out = Precision::F32;
+    else if (name == "mixed") out = Precision::Mixed;
+    else return false;
+    return true;
+}
+
+static bool parseSummation(const std::string& name, Summation& out) {
+    if (name == "pairwise") out = Summation::Pairwise;
+    else if (name == "kahan") out = Summation::Kahan;
+    else return false;
+    return true;
+}
+
+static bool parseEngine(const std::string& name, Engine& out) {
+    if (name == "tiered") out = Engine::Tiered;
+    else if (name == "jit") out = Engine::JIT;
+    else if (name == "vm") out = Engine::VM;
+    else if (name == "tree") out = Engine::Tree;
+    else return false;
+    return true;
+}
+
+static double runVM(const ASTNode* node, SymbolTable& symbols) {
+    std::vector<int> bind;
+    collectSlots(node, bind);
+    return BytecodeProgram(node, session->getPrecision()).call(symbols.values(), bind);
+}
+
+// The shared pool when work of this many rows is worth spreading over cores.
+static ThreadPool* poolFor(size_t rows) {
+    if (rows < 16384)
+        return nullptr;
+    if (!workPool)
+        workPool = std::make_unique<ThreadPool>();
+    return workPool.get();
+}
+
+// Reactive mode: keep name's new formula and recompute the variables that read
+// name, printing each new value. Formulas over columns are not kept.
+static void trackAssignment(Script& script, const char* name, ASTNode* node) {
+    SymbolTable& symbols = script.symbols();
+    int slot = symbols.slot(name);
+    ASTNodePtr simplified;
+    if (node && simplifyAST) {
+        simplified = simplify(node, script.arena(), session->getFastMath());
+        node = simplified.get();
+    }
+    if (node && containsReduction(node))
+        node = nullptr;
+    dependencies->define(slot, node, session->getPrecision());
+    auto Start = std::chrono::steady_clock::now();
+    ThreadPool* pool = nullptr;
+    if (dependencies->size() >= DependencyGraph::ParallelWave) {
+        if (!workPool)
+            workPool = std::make_unique<ThreadPool>();
+        pool = workPool.get();
+    }
+    std::vector<DependencyGraph::Update> updates = dependencies->propagate(slot, symbols, pool);
+    if (reportTiming && !updates.empty())
+        std::cerr << "[time] reactive: " << updates.size() << " updates in "
+                  << std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - Start).count()
+                  << "us\n";
+    for (const DependencyGraph::Update& u : updates) {
+        if (u.error.empty())
+            script.out() << "Updated: " << symbols.name(u.slot) << " = " << u.value << "\n";
+        else
+            script.err() << "Error: " << symbols.name(u.slot) << ": " << u.error << "\n";
+    }
+}
+
+// Evaluate an expression with reductions over the loaded columns, on one fused
+// reduction kernel whatever the engine.
+static double evaluateOverColumns(Script& script, const ASTNode* node) {
+    std::vector<std::string> names;
+    collectColumns(node, names);
+    std::vector<Column> columns;
+    size_t rows = 0;
+    for (const std::string& name : names) {
+        auto it = std::find_if(dataColumns.begin(), dataColumns.end(),
+                               [&](const auto& c) { return c.first == name; });
+        if (it == dataColumns.end())
+            throw std::runtime_error("No column named " + name + " (see :load)");
+        if (!columns.empty() && it->second.size() != rows)
+            throw std::runtime_error("Columns " + names[0] + " and " + name + " differ in length");
+        rows = it->second.size();
+        columns.emplace_back(name, it->second.data());
+    }
+    auto Start = std::chrono::steady_clock::now();
+    double result = evaluateReductions(*session, poolFor(rows), node, columns, rows,
+                                       script.symbols(), summation);
+    if (reportTiming)
+        std::cerr << "[time] reduction over " << rows << " rows: "
+                  << std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - Start).count()
+                  << "us\n";
+    return result;
+}
+
+// Read a CSV file with a header row of column names into dataColumns,
+// replacing columns of the same names. Returns the number of rows.
+static size_t loadColumns(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Cannot read " + path);
+    std::string line, field;
+    std::vector<std::string> names;
+    if (std::getline(file, line)) {
+        std::istringstream header(line);
+        while (std::getline(header, field, ','))
+            names.push_back(field.substr(0, field.find_last_not_of(" \r") + 1));
+    }
+    if (names.empty())
+        throw std::runtime_error("No header in " + path);
+    std::vector<std::vector<double>> values(names.size());
+    size_t lineNo = 1;
+    while (std::getline(file, line)) {
+        ++lineNo;
+        if (line.empty() || line == "\r")
+            continue;
+        const char* p = line.c_str();
+        for (size_t i = 0; i < names.size(); ++i) {
+            char* end;
+            double v = std::strtod(p, &end);
+            if (end == p || (*end != ',' && *end != '\0' && *end != '\r'))
+                throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": expected a number");
+            if (i + 1 < names.size() && *end != ',')
+                throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": missing columns");
+            values[i].push_back(v);
+            p = end + 1;
+        }
+    }
+    size_t rows = values[0].size();
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto it = std::find_if(dataColumns.begin(), dataColumns.end(),
+                               [&](const auto& c) { return c.first == names[i]; });
+        if (it != dataColumns.end())
+            it->second = std::move(values[i]);
+        else
+            dataColumns.emplace_back(names[i], std::move(values[i]));
+    }
+    return rows;
+}
+
+// Evaluate a statement's expression on the selected engine, returning the result.
+// Names are bound to slots here, once per statement; every engine then reads
+// the slot array directly.
+static double evaluateAST(Script& script, ASTNode* node) {
+    SymbolTable& symbols = script.symbols();
+    resolveSlots(node, symbols);
+    // The rewritten tree shares the statement's arena and goes with it.
+    ASTNodePtr simplified;
+    if (simplifyAST) {
+        simplified = simplify(node, script.arena(), session->getFastMath());
+        node = simplified.get();
+    }
+    if (containsReduction(node))
+        return evaluateOverColumns(script, node);
+    if (engine != Engine::JIT) {
+        auto Start = std::chrono::steady_clock::now();
+        double result = engine == Engine::Tiered ? tiered->evaluate(node, symbols)
+                        : engine == Engine::VM   ? runVM(node, symbols)
+                                                 : evaluateAt(node, symbols, session->getPrecision());
+        Tier tier = engine == Engine::Tiered ? tiered->lastTier()
+                    : engine == Engine::VM   ? Tier::VM
+                                             : Tier::Tree;
+        statAdd(tier == Tier::JIT ? Counter::EvalJIT : tier == Tier::VM ? Counter::EvalVM
+                                                                         : Counter::EvalTree);
+        if (reportTiming)
+            std::cerr << "[time] " << tierName(tier) << "="
+                      << std::chrono::duration<double, std::micro>(
+                             std::chrono::steady_clock::now() - Start).count()
+                      << "us\n";
+        return result;
+    }
+    double result = session->evaluate(node, symbols);
+    statAdd(Counter::EvalJIT);
+    if (reportTiming) {
+        StatementTiming t = session->lastTiming();
+        std::cerr << "[time] setup=" << t.setup << "us codegen=" << t.codegen
+                  << "us optimize=" << t.optimize << "us compile=" << t.compile
+                  << "us execute=" << t.execute
+                  << "us teardown=" << t.teardown << "us"
+                  << (t.cacheHit ? " (cached)" : "") << "\n";
+    }
+    return result;
+}
+
+// Evaluate a `grad` statement: the value and the partial derivative for each
+// free variable, from one fused JIT function whatever the engine.
+static double evaluateGradient(Script& script, ASTNode* node,
+                               std::vector<std::pair<std::string, double>>& partials) {
+    SymbolTable& symbols = script.symbols();
+    resolveSlots(node, symbols);
+    ASTNodePtr simplified;
+    if (simplifyAST) {
+        simplified = simplify(node, script.arena(), session->getFastMath());
+        node = simplified.get();
+    }
+    GradientFunctionPtr fn = session->compileGradient(node, adMode);
+    std::vector<int> bind;
+    collectSlots(node, bind);
+    std::vector<double> grad(bind.size());
+    auto Start = std::chrono::steady_clock::now();
+    double result = fn->call(symbols.values(), bind, grad.data());
+    if (reportTiming) {
+        StatementTiming t = session->lastTiming();
+        std::cerr << "[time] gradient (" << adModeName(adMode) << ") codegen=" << t.codegen
+                  << "us call=" << std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - Start).count()
+                  << "us" << (t.cacheHit ? " (cached)" : "") << "\n";
+    }
+    partials.clear();
+    for (size_t i = 0; i < grad.size(); ++i)
+        partials.emplace_back(fn->getParams()[i], grad[i]);
+    return result;
+}
+
+// Evaluate a `solve` statement: find a root of residual in var, store it in
+// var and return it. lo and hi, when given, bracket the root. An unassigned
+// var starts from the bracket's midpoint, or 1.
+static double solveEquation(Script& script, ASTNode* residual, const std::string& var,
+                            ASTNode* lo, ASTNode* hi) {
+    SymbolTable& symbols = script.symbols();
+    double bracketLo = 0, bracketHi = 0;  // an empty bracket is ignored
+    if (lo) {
+        bracketLo = evaluateAST(script, lo);
+        bracketHi = evaluateAST(script, hi);
+        if (!(bracketLo < bracketHi))
+            throw std::runtime_error("Empty bracket for " + var);
+    }
+    int s = symbols.slot(var);
+    if (!symbols.isDefined(s))
+        symbols.set(s, lo ? (bracketLo + bracketHi) / 2 : 1);
+    resolveSlots(residual, symbols);
+    ASTNodePtr simplified;
+    if (simplifyAST) {
+        simplified = simplify(residual, script.arena(), session->getFastMath());
+        residual = simplified.get();
+    }
+    SolverFunctionPtr fn = session->compileSolver(residual, var);
+    std::vector<int> bind;
+    collectSlots(residual, bind);
+    auto Start = std::chrono::steady_clock::now();
+    double root = fn->call(symbols.values(), bind, bracketLo, bracketHi);
+    if (reportTiming) {
+        StatementTiming t = session->lastTiming();
+        std::cerr << "[time] solve codegen=" << t.codegen << "us call="
+                  << std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - Start).count()
+                  << "us" << (t.cacheHit ? " (cached)" : "") << "\n";
+    }
+    symbols.set(s, root);
+    return root;
+}
+
+// Run a `for` sweep on a sweep kernel, whatever the engine. Sweeps of many
+// points are split over every core.
+static void runSweep(Script& script, const SweepStatement& sweep) {
+    SweepRange range{evaluateAST(script, sweep.from), evaluateAST(script, sweep.to),
+                     sweep.step ? evaluateAST(script, sweep.step) : 1.0};
+    size_t points = range.size();
+    const ASTNode* body = sweep.body;
+    ASTNodePtr simplified;
+    if (simplifyAST) {
+        simplified = simplify(sweep.body, script.arena(), session->getFastMath());
+        body = simplified.get();
+    }
+    ThreadPool* pool = poolFor(points);
+    auto Start = std::chrono::steady_clock::now();
+    std::ostream& out = script.out();
+    if (sweep.reduction) {
+        Reduction reduction = parseReduction(sweep.reduction);
+        size_t index = 0;
+        double value = reduceSweep(*session, pool, body, sweep.var, range, script.symbols(),
+                                   reduction, &index);
+        if (reduction == Reduction::ArgMin || reduction == Reduction::ArgMax)
+            out << (reduction == Reduction::ArgMin ? "Argmin: " : "Argmax: ") << sweep.var
+                << " = " << range.at(index) << " (value " << value << ")" << std::endl;
+        else
+            out << (reduction == Reduction::Sum ? "Sum: " : reduction == Reduction::Min ? "Min: " : "Max: ")
+                << value << " over " << points << " points" << std::endl;
+    } else {
+        std::vector<double> values(points);
+        evaluateSweep(*session, pool, body, sweep.var, range, script.symbols(), values.data());
+        if (sweep.path) {
+            std::ofstream file(sweep.path);
+            if (!file)
+                throw std::runtime_error(std::string("Cannot write ") + sweep.path);
+            file.precision(17);
+            file << sweep.var << ",value\n";
+            for (size_t i = 0; i < points; ++i)
+                file << range.at(i) << "," << values[i] << "\n";
+            if (!file.flush())
+                throw std::runtime_error(std::string("Cannot write ") + sweep.path);
+            out << "Wrote " << points << " points to " << sweep.path << std::endl;
+        } else {
+            for (size_t i = 0; i < points; ++i)
+                out << "  " << sweep.var << " = " << range.at(i) << ": " << values[i] << "\n";
+            out.flush();
+        }
+    }
+    if (reportTiming)
+        std::cerr << "[time] sweep of " << points << " points" << (pool ? " (parallel)" : "")
+                  << ": " << std::chrono::duration<double, std::micro>(
+                                 std::chrono::steady_clock::now() - Start).count()
+                  << "us\n";
+}
+
+// `func name(params) = body;`: simplify the body once, here, rather than at
+// every call.
+static void defineFunction(Script& script, const std::string& name,
+                           const std::vector<std::string>& params, ASTNode* body) {
+    ASTNodePtr simplified = simplifyAST ? simplify(body, script.arena(), session->getFastMath()) : nullptr;
+    script.functions().define(name, params, simplified ? simplified.get() : body);
+}
+
+// In AOT mode, record a named formula (expression statements have no name and
+// are skipped) and return true; otherwise return false to have it evaluated.
+// solve and sweeps cannot be compiled: they are reported and fail the build.
+static bool aotFailed = false;
+
+static void aotUnsupported(const std::string& statement) {
+    aotFailed = true;
+    throw std::runtime_error(statement + " cannot be compiled ahead of time");
+}
+
+static bool compileStatement(Script& script, const char* name, ASTNode* node) {
+    if (!aot)
+        return false;
+    if (name) {
+        ASTNodePtr simplified = simplifyAST ? simplify(node, script.arena(), session->getFastMath()) : nullptr;
+        aot->define(name, simplified ? simplified.get() : node);
+        script.out() << "Compiled: dsl_" << name << "\n";
+    }
+    return true;
+}
+
+// Turn a debug dump (tokens, ast, ir or all) on, starting a fresh file, or off.
+static bool setDump(const std::string& what, bool on) {
+    if (what != "tokens" && what != "ast" && what != "ir" && what != "all")
+        return false;
+    auto set = [on](std::unique_ptr<TraceSink>& sink, const char* path) {
+        sink.reset();
+        if (on)
+            sink = std::make_unique<TraceSink>(path);
+    };
+    if (what == "tokens" || what == "all")
+        set(tokenDump, "tokens.txt");
+    if (what == "ast" || what == "all")
+        set(astDump, "ast.txt");
+    if (what == "ir" || what == "all") {
+        session->setIRDump(nullptr);
+        set(irDump, "ir.ll");
+        session->setIRDump(irDump.get());
+    }
+    return true;
+}
+
+// REPL directives: ':name args' on a line of its own.
+static void runDirective(Script& script, const char* text) {
+    std::istringstream in(text + 1);
+    std::string name, arg;
+    in >> name >> arg;
+    if (name == "opt") {
+        if (arg.size() != 1 || arg[0] < '0' || arg[0] > '3') {
+            script.err() << "Usage: :opt 0|1|2|3\n";
+            return;
+        }
+        session->setOptLevel(arg[0] - '0');
+        script.out() << "Optimization level: O" << session->getOptLevel() << "\n";
+    } else if (name == "fastmath") {
+        if (arg != "on" && arg != "off") {
+            script.err() << "Usage: :fastmath on|off\n";
+            return;
+        }
+        session->setFastMath(arg == "on");
+        script.out() << "Fast-math: " << arg << "\n";
+    } else if (name == "precision") {
+        Precision p;
+        if (!parsePrecision(arg, p)) {
+            script.err() << "Usage: :precision f64|f32|mixed\n";
+            return;
+        }
+        session->setPrecision(p);
+        script.out() << "Precision: " << arg << "\n";
+    } else if (name == "summation") {
+        if (!parseSummation(arg, summation)) {
+            script.err() << "Usage: :summation pairwise|kahan\n";
+            return;
+        }
+        script.out() << "Summation: " << arg << "\n";
+    } else if (name == "load") {
+        if (arg.empty()) {
+            script.err() << "Usage: :load file.csv\n";
+            return;
+        }
+        try {
+            size_t rows = loadColumns(arg);
+            script.out() << "Loaded: " << rows << " rows from " << arg << "\n";
+        } catch (const std::exception& e) {
+            script.err() << "Error: " << e.what() << "\n";
+        }
+    } else if (name == "engine") {
+        if (!parseEngine(arg, engine)) {
+            script.err() << "Usage: :engine tiered|jit|vm|tree\n";
+            return;
+        }
+        script.out() << "Engine: " << arg << "\n";
+    } else if (name == "tier") {
+        TierPolicy& policy = tiered->policy();
+        std::string value;
+        in >> value;
+        if (arg == "vm" || arg == "jit") {
+            unsigned n = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+            if (n == 0) {
+                script.err() << "Usage: :tier vm|jit <runs>\n";
+                return;
             }
-            Value *L = emit(bin->left.get());
-            Value *R = emit(bin->right.get());
-            switch (bin->op) {
-                case '+': return Builder.CreateFAdd(L, R, "addtmp");
-                case '-': return Builder.CreateFSub(L, R, "subtmp");
-                case '*': return Builder.CreateFMul(L, R, "multmp");
-                case '/': return Builder.CreateFDiv(L, R, "divtmp");
-                default: throw std::runtime_error("Unknown binary operator");
+            (arg == "vm" ? policy.vmThreshold : policy.jitThreshold) = n;
+        } else if (arg == "trace") {
+            policy.trace = value == "off" ? nullptr : &std::cerr;
+        } else if (!arg.empty()) {
+            script.err() << "Usage: :tier [vm <runs> | jit <runs> | trace on|off]\n";
+            return;
+        }
+        script.out() << "Tiers: vm after " << policy.vmThreshold << " runs, jit (O"
+                  << policy.jitOptLevel << ") after " << policy.jitThreshold << " runs"
+                  << (policy.trace ? ", tracing" : "") << "\n";
+    } else if (name == "ad") {
+        if (!parseADMode(arg, adMode)) {
+            script.err() << "Usage: :ad forward|reverse\n";
+            return;
+        }
+        script.out() << "Differentiation: " << arg << " mode\n";
+    } else if (name == "cache") {
+        if (!objectCache) {
+            script.out() << "Object cache: off\n";
+            return;
+        }
+        script.out() << "Object cache: " << objectCache->getDirectory() << ", " << objectCache->hits()
+                  << " hits, " << objectCache->misses() << " misses\n";
+    } else if (name == "stats") {
+        if (arg.empty()) {
+            printStats(script.out());
+        } else if (arg == "json") {
+            writeStatsJSON(script.out());
+        } else if (arg == "reset") {
+            resetStats();
+            script.out() << "Statistics reset\n";
+        } else if (arg == "timing") {
+            std::string value;
+            in >> value;
+            if (value != "on" && value != "off") {
+                script.err() << "Usage: :stats [json | reset | timing on|off]\n";
+                return;
+            }
+            if (!statsEnabled()) {
+                script.err() << "Statistics are not built in (DSL_NO_STATS)\n";
+                return;
             }
+            setStatsTiming(value == "on");
+            script.out() << "Stats timing: " << value << "\n";
+        } else {
+            script.err() << "Usage: :stats [json | reset | timing on|off]\n";
         }
-        if (auto *func = dynamic_cast<FunctionNode*>(nd)) {
-            double res = func->evaluate(symbols);
-            return ConstantFP::get(Context, APFloat(res));
+    } else if (name == "reactive") {
+        if (arg != "on" && arg != "off") {
+            script.err() << "Usage: :reactive on|off\n";
+            return;
         }
-        throw std::runtime_error("Unknown AST node in codegen");
-    };
+        if (arg == "off")
+            dependencies.reset();
+        else if (!dependencies)
+            dependencies = std::make_unique<DependencyGraph>();
+        script.out() << "Reactive: " << arg << "\n";
+    } else if (name == "deps") {
+        if (arg.empty()) {
+            script.err() << "Usage: :deps name\n";
+            return;
+        }
+        if (!dependencies) {
+            script.err() << "Reactive mode is off\n";
+            return;
+        }
+        SymbolTable& symbols = script.symbols();
+        int slot = symbols.find(arg);
+        if (slot < 0) {
+            script.err() << "Undefined variable: " << arg << "\n";
+            return;
+        }
+        auto list = [&](const char* what, const std::vector<int>& slots) {
+            script.out() << what;
+            for (int s : slots)
+                script.out() << " " << symbols.name(s);
+            if (slots.empty())
+                script.out() << " (none)";
+        };
+        script.out() << arg << ":";
+        list(" reads", dependencies->inputs(slot));
+        list(", read by", dependencies->dependents(slot));
+        script.out() << "\n";
+    } else if (name == "dump") {
+        std::string value;
+        in >> value;
+        if ((value != "on" && value != "off") || !setDump(arg, value == "on")) {
+            script.err() << "Usage: :dump tokens|ast|ir|all on|off\n";
+            return;
+        }
+        script.out() << "Dump " << arg << ": " << value << "\n";
+    } else {
+        script.err() << "Unknown directive: :" << name << "\n";
+    }
+}
 
-    Value *RetVal = emit(node);
-    Builder.CreateRet(RetVal);
-    std::error_code EC;
-    raw_fd_ostream out("ir.ll", EC, sys::fs::OpenFlags::OF_None); // Use the correct enum
-    F->getParent()->print(out, nullptr);
-    verifyFunction(*F);
-
-    InitializeNativeTarget(); 
-    InitializeNativeTargetAsmPrinter(); 
-    InitializeNativeTargetAsmParser();
-
-    std::string ErrStr;
-    EngineBuilder EB(std::move(ModulePtr));
-    EB.setErrorStr(&ErrStr).setEngineKind(EngineKind::JIT).setMCJITMemoryManager(
-        std::make_unique<SectionMemoryManager>());
-    ExecutionEngine *EE = EB.create();
-    if (!EE) {
-        std::cerr << "Failed to create ExecutionEngine: " << ErrStr << "\n";
-        throw std::runtime_error("JIT initialization failed");
-    }
-    EE->finalizeObject();
-    auto FuncAddr = EE->getFunctionAddress("expr");
-    if (!FuncAddr) {
-        delete EE;
-        throw std::runtime_error("Function not found in JIT");
-    }
-    double (*FP)() = (double (*)())FuncAddr;
-    double result = FP();
-    delete EE;
-    return result;
+// --stats: the statistics as a table on stderr or, given a file, as JSON.
+static void reportStats(const char* file) {
+    if (!*file) {
+        std::cerr << "[stats]\n";
+        printStats(std::cerr);
+        return;
+    }
+    std::ofstream out(file);
+    writeStatsJSON(out);
+    if (!out)
+        std::cerr << "Failed to write " << file << "\n";
 }
 
+// Runs a script's statements with the options and engines set up by main().
+class Interpreter : public ScriptHost {
+public:
+    double evaluate(Script& script, ASTNode* node) override {
+        locate(script);
+        return evaluateAST(script, node);
+    }
+    double gradient(Script& script, ASTNode* node,
+                    std::vector<std::pair<std::string, double>>& partials) override {
+        locate(script);
+        return evaluateGradient(script, node, partials);
+    }
+    double solve(Script& script, ASTNode* residual, const std::string& var,
+                 ASTNode* lo, ASTNode* hi) override {
+        if (aot)
+            aotUnsupported("Solve for " + var);
+        locate(script);
+        return solveEquation(script, residual, var, lo, hi);
+    }
+    void defineFunction(Script& script, const std::string& name,
+                        const std::vector<std::string>& params, ASTNode* body) override {
+        ::defineFunction(script, name, params, body);
+    }
+    bool compileStatement(Script& script, const char* name, ASTNode* node) override {
+        return ::compileStatement(script, name, node);
+    }
+    void sweep(Script& script, const SweepStatement& sweep) override {
+        if (aot)
+            aotUnsupported(std::string("Sweep over ") + sweep.var);
+        locate(script);
+        runSweep(script, sweep);
+    }
+    void assigned(Script& script, const char* name, ASTNode* node) override {
+        if (dependencies)
+            trackAssignment(script, name, node);
+    }
+    void runDirective(Script& script, const char* text) override {
+        ::runDirective(script, text);
+    }
+
+private:
+    // Name the code compiled for this statement after its line in the perf map.
+    static void locate(Script& script) {
+        if (perfMap)
+            session->setSourceLocation(sourceName + ":" + std::to_string(script.line()));
+    }
+};
+
 int main(int argc, char* argv[]) {
     std::cout << "Mathematical DSL Interpreter (type 'exit;' to quit)\n";
-    InitializeNativeTarget(); 
-    InitializeNativeTargetAsmPrinter(); 
-    InitializeNativeTargetAsmParser();
-    std::ofstream("ast.txt", std::ios::trunc).close();
-    if (argc == 2) {
-    FILE* file = fopen(argv[1], "r");
-    if (!file) {
-        std::cerr << "Failed to open file: " << argv[1] << "\n";
+    const char* path = nullptr;
+    int optLevel = 0;
+    bool fastMath = false;
+    Precision precision = Precision::F64;
+    VectorLibrary vectorLibrary = VectorLibrary::None;
+    TierPolicy policy;
+    std::vector<std::string> dumps;
+    const char* cacheDir = nullptr;
+    std::string emitObj, emitSo, emitHeader, targetCpu;
+    bool mapInput = true;
+    const char* statsFile = nullptr;
+    bool writePerfMap = false, jitDebug = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--time") == 0)
+            reportTiming = true;
+        else if (std::strcmp(argv[i], "--fast-math") == 0)
+            fastMath = true;
+        else if (std::strcmp(argv[i], "--no-simplify") == 0)
+            simplifyAST = false;
+        else if (std::strcmp(argv[i], "--no-mmap") == 0)
+            mapInput = false;
+        else if (std::strncmp(argv[i], "--engine=", 9) == 0) {
+            if (!parseEngine(argv[i] + 9, engine)) {
+                std::cerr << "Unknown engine: " << argv[i] + 9 << " (expected tiered, jit, vm or tree)\n";
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--precision=", 12) == 0) {
+            if (!parsePrecision(argv[i] + 12, precision)) {
+                std::cerr << "Unknown precision: " << argv[i] + 12 << " (expected f64, f32 or mixed)\n";
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--summation=", 12) == 0) {
+            if (!parseSummation(argv[i] + 12, summation)) {
+                std::cerr << "Unknown summation: " << argv[i] + 12 << " (expected pairwise or kahan)\n";
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--vector-library=", 17) == 0) {
+            std::string name = argv[i] + 17;
+            if (name == "libmvec")
+                vectorLibrary = VectorLibrary::LibMVec;
+            else if (name != "none") {
+                std::cerr << "Unknown vector library: " << name << " (expected libmvec or none)\n";
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--ad=", 5) == 0) {
+            if (!parseADMode(argv[i] + 5, adMode)) {
+                std::cerr << "Unknown AD mode: " << argv[i] + 5 << " (expected forward or reverse)\n";
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--tier-vm=", 10) == 0)
+            policy.vmThreshold = (unsigned)std::max(1l, std::strtol(argv[i] + 10, nullptr, 10));
+        else if (std::strncmp(argv[i], "--tier-jit=", 11) == 0)
+            policy.jitThreshold = (unsigned)std::max(1l, std::strtol(argv[i] + 11, nullptr, 10));
+        else if (std::strncmp(argv[i], "--emit-obj=", 11) == 0)
+            emitObj = argv[i] + 11;
+        else if (std::strncmp(argv[i], "--emit-so=", 10) == 0)
+            emitSo = argv[i] + 10;
+        else if (std::strncmp(argv[i], "--emit-header=", 14) == 0)
+            emitHeader = argv[i] + 14;
+        else if (std::strncmp(argv[i], "--target-cpu=", 13) == 0)
+            targetCpu = argv[i] + 13;
+        else if (std::strncmp(argv[i], "--cache-dir=", 12) == 0)
+            cacheDir = argv[i] + 12;
+        else if (std::strncmp(argv[i], "--dump-", 7) == 0)
+            dumps.push_back(argv[i] + 7);
+        else if (std::strcmp(argv[i], "--stats") == 0 || std::strncmp(argv[i], "--stats=", 8) == 0) {
+            statsFile = argv[i][7] ? argv[i] + 8 : "";
+            setStatsTiming(true);
+        }
+        else if (std::strcmp(argv[i], "--reactive") == 0)
+            dependencies = std::make_unique<DependencyGraph>();
+        else if (std::strcmp(argv[i], "--perf-map") == 0)
+            writePerfMap = true;
+        else if (std::strcmp(argv[i], "--jit-debug") == 0)
+            jitDebug = true;
+        else if (std::strcmp(argv[i], "--trace-tiers") == 0)
+            policy.trace = &std::cerr;
+        else if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3])
+            optLevel = argv[i][2] - '0';
+        else
+            path = argv[i];
+    }
+    JITSession jit;
+    if (cacheDir) {
+        try {
+            objectCache = std::make_unique<DiskObjectCache>(cacheDir);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        jit.setObjectCache(objectCache.get());
+    }
+    if (writePerfMap) {
+        try {
+            perfMap = std::make_unique<PerfMapListener>();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        jit.setPerfMap(perfMap.get());
+    }
+    if (jitDebug)
+        jit.addEventListener(llvm::JITEventListener::createGDBRegistrationListener());
+    if (path)
+        sourceName = path;
+    try {
+        jit.setVectorLibrary(vectorLibrary);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
         return 1;
     }
-    extern FILE* yyin;
-    yyin = file;
-}
-    if (yyparse() != 0) {
+    jit.setOptLevel(optLevel);
+    jit.setFastMath(fastMath);
+    jit.setPrecision(precision);
+    session = &jit;
+    TieredEvaluator tier(jit);
+    tier.policy() = policy;
+    tiered = &tier;
+    AOTCompiler compiler;
+    if (!emitObj.empty() || !emitSo.empty()) {
+        aot = &compiler;
+        if (emitHeader.empty()) {
+            const std::string& out = emitSo.empty() ? emitObj : emitSo;
+            emitHeader = out.substr(0, out.find_last_of('.')) + ".h";
+        }
+    }
+    for (const std::string& what : dumps) {
+        if (!setDump(what, true)) {
+            std::cerr << "Unknown dump: " << what << " (expected tokens, ast, ir or all)\n";
+            return 1;
+        }
+    }
+    int fd = 0;
+    if (path) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Failed to open file: " << path << "\n";
+            return 1;
+        }
+    }
+    Interpreter interpreter;
+    Script script(interpreter);
+    bool parsed;
+    try {
+        parsed = mapInput ? script.runMapped(fd) : script.run(fd);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        if (statsFile)
+            reportStats(statsFile);
+        return 1;
+    }
+    if (fd)
+        close(fd);
+    if (statsFile)
+        reportStats(statsFile);
+    if (reportTiming) {
+        double seconds = script.parseSeconds();
+        std::cerr << "[time] parse: " << script.bytesParsed() << " bytes in " << seconds * 1e3
+                  << "ms (" << (seconds > 0 ? script.bytesParsed() / seconds / 1e6 : 0)
+                  << " MB/s, " << script.names().size() << " distinct names)\n";
+    }
+    if (!parsed) {
         std::cerr << "Parsing failed.\n";
         return 1;
     }
+    if (aot) {
+        if (aotFailed) {
+            std::cerr << "Nothing written: the script has statements that cannot be compiled.\n";
+            return 1;
+        }
+        try {
+            std::string obj = emitObj.empty() ? emitSo + ".o" : emitObj;
+            compiler.emitObject(obj, optLevel, fastMath, targetCpu);
+            if (!emitSo.empty()) {
+                AOTCompiler::linkShared(obj, emitSo);
+                if (emitObj.empty())
+                    std::remove(obj.c_str());
+            }
+            compiler.emitHeader(emitHeader, path ? path : "stdin");
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "Wrote " << (emitSo.empty() ? emitObj : emitSo) << " and " << emitHeader << "\n";
+    }
     return 0;
 }
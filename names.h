@@ -0,0 +1,36 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <cstring>
+#include <string_view>
+#include <unordered_set>
+#include "arena.h"
+
+// Interned identifiers. Every distinct name is stored once, NUL-terminated,
+// and lives as long as the pool, so the scanner can hand out the same pointer
+// for each occurrence of a name without allocating.
+class NamePool {
+public:
+    NamePool() : text(16 << 10) {}
+    NamePool(const NamePool&) = delete;
+    NamePool& operator=(const NamePool&) = delete;
+
+    const char* intern(const char* s, size_t n) {
+        auto it = names.find(std::string_view(s, n));
+        if (it != names.end())
+            return it->data();
+        char* copy = static_cast<char*>(text.allocate(n + 1, 1));
+        std::memcpy(copy, s, n);
+        copy[n] = '\0';
+        names.insert(std::string_view(copy, n));
+        return copy;
+    }
+
+    size_t size() const { return names.size(); }
+
+private:
+    Arena text;
+    std::unordered_set<std::string_view> names;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "objcache.h"
+#include <stdexcept>
+#include <unistd.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+// Named metadata holding a module's cache key between tag() and compilation.
+static const char* KeyMetadata = "dsl.objcache.key";
+
+DiskObjectCache::DiskObjectCache(std::string dir) : dir(std::move(dir)) {
+    if (std::error_code EC = sys::fs::create_directories(this->dir))
+        throw std::runtime_error("Cannot create cache directory " + this->dir + ": " + EC.message());
+}
+
+bool DiskObjectCache::tag(Module& M) {
+    std::string text;
+    raw_string_ostream out(text);
+    M.print(out, nullptr);
+    out.flush();
+    // The module name is not part of the code; drop the ModuleID line.
+    StringRef body(text);
+    if (body.startswith(";"))
+        body = body.split('\n').second;
+
+    SHA1 Hash;
+    Hash.update(target);
+    Hash.update("\n");
+    Hash.update(body);
+    std::string key = toHex(Hash.final(), true);
+
+    LLVMContext& Ctx = M.getContext();
+    NamedMDNode* Node = M.getOrInsertNamedMetadata(KeyMetadata);
+    Node->clearOperands();
+    Node->addOperand(MDNode::get(Ctx, MDString::get(Ctx, key)));
+    if (!sys::fs::exists(pathFor(key)))
+        return false;
+    // The caller will skip optimization. Should the file vanish before it is
+    // loaded, the unoptimized object must not be stored under this key.
+    Node->addOperand(MDNode::get(Ctx, MDString::get(Ctx, "unoptimized")));
+    return true;
+}
+
+std::string DiskObjectCache::pathFor(const std::string& key) const {
+    return dir + "/" + key + ".o";
+}
+
+static std::string keyOf(const Module* M) {
+    NamedMDNode* Node = M->getNamedMetadata(KeyMetadata);
+    if (!Node || Node->getNumOperands() == 0)
+        return "";
+    return cast<MDString>(Node->getOperand(0)->getOperand(0))->getString().str();
+}
+
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module* M) {
+    std::string key = keyOf(M);
+    if (key.empty())
+        return nullptr;
+    auto Buf = MemoryBuffer::getFile(pathFor(key), /*IsText=*/false,
+                                     /*RequiresNullTerminator=*/false);
+    if (!Buf) {
+        ++missCount;
+        return nullptr;
+    }
+    ++hitCount;
+    return std::move(*Buf);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const Module* M, MemoryBufferRef Obj) {
+    std::string key = keyOf(M);
+    if (key.empty() || M->getNamedMetadata(KeyMetadata)->getNumOperands() > 1)
+        return;
+    std::string path = pathFor(key);
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    std::error_code EC;
+    {
+        raw_fd_ostream out(tmp, EC, sys::fs::OF_None);
+        if (EC)
+            return;  // a cache that cannot be written just stays cold
+        out << Obj.getBuffer();
+    }
+    if (sys::fs::rename(tmp, path))
+        sys::fs::remove(tmp);
+}
@@ -0,0 +1,48 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+
+namespace llvm {
+class Module;
+}
+
+// Native objects for JIT'd modules, kept as files in a directory so that later
+// runs load them instead of optimizing and compiling again. The key is a SHA-1
+// of the unoptimized IR (without the module name) and of the target: triple,
+// CPU, features and codegen level. Files are written under a temporary name
+// and renamed, so concurrent processes can share a directory.
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+    // Creates dir if needed. Throws std::runtime_error if that fails.
+    explicit DiskObjectCache(std::string dir);
+
+    // Identifies the code generator; part of every key.
+    void setTarget(std::string id) { target = std::move(id); }
+
+    // Compute M's key and record it in M for getObject/notifyObjectCompiled.
+    // Call before optimizing. Returns whether an object is already stored, in
+    // which case the module need not be optimized (and its object, if it ends
+    // up compiled after all, is not stored).
+    bool tag(llvm::Module& M);
+
+    void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+
+    const std::string& getDirectory() const { return dir; }
+    unsigned long hits() const { return hitCount; }
+    unsigned long misses() const { return missCount; }
+
+private:
+    std::string pathFor(const std::string& key) const;
+
+    std::string dir;
+    std::string target;
+    std::atomic<unsigned long> hitCount{0};
+    std::atomic<unsigned long> missCount{0};
+};
+
+#endif
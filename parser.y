@@ -1,39 +1,63 @@
 %{
 #include "ast.h"
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
-#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "diff.h"
+#include "functions.h"
+#include "script.h"
+#include "trace.h"
 using namespace std;
-using SymbolTable = unordered_map<string, double>;
-extern int yylex();
-extern void yyerror(const char *s);
-std::unique_ptr<ASTNode> root;
-SymbolTable symbol_table;
-
-double evaluateAST(ASTNode* node, SymbolTable& symbols);
+void yyerror(Script& script, const char *s);
+static void solveStatement(Script& script, ASTNode* lhs, ASTNode* rhs, const char* var,
+                           ASTNode* lo, ASTNode* hi);
+static void sweepStatement(Script& script, SweepStatement sweep);
 %}
 
 %define parse.error verbose
+// Reentrant push parser: Script feeds it one token at a time, and all state
+// lives in the Script passed to every action.
+%define api.pure full
+%define api.push-pull push
+%parse-param {Script& script}
 
 %code requires {
+    #include <string>
+    #include <vector>
     #include "ast.h"
     using ASTNode = ASTNode;
-    using ASTNodePtr = std::unique_ptr<ASTNode>;
+    class Script;
 }
 
 %union {
     ASTNode* node;
     double    fval;
     char*     sval;
+    const char* name;  // interned in the script's NamePool; never freed
+    std::vector<ASTNode*>* nodes;
+    std::vector<std::string>* names;
 }
 
 %token <fval> NUMBER
-%token <sval> ID
-%token VAR SIN COS LOG SQRT
+%token <name> ID
+%token <sval> DIRECTIVE STRING
+%token EXIT VAR FUNC SIN COS LOG SQRT GRAD DIFF SOLVE FOR IN DOTDOT
 %left '+' '-'
 %left '*' '/'
 %right '^'
-%type <node> expression
+%type <node> expression step
+%type <name> name
+%type <nodes> arguments argument_list
+%type <names> parameters parameter_list
+%destructor { ASTNodePtr($$); } <node>
+%destructor { for (ASTNode* n : *$$) ASTNodePtr{n}; delete $$; } <nodes>
+%destructor { delete $$; } <names>
+%destructor { free($$); } <sval>
 
 %%
 
@@ -43,53 +67,274 @@ program:
   ;
 
 statement:
-    VAR ID '=' expression ';' {
-        double val = evaluateAST($4, symbol_table);
-        symbol_table[$2] = val;
-        cout << "Assigned: " << $2 << " = " << val << endl;
+    VAR name '=' expression ';' {
+        ASTNodePtr expr($4);
+        if (!script.host().compileStatement(script, $2, expr.get())) try {
+            double val = script.host().evaluate(script, expr.get());
+            script.symbols().set(script.symbols().slot($2), val);
+            script.out() << "Assigned: " << $2 << " = " << val << endl;
+            script.host().assigned(script, $2, expr.get());
+        } catch (const std::exception& e) {
+            script.err() << "Error: " << e.what() << endl;
+        }
 
         // AST Dump
-        std::ofstream ast_out("ast.txt", std::ios::app);
-        ast_out << "Assignment to " << $2 << ":\n";
-        $4->print(ast_out);
-        ast_out << "------------------------\n";
-        ast_out.close();
+        if (astDump) {
+            std::ostringstream ast_out;
+            ast_out << "Assignment to " << $2 << ":\n";
+            expr->print(ast_out);
+            ast_out << "------------------------\n";
+            astDump->write(ast_out.str());
+        }
 
-        free($2);
+        expr.reset();
+        script.arena().reset();
     }
   | expression ';' {
-        double val = evaluateAST($1, symbol_table);
-        cout << "Result: " << val << endl;
+        ASTNodePtr expr($1);
+        if (!script.host().compileStatement(script, nullptr, expr.get())) try {
+            double val = script.host().evaluate(script, expr.get());
+            script.out() << "Result: " << val << endl;
+        } catch (const std::exception& e) {
+            script.err() << "Error: " << e.what() << endl;
+        }
 
         // AST Dump
-        std::ofstream ast_out("ast.txt", std::ios::app);
-        ast_out << "Expression:\n";
-        $1->print(ast_out);
-        ast_out << "------------------------\n";
-        ast_out.close();
+        if (astDump) {
+            std::ostringstream ast_out;
+            ast_out << "Expression:\n";
+            expr->print(ast_out);
+            ast_out << "------------------------\n";
+            astDump->write(ast_out.str());
+        }
+
+        expr.reset();
+        script.arena().reset();
+    }
+  | FUNC ID '(' parameters ')' '=' expression ';' {
+        std::unique_ptr<std::vector<std::string>> params($4);
+        ASTNodePtr body($7);
+        try {
+            script.host().defineFunction(script, $2, *params, body.get());
+            script.out() << "Defined: " << $2 << "(";
+            for (size_t i = 0; i < params->size(); ++i)
+                script.out() << (i ? ", " : "") << (*params)[i];
+            script.out() << ")" << endl;
+        } catch (const std::exception& e) {
+            script.err() << "Error: " << e.what() << endl;
+        }
+
+        // AST Dump
+        if (astDump) {
+            std::ostringstream ast_out;
+            ast_out << "Function " << $2 << ":\n";
+            body->print(ast_out);
+            ast_out << "------------------------\n";
+            astDump->write(ast_out.str());
+        }
+
+        body.reset();
+        script.arena().reset();
+    }
+  | GRAD expression ';' {
+        ASTNodePtr expr($2);
+        if (!script.host().compileStatement(script, nullptr, expr.get())) try {
+            std::vector<std::pair<std::string, double>> partials;
+            double val = script.host().gradient(script, expr.get(), partials);
+            script.out() << "Result: " << val << endl;
+            for (const auto& p : partials)
+                script.out() << "  d/d" << p.first << " = " << p.second << endl;
+        } catch (const std::exception& e) {
+            script.err() << "Error: " << e.what() << endl;
+        }
+
+        // AST Dump
+        if (astDump) {
+            std::ostringstream ast_out;
+            ast_out << "Gradient of:\n";
+            expr->print(ast_out);
+            ast_out << "------------------------\n";
+            astDump->write(ast_out.str());
+        }
+
+        expr.reset();
+        script.arena().reset();
     }
+  | SOLVE expression '=' expression FOR name ';' { solveStatement(script, $2, $4, $6, nullptr, nullptr); }
+  | SOLVE expression '=' expression FOR name IN '[' expression ',' expression ']' ';' {
+        solveStatement(script, $2, $4, $6, $9, $11);
+    }
+  | FOR name IN expression DOTDOT expression step '{' expression '}' ';' {
+        sweepStatement(script, {$2, $4, $6, $7, $9});
+    }
+  | FOR name IN expression DOTDOT expression step '{' expression '}' ID ';' {
+        sweepStatement(script, {$2, $4, $6, $7, $9, $11});
+    }
+  | FOR name IN expression DOTDOT expression step '{' expression '}' '>' STRING ';' {
+        sweepStatement(script, {$2, $4, $6, $7, $9, nullptr, $12});
+        free($12);
+    }
+  | EXIT { YYACCEPT; }  // end of input, whatever follows
+  | DIRECTIVE { script.host().runDirective(script, $1); free($1); }  // ';' is in the token
   | error ';' {
-        yyerror("Syntax error");
+        yyerror(script, "Syntax error");
         yyerrok;
+        // Discarded subtrees were destroyed by %destructor.
+        script.arena().reset();
     }
   ;
 
+step:
+    /* empty */ { $$ = nullptr; }
+  | ID expression {
+        if (strcmp($1, "step") != 0) {
+            ASTNodePtr{$2};
+            yyerror(script, ("Expected step, got " + std::string($1)).c_str());
+            YYERROR;
+        }
+        $$ = $2;
+    }
+  ;
+
+parameters:
+    /* empty */ { $$ = new std::vector<std::string>(); }
+  | parameter_list
+  ;
+
+parameter_list:
+    ID { $$ = new std::vector<std::string>{$1}; }
+  | parameter_list ',' ID { $$ = $1; $$->push_back($3); }
+  ;
+
+// A variable. The keywords other than var, exit and the built-in functions
+// can be variables too: which one is meant follows from the next token.
+name:
+    ID
+  | GRAD  { $$ = script.names().intern("grad", 4); }
+  | DIFF  { $$ = script.names().intern("diff", 4); }
+  | SOLVE { $$ = script.names().intern("solve", 5); }
+  | FOR   { $$ = script.names().intern("for", 3); }
+  | IN    { $$ = script.names().intern("in", 2); }
+  ;
+
+arguments:
+    /* empty */ { $$ = new std::vector<ASTNode*>(); }
+  | argument_list
+  ;
+
+argument_list:
+    expression { $$ = new std::vector<ASTNode*>{$1}; }
+  | argument_list ',' expression { $$ = $1; $$->push_back($3); }
+  ;
+
 expression:
-    NUMBER          { $$ = new NumberNode($1); }
-  | ID              { $$ = new VariableNode($1); free($1); }
-  | expression '+' expression { $$ = new BinaryOpNode('+', ASTNodePtr($1), ASTNodePtr($3)); }
-  | expression '-' expression { $$ = new BinaryOpNode('-', ASTNodePtr($1), ASTNodePtr($3)); }
-  | expression '*' expression { $$ = new BinaryOpNode('*', ASTNodePtr($1), ASTNodePtr($3)); }
-  | expression '/' expression { $$ = new BinaryOpNode('/', ASTNodePtr($1), ASTNodePtr($3)); }
-  | expression '^' expression { $$ = new BinaryOpNode('^', ASTNodePtr($1), ASTNodePtr($3)); }
-  | SIN '(' expression ')' { $$ = new FunctionNode("sin", ASTNodePtr($3)); }
-  | COS '(' expression ')' { $$ = new FunctionNode("cos", ASTNodePtr($3)); }
-  | LOG '(' expression ')' { $$ = new FunctionNode("log", ASTNodePtr($3)); }
-  | SQRT '(' expression ')' { $$ = new FunctionNode("sqrt", ASTNodePtr($3)); }
+    NUMBER          { $$ = script.arena().make<NumberNode>($1); }
+  | name            { $$ = script.arena().make<VariableNode>($1); }
+  | expression '+' expression { $$ = script.arena().make<BinaryOpNode>('+', ASTNodePtr($1), ASTNodePtr($3)); }
+  | expression '-' expression { $$ = script.arena().make<BinaryOpNode>('-', ASTNodePtr($1), ASTNodePtr($3)); }
+  | expression '*' expression { $$ = script.arena().make<BinaryOpNode>('*', ASTNodePtr($1), ASTNodePtr($3)); }
+  | expression '/' expression { $$ = script.arena().make<BinaryOpNode>('/', ASTNodePtr($1), ASTNodePtr($3)); }
+  | expression '^' expression { $$ = script.arena().make<BinaryOpNode>('^', ASTNodePtr($1), ASTNodePtr($3)); }
+  | SIN '(' expression ')' { $$ = script.arena().make<FunctionNode>("sin", ASTNodePtr($3)); }
+  | COS '(' expression ')' { $$ = script.arena().make<FunctionNode>("cos", ASTNodePtr($3)); }
+  | LOG '(' expression ')' { $$ = script.arena().make<FunctionNode>("log", ASTNodePtr($3)); }
+  | SQRT '(' expression ')' { $$ = script.arena().make<FunctionNode>("sqrt", ASTNodePtr($3)); }
+  | ID '(' arguments ')' {
+        std::vector<ASTNodePtr> args;
+        for (ASTNode* n : *$3)
+            args.emplace_back(n);
+        delete $3;
+        std::string name($1);
+        const FunctionDef* def = script.functions().find(name);
+        if (!def || def->params.size() != args.size()) {
+            yyerror(script, ((def ? "Wrong number of arguments to " : "Unknown function: ") + name).c_str());
+            YYERROR;
+        }
+        $$ = script.arena().make<CallNode>(def, std::move(args));
+    }
+  | ID '(' argument_list ID parameter_list ')' {
+        // sum(expr over cols), mean, min, max, dot(a, b over cols)
+        std::vector<ASTNodePtr> args;
+        for (ASTNode* n : *$3)
+            args.emplace_back(n);
+        delete $3;
+        std::unique_ptr<std::vector<std::string>> over($5);
+        ReductionNode::Kind kind;
+        if (!ReductionNode::parseKind($1, kind) || strcmp($4, "over") != 0) {
+            yyerror(script, ("Unknown reduction: " + std::string($1) + "(... " + $4 + " ...)").c_str());
+            YYERROR;
+        }
+        if (args.size() != (kind == ReductionNode::Dot ? 2u : 1u)) {
+            yyerror(script, ("Wrong number of arguments to " + std::string($1)).c_str());
+            YYERROR;
+        }
+        ASTNodePtr second = args.size() == 2 ? std::move(args[1]) : nullptr;
+        $$ = script.arena().make<ReductionNode>(kind, std::move(args[0]), std::move(second),
+                                                std::move(*over));
+    }
+  | DIFF '(' expression ',' name ')' {
+        // Symbolic derivative, spliced in place of the call.
+        ASTNodePtr expr($3);
+        $$ = differentiate(expr.get(), $5, script.arena()).release();
+    }
   | '(' expression ')' { $$ = $2; }
   ;
 %%
 
-void yyerror(const char *s) {
-    std::cerr << "Parse error: " << s << std::endl;
+// solve lhs = rhs for var [in [lo, hi]]: find a root of lhs - rhs.
+static void solveStatement(Script& script, ASTNode* lhs, ASTNode* rhs, const char* var,
+                           ASTNode* lo, ASTNode* hi) {
+    ASTNodePtr residual(script.arena().make<BinaryOpNode>('-', ASTNodePtr(lhs), ASTNodePtr(rhs)));
+    ASTNodePtr bracketLo(lo), bracketHi(hi);
+    try {
+        double root = script.host().solve(script, residual.get(), var, bracketLo.get(), bracketHi.get());
+        script.out() << "Solved: " << var << " = " << root << endl;
+        script.host().assigned(script, var, nullptr);
+    } catch (const std::exception& e) {
+        script.err() << "Error: " << e.what() << endl;
+    }
+
+    // AST Dump
+    if (astDump) {
+        std::ostringstream ast_out;
+        ast_out << "Solve for " << var << ", residual:\n";
+        residual->print(ast_out);
+        ast_out << "------------------------\n";
+        astDump->write(ast_out.str());
+    }
+
+    residual.reset();
+    bracketLo.reset();
+    bracketHi.reset();
+    script.arena().reset();
+}
+
+// for var in from..to [step s] { body } [reduction | > "path"]: the body at every
+// point of the range, compiled once for all of them.
+static void sweepStatement(Script& script, SweepStatement sweep) {
+    ASTNodePtr from(sweep.from), to(sweep.to), step(sweep.step), body(sweep.body);
+    try {
+        script.host().sweep(script, sweep);
+    } catch (const std::exception& e) {
+        script.err() << "Error: " << e.what() << endl;
+    }
+
+    // AST Dump
+    if (astDump) {
+        std::ostringstream ast_out;
+        ast_out << "Sweep over " << sweep.var << ":\n";
+        body->print(ast_out);
+        ast_out << "------------------------\n";
+        astDump->write(ast_out.str());
+    }
+
+    from.reset();
+    to.reset();
+    step.reset();
+    body.reset();
+    script.arena().reset();
+}
+
+void yyerror(Script& script, const char *s) {
+    script.err() << "Parse error: " << s << std::endl;
 }
@@ -0,0 +1,62 @@
+#include "perfmap.h"
+#include <cinttypes>
+#include <stdexcept>
+#include <unistd.h>
+#include <llvm/Object/SymbolSize.h>
+
+using namespace llvm;
+
+PerfMapListener::PerfMapListener(const std::string& path)
+    : path(path.empty() ? "/tmp/perf-" + std::to_string(getpid()) + ".map" : path),
+      file(std::fopen(this->path.c_str(), "a")) {
+    if (!file)
+        throw std::runtime_error("Failed to open " + this->path);
+}
+
+PerfMapListener::~PerfMapListener() {
+    std::fclose(file);
+}
+
+void PerfMapListener::label(const std::string& symbol, std::string label) {
+    std::lock_guard<std::mutex> lock(m);
+    labels[symbol] = std::move(label);
+}
+
+// The debug copy of the object has its sections at their load addresses, so
+// symbol addresses are where the code actually runs.
+void PerfMapListener::notifyObjectLoaded(ObjectKey, const object::ObjectFile& obj,
+                                         const RuntimeDyld::LoadedObjectInfo& info) {
+    object::OwningBinary<object::ObjectFile> debug = info.getObjectForDebug(obj);
+    if (!debug.getBinary())
+        return;
+    std::lock_guard<std::mutex> lock(m);
+    for (const auto& sym : object::computeSymbolSizes(*debug.getBinary())) {
+        Expected<object::SymbolRef::Type> type = sym.first.getType();
+        if (!type || *type != object::SymbolRef::ST_Function) {
+            if (!type)
+                consumeError(type.takeError());
+            continue;
+        }
+        Expected<StringRef> name = sym.first.getName();
+        Expected<uint64_t> address = sym.first.getAddress();
+        if (!name || !address || sym.second == 0) {
+            if (!name)
+                consumeError(name.takeError());
+            if (!address)
+                consumeError(address.takeError());
+            continue;
+        }
+        std::string text;
+        auto it = labels.find(name->str());
+        if (it != labels.end()) {
+            text = std::move(it->second);
+            labels.erase(it);
+        } else {
+            // The lazy JIT renames the internal functions it splits out.
+            text = name->startswith("__orc_lcl.") ? name->substr(10).str() : name->str();
+        }
+        std::fprintf(file, "%" PRIx64 " %" PRIx64 " %s\n", *address, sym.second, text.c_str());
+    }
+    // perf may read the map while we are still running.
+    std::fflush(file);
+}
@@ -0,0 +1,42 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+// Tells perf which formula each piece of JIT'd code belongs to, by appending
+// one "start size name" line per function to /tmp/perf-<pid>.map as objects
+// are loaded. perf reads the file when it resolves samples in anonymous
+// memory, so `perf record` and `perf report` show the formula instead of a
+// bare address. Lines are never removed, so once freed code's memory is
+// reused, perf may show either name for it.
+class PerfMapListener : public llvm::JITEventListener {
+public:
+    // Opens (appending to) /tmp/perf-<pid>.map, or path if not empty. Throws
+    // std::runtime_error if it cannot.
+    explicit PerfMapListener(const std::string& path = "");
+    ~PerfMapListener() override;
+    PerfMapListener(const PerfMapListener&) = delete;
+    PerfMapListener& operator=(const PerfMapListener&) = delete;
+
+    // Name symbol's code after label when it is loaded (the label is then
+    // forgotten). Unlabelled symbols, such as the internal copies of user
+    // functions (fn.<name>...), keep their own names.
+    void label(const std::string& symbol, std::string label);
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile& obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+
+    const std::string& getPath() const { return path; }
+
+private:
+    std::string path;
+    FILE* file;
+    std::mutex m;  // code may be loaded on any thread calling it first
+    std::unordered_map<std::string, std::string> labels;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "reactive.h"
+#include <algorithm>
+#include <cmath>
+#include "threadpool.h"
+
+namespace {
+// Formulas per pool task: enough to outweigh handing out the task.
+constexpr size_t TaskFormulas = 16;
+
+const std::vector<int> none;
+}
+
+DependencyGraph::Node& DependencyGraph::node(int slot) {
+    if ((size_t)slot >= nodes.size())
+        nodes.resize(slot + 1);
+    return nodes[slot];
+}
+
+bool DependencyGraph::reaches(int slot, int target) const {
+    if ((size_t)slot >= nodes.size())
+        return false;
+    std::vector<bool> seen(nodes.size());
+    std::vector<int> stack{slot};
+    while (!stack.empty()) {
+        int s = stack.back();
+        stack.pop_back();
+        for (int d : nodes[s].dependents) {
+            if (d == target)
+                return true;
+            if (!seen[d]) {
+                seen[d] = true;
+                stack.push_back(d);
+            }
+        }
+    }
+    return false;
+}
+
+bool DependencyGraph::define(int slot, const ASTNode* formula, Precision precision) {
+    std::vector<int> bind;
+    if (formula)
+        collectSlots(formula, bind);
+    for (int in : bind)
+        node(in);
+    Node& n = node(slot);
+    for (int in : n.bind) {
+        std::vector<int>& d = nodes[in].dependents;
+        d.erase(std::remove(d.begin(), d.end(), slot), d.end());
+    }
+    n.bind.clear();
+    n.program.reset();
+    if (!formula)
+        return false;
+    for (int in : bind)
+        if (in == slot || reaches(slot, in))
+            return false;
+    n.program = std::make_unique<BytecodeProgram>(formula, precision);
+    n.bind = std::move(bind);
+    for (int in : n.bind)
+        nodes[in].dependents.push_back(slot);
+    return true;
+}
+
+std::vector<DependencyGraph::Update> DependencyGraph::propagate(int slot, SymbolTable& symbols,
+                                                                ThreadPool* pool) {
+    std::vector<Update> updates;
+    if ((size_t)slot >= nodes.size())
+        return updates;
+    // Everything downstream of slot, with the number of its inputs that are
+    // downstream too (-1 for the rest); a formula is ready when that is 0.
+    std::vector<int> waiting(nodes.size(), -1);
+    std::vector<int> affected, stack{slot};
+    while (!stack.empty()) {
+        int s = stack.back();
+        stack.pop_back();
+        for (int d : nodes[s].dependents) {
+            if (waiting[d] < 0) {
+                waiting[d] = 0;
+                affected.push_back(d);
+                stack.push_back(d);
+            }
+        }
+    }
+    for (int s : affected)
+        for (int in : nodes[s].bind)
+            if (waiting[in] >= 0)
+                ++waiting[s];
+
+    std::vector<int> wave, next;
+    for (int s : affected)
+        if (waiting[s] == 0)
+            wave.push_back(s);
+    // No formula of a wave reads another's variable, so each can store its
+    // result as soon as it has it.
+    double* values = symbols.values();
+    while (!wave.empty()) {
+        std::sort(wave.begin(), wave.end());
+        size_t first = updates.size();
+        updates.resize(first + wave.size());
+        auto run = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Update& u = updates[first + i];
+                const Node& n = nodes[wave[i]];
+                u.slot = wave[i];
+                try {
+                    u.value = n.program->call(values, n.bind);
+                } catch (const std::exception& e) {
+                    u.value = NAN;
+                    u.error = e.what();
+                }
+                values[u.slot] = u.value;
+            }
+        };
+        if (pool && wave.size() >= ParallelWave) {
+            size_t tasks = (wave.size() + TaskFormulas - 1) / TaskFormulas;
+            pool->parallelFor(tasks, [&](size_t t) {
+                run(t * TaskFormulas, std::min(wave.size(), (t + 1) * TaskFormulas));
+            });
+        } else {
+            run(0, wave.size());
+        }
+        next.clear();
+        for (int s : wave)
+            for (int d : nodes[s].dependents)
+                if (--waiting[d] == 0)
+                    next.push_back(d);
+        wave.swap(next);
+    }
+    return updates;
+}
+
+const std::vector<int>& DependencyGraph::inputs(int slot) const {
+    return (size_t)slot < nodes.size() ? nodes[slot].bind : none;
+}
+
+const std::vector<int>& DependencyGraph::dependents(int slot) const {
+    return (size_t)slot < nodes.size() ? nodes[slot].dependents : none;
+}
+
+size_t DependencyGraph::size() const {
+    return std::count_if(nodes.begin(), nodes.end(),
+                         [](const Node& n) { return n.program != nullptr; });
+}
@@ -0,0 +1,63 @@
+#ifndef REACTIVE_H
+#define REACTIVE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "bytecode.h"
+
+class ThreadPool;
+
+// Reactive mode: each variable keeps the formula it was last assigned, so that
+// assigning a variable again recomputes only the variables downstream of it.
+// Variables are identified by their SymbolTable slots. Formulas are flattened
+// to bytecode when defined, and the bytecode runs on every recompute.
+class DependencyGraph {
+public:
+    // One recomputed variable. error is empty unless it failed, in which case
+    // its value is NaN.
+    struct Update {
+        int slot;
+        double value;
+        std::string error;
+    };
+
+    // Formulas in a wave at least this large are spread over the pool.
+    static constexpr size_t ParallelWave = 64;
+
+    // slot now holds the value of formula, which must be resolved against the
+    // symbols. A null formula marks a value set some other way, such as by
+    // solve, that depends on nothing. A formula that reads slot, directly or
+    // through other formulas, is not kept either: the variable keeps the value
+    // just computed, like a plain assignment. Returns whether formula is kept.
+    bool define(int slot, const ASTNode* formula, Precision precision);
+
+    // Recompute everything downstream of slot and store the results in
+    // symbols. Formulas run in waves, each depending only on earlier waves
+    // and on variables outside the graph; a wave of ParallelWave or more runs
+    // on pool, if given. Updates come in the order they were computed.
+    std::vector<Update> propagate(int slot, SymbolTable& symbols, ThreadPool* pool);
+
+    // Variables slot's formula reads, and those that read slot.
+    const std::vector<int>& inputs(int slot) const;
+    const std::vector<int>& dependents(int slot) const;
+    // Number of variables with a formula.
+    size_t size() const;
+    void clear() { nodes.clear(); }
+
+private:
+    struct Node {
+        std::unique_ptr<BytecodeProgram> program;  // null: a plain value
+        std::vector<int> bind;                     // argument slots, also the inputs
+        std::vector<int> dependents;
+    };
+
+    Node& node(int slot);
+    // Whether target is downstream of slot.
+    bool reaches(int slot, int target) const;
+
+    std::vector<Node> nodes;  // by slot
+};
+
+#endif
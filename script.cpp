@@ -0,0 +1,291 @@
+#include "script.h"
+#include "parser.tab.hpp"
+#include "lexer.yy.hpp"
+#include "stats.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// Adds the time until it goes out of scope to ns.
+struct ScopedTimer {
+    explicit ScopedTimer(long long& ns) : ns(ns), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start).count();
+    }
+    long long& ns;
+    std::chrono::steady_clock::time_point start;
+};
+
+long long nanoseconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+}
+
+// Times one host call, which is a statement unless it is compileStatement.
+// The stats are brought up to date first, so that :stats sees the statements
+// before it.
+struct Script::HostCall {
+    HostCall(Script& script, bool statement)
+        : script(script), start(std::chrono::steady_clock::now()) {
+        script.flushStats(start);
+        if (statement)
+            statAdd(Counter::Statements);
+    }
+    ~HostCall() {
+        auto end = std::chrono::steady_clock::now();
+        long long ns = nanoseconds(end - start);
+        script.timedHost.ns += ns;
+        statTime(Phase::Run, ns);
+        script.resumed = end;
+    }
+    Script& script;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Times a stretch of scanning and parsing, with the statements it runs (see
+// lexNs), and adds its share to the stats at the end.
+struct Script::Lexing : ScopedTimer {
+    explicit Lexing(Script& script) : ScopedTimer(script.lexNs), script(script) {
+        script.resumed = start;
+    }
+    ~Lexing() {
+        if (statsEnabled())
+            script.flushStats(std::chrono::steady_clock::now());
+    }
+    Script& script;
+};
+
+double Script::TimedHost::evaluate(Script& script, ASTNode* node) {
+    HostCall t(script, true);
+    return host.evaluate(script, node);
+}
+
+double Script::TimedHost::gradient(Script& script, ASTNode* node,
+                                   std::vector<std::pair<std::string, double>>& partials) {
+    HostCall t(script, true);
+    return host.gradient(script, node, partials);
+}
+
+double Script::TimedHost::solve(Script& script, ASTNode* residual, const std::string& var,
+                                ASTNode* lo, ASTNode* hi) {
+    HostCall t(script, true);
+    return host.solve(script, residual, var, lo, hi);
+}
+
+void Script::TimedHost::defineFunction(Script& script, const std::string& name,
+                                       const std::vector<std::string>& params, ASTNode* body) {
+    HostCall t(script, true);
+    host.defineFunction(script, name, params, body);
+}
+
+bool Script::TimedHost::compileStatement(Script& script, const char* name, ASTNode* node) {
+    HostCall t(script, false);
+    return host.compileStatement(script, name, node);
+}
+
+void Script::TimedHost::sweep(Script& script, const SweepStatement& sweep) {
+    HostCall t(script, true);
+    host.sweep(script, sweep);
+}
+
+void Script::TimedHost::assigned(Script& script, const char* name, ASTNode* node) {
+    HostCall t(script, false);
+    host.assigned(script, name, node);
+}
+
+void Script::TimedHost::runDirective(Script& script, const char* text) {
+    HostCall t(script, true);
+    host.runDirective(script, text);
+}
+
+Script::Script(ScriptHost& host, std::ostream& out, std::ostream& err)
+    : timedHost(host), output(out), errors(err), ownSymbols(new SymbolTable),
+      ownFunctions(new FunctionTable), symbolTable(*ownSymbols), functionTable(*ownFunctions) {
+    init();
+}
+
+Script::Script(ScriptHost& host, SymbolTable& symbols, FunctionTable& functions,
+               std::ostream& out, std::ostream& err)
+    : timedHost(host), output(out), errors(err), symbolTable(symbols), functionTable(functions) {
+    init();
+}
+
+void Script::init() {
+    yyscan_t s;
+    // The scanner interns identifiers in this script's name pool.
+    if (yylex_init_extra(this, &s) != 0)
+        throw std::runtime_error("Cannot create scanner");
+    scanner = s;
+    parser = yypstate_new();
+    if (!parser) {
+        yylex_destroy(s);
+        throw std::runtime_error("Cannot create parser");
+    }
+}
+
+Script::~Script() {
+    yypstate_delete(static_cast<yypstate*>(parser));
+    yylex_destroy(static_cast<yyscan_t>(scanner));
+}
+
+void Script::push(int token, const void* value) {
+    int status = yypush_parse(static_cast<yypstate*>(parser), token,
+                              static_cast<const YYSTYPE*>(value), *this);
+    if (status != YYPUSH_MORE) {
+        stopped = true;
+        failed = status != 0;
+    }
+}
+
+double Script::parseSeconds() const {
+    return (lexNs - timedHost.ns) * 1e-9;
+}
+
+// Push every token of the scanner's current buffer, then delete it.
+void Script::scan(void* buffer) {
+    yyscan_t s = static_cast<yyscan_t>(scanner);
+    YYSTYPE value;
+    // Timing the scanner apart from the parser costs two clock reads a token.
+    bool timed = statsTiming();
+    while (!stopped) {
+        std::chrono::steady_clock::time_point start;
+        if (timed)
+            start = std::chrono::steady_clock::now();
+        int token = yylex(&value, s);
+        if (timed)
+            scanNs += nanoseconds(std::chrono::steady_clock::now() - start);
+        if (token == 0)
+            break;
+        ++tokens;
+        push(token, &value);
+    }
+    yy_delete_buffer(static_cast<YY_BUFFER_STATE>(buffer), s);
+}
+
+// Add the front end's share since `resumed` to the process-wide stats: the
+// scanner's time while timing, and the rest as parsing.
+void Script::flushStats(std::chrono::steady_clock::time_point now) {
+    if (!statsEnabled())
+        return;
+    statTime(Phase::Lex, scanNs);
+    statTime(Phase::Parse, std::max(0LL, nanoseconds(now - resumed) - scanNs));
+    statAdd(Counter::Tokens, tokens);
+    statAdd(Counter::AstNodes, nodes.objectsMade() - objectsCounted);
+    statAdd(Counter::ArenaBytes, nodes.bytesAllocated() - bytesCounted);
+    objectsCounted = nodes.objectsMade();
+    bytesCounted = nodes.bytesAllocated();
+    scanNs = 0;
+    tokens = 0;
+    resumed = now;
+}
+
+// Lex a run of input that ends on a statement boundary and push its tokens.
+void Script::lex(const char* data, size_t size) {
+    yyscan_t s = static_cast<yyscan_t>(scanner);
+    Lexing t(*this);
+    bytes += size;
+    while (size && !stopped) {
+        // yy_scan_bytes takes an int; split longer runs at a boundary.
+        size_t n = size;
+        if (n > INT_MAX) {
+            n = std::string(data, INT_MAX).find_last_of(";\n") + 1;
+            if (n == 0)
+                throw std::runtime_error("Input line too long");
+        }
+        scan(yy_scan_bytes(data, (int)n, s));
+        data += n;
+        size -= n;
+    }
+}
+
+// No token contains ';' or a newline, so input is cut after the last one:
+// everything before is lexed now, the rest waits for the next chunk.
+void Script::feed(const char* data, size_t size) {
+    if (stopped)
+        return;
+    size_t cut = size;
+    while (cut && data[cut - 1] != ';' && data[cut - 1] != '\n')
+        --cut;
+    if (cut == 0) {
+        pending.append(data, size);
+        return;
+    }
+    if (pending.empty()) {
+        lex(data, cut);
+    } else {
+        pending.append(data, cut);
+        lex(pending.data(), pending.size());
+    }
+    pending.assign(data + cut, size - cut);
+}
+
+bool Script::finish() {
+    if (!stopped) {
+        lex(pending.data(), pending.size());
+        pending.clear();
+        if (!stopped) {
+            Lexing t(*this);
+            push(0, nullptr);
+        }
+    }
+    return !failed;
+}
+
+bool Script::run(int fd, size_t chunkSize) {
+    std::vector<char> buffer(chunkSize);
+    while (!stopped) {
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error("Read failed");
+        if (n == 0)
+            break;
+        feed(buffer.data(), (size_t)n);
+    }
+    return finish();
+}
+
+bool Script::runMapped(int fd) {
+    struct stat st;
+    // Flex buffers are limited to INT_MAX bytes, including two NULs at the end.
+    if (stopped || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        st.st_size > INT_MAX - 2)
+        return run(fd);
+    size_t size = (size_t)st.st_size;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size + 2 + page - 1) / page * page;
+    // Reserve zeroed memory with room for the NULs, then map the file over
+    // its start. The mapping is private: the scanner writes into its buffer,
+    // and only the pages it touches are copied.
+    char* base = static_cast<char*>(mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (base == MAP_FAILED)
+        return run(fd);
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, length);
+        return run(fd);
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    try {
+        Lexing t(*this);
+        bytes += size;
+        yyscan_t s = static_cast<yyscan_t>(scanner);
+        YY_BUFFER_STATE buffer = yy_scan_buffer(base, size + 2, s);
+        if (!buffer)
+            throw std::runtime_error("Cannot scan mapped file");
+        scan(buffer);
+    } catch (...) {
+        munmap(base, length);
+        throw;
+    }
+    munmap(base, length);
+    return finish();
+}
@@ -0,0 +1,178 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "arena.h"
+#include "ast.h"
+#include "functions.h"
+#include "names.h"
+
+class Script;
+
+// `for var in from..to step s { body }`, then a reduction or `> "path"`. step is
+// null when omitted (1). With neither reduction nor path, every point's value
+// is printed.
+struct SweepStatement {
+    const char* var;
+    ASTNode* from;
+    ASTNode* to;
+    ASTNode* step;
+    ASTNode* body;
+    const char* reduction = nullptr;  // sum, min, max, argmin or argmax
+    const char* path = nullptr;       // write var,value rows here as CSV
+};
+
+// What a script's statements do, supplied by the program running it. Each is
+// called as soon as its statement has been parsed; nodes live in the script's
+// arena until the statement is done. Errors are thrown as std::runtime_error
+// and reported by the script.
+class ScriptHost {
+public:
+    virtual ~ScriptHost() = default;
+
+    // Value of an expression, whose variables are in script.symbols().
+    virtual double evaluate(Script& script, ASTNode* node) = 0;
+    // Value and partial derivatives of a `grad` statement.
+    virtual double gradient(Script& script, ASTNode* node,
+                            std::vector<std::pair<std::string, double>>& partials) = 0;
+    // Root of residual in var for `solve`; lo and hi may be null.
+    virtual double solve(Script& script, ASTNode* residual, const std::string& var,
+                         ASTNode* lo, ASTNode* hi) = 0;
+    virtual void defineFunction(Script& script, const std::string& name,
+                                const std::vector<std::string>& params, ASTNode* body) = 0;
+    // Return true to take `var name = node;` (name null for expression and
+    // grad statements) over instead of having it evaluated. solve and sweeps
+    // always go to solve() and sweep().
+    virtual bool compileStatement(Script& script, const char* name, ASTNode* node) {
+        (void)script, (void)name, (void)node;
+        return false;
+    }
+    virtual void sweep(Script& script, const SweepStatement& sweep) {
+        (void)script, (void)sweep;
+        throw std::runtime_error("Sweeps are not supported here");
+    }
+    // Called once `var name = node;` has stored name's value (node null after
+    // `solve ... for name`).
+    virtual void assigned(Script& script, const char* name, ASTNode* node) {
+        (void)script, (void)name, (void)node;
+    }
+    // A ':name args' directive.
+    virtual void runDirective(Script& script, const char* text) = 0;
+};
+
+// One script being parsed and run incrementally. Input arrives in chunks of
+// any size, from memory, a file or a socket; every statement is run as soon
+// as its last token arrives. Only the unfinished tail of the input is kept,
+// and each statement's nodes are freed once it has run, so memory stays
+// bounded however long the script is. Scripts share no parser state, so any
+// number can be open at once (each on one thread at a time).
+class Script {
+public:
+    explicit Script(ScriptHost& host, std::ostream& out = std::cout,
+                    std::ostream& err = std::cerr);
+    // Run against variables and functions owned by the caller, who may share
+    // them between scripts (one at a time).
+    Script(ScriptHost& host, SymbolTable& symbols, FunctionTable& functions,
+           std::ostream& out = std::cout, std::ostream& err = std::cerr);
+    ~Script();
+    Script(const Script&) = delete;
+    Script& operator=(const Script&) = delete;
+
+    // Parse the next piece of input. Tokens may be split between chunks.
+    void feed(const char* data, size_t size);
+    // End of input. Returns false if the script could not be parsed (syntax
+    // errors inside statements are reported and skipped, and do not count).
+    bool finish();
+    // feed() everything read from fd, then finish(). Reads return as soon as
+    // data is available, so on a terminal each line runs when entered.
+    bool run(int fd, size_t chunkSize = 64 << 10);
+    // Like run(), but a regular file is mapped into memory and scanned in
+    // place, with no reads or copies. Other descriptors go through run().
+    bool runMapped(int fd);
+    // `exit` was reached, or the parser gave up; further input is ignored.
+    bool done() const { return stopped; }
+
+    SymbolTable& symbols() { return symbolTable; }
+    FunctionTable& functions() { return functionTable; }
+    Arena& arena() { return nodes; }
+    NamePool& names() { return namePool; }
+    ScriptHost& host() { return timedHost; }
+    std::ostream& out() { return output; }
+    std::ostream& err() { return errors; }
+
+    // Input scanned and parsed so far, and the time that took, not counting
+    // the time spent running the statements.
+    size_t bytesParsed() const { return bytes; }
+    double parseSeconds() const;
+
+    // Line of the input being parsed, from 1. A statement runs on the line
+    // of its ';'.
+    size_t line() const { return lineNo; }
+    // For the scanner: whitespace, the only text containing newlines.
+    void skipped(const char* text, size_t size) { lineNo += std::count(text, text + size, '\n'); }
+
+private:
+    // Forwards to the real host, timing each call.
+    class TimedHost : public ScriptHost {
+    public:
+        explicit TimedHost(ScriptHost& host) : host(host) {}
+        double evaluate(Script& script, ASTNode* node) override;
+        double gradient(Script& script, ASTNode* node,
+                        std::vector<std::pair<std::string, double>>& partials) override;
+        double solve(Script& script, ASTNode* residual, const std::string& var,
+                     ASTNode* lo, ASTNode* hi) override;
+        void defineFunction(Script& script, const std::string& name,
+                            const std::vector<std::string>& params, ASTNode* body) override;
+        bool compileStatement(Script& script, const char* name, ASTNode* node) override;
+        void sweep(Script& script, const SweepStatement& sweep) override;
+        void assigned(Script& script, const char* name, ASTNode* node) override;
+        void runDirective(Script& script, const char* text) override;
+
+        ScriptHost& host;
+        long long ns = 0;
+    };
+
+    struct HostCall;
+    struct Lexing;
+
+    void init();
+    void lex(const char* data, size_t size);
+    void scan(void* buffer);
+    void push(int token, const void* value);
+    void flushStats(std::chrono::steady_clock::time_point now);
+
+    TimedHost timedHost;
+    std::ostream& output;
+    std::ostream& errors;
+    NamePool namePool;  // identifiers seen by the scanner
+    std::unique_ptr<SymbolTable> ownSymbols;  // unless the caller's are used
+    std::unique_ptr<FunctionTable> ownFunctions;
+    SymbolTable& symbolTable;
+    FunctionTable& functionTable;
+    Arena nodes;  // the current statement's AST, reset after each one
+    std::string pending;  // input after the last statement boundary
+    void* scanner = nullptr;
+    void* parser = nullptr;
+    bool stopped = false;
+    bool failed = false;
+    size_t bytes = 0;
+    size_t lineNo = 1;
+    long long lexNs = 0;  // time in lex() and finish(), statements included
+    // Not yet added to the process-wide stats (stats.h): the front end's work
+    // since `resumed`, when lexing started or the last host call returned.
+    std::chrono::steady_clock::time_point resumed;
+    long long scanNs = 0;  // in the scanner, while timing
+    size_t tokens = 0;
+    size_t objectsCounted = 0;  // arena totals already added
+    size_t bytesCounted = 0;
+};
+
+#endif
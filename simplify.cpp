@@ -0,0 +1,212 @@
+#include "simplify.h"
+#include <cmath>
+#include <stdexcept>
+
+ASTNodePtr cloneAST(const ASTNode* nd, Arena& arena) {
+    if (auto *num = dynamic_cast<const NumberNode*>(nd))
+        return ASTNodePtr(arena.make<NumberNode>(num->getValue()));
+    if (auto *var = dynamic_cast<const VariableNode*>(nd)) {
+        auto *copy = arena.make<VariableNode>(var->getName());
+        copy->setSlot(var->getSlot());
+        return ASTNodePtr(copy);
+    }
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd))
+        return ASTNodePtr(arena.make<BinaryOpNode>(bin->op, cloneAST(bin->left.get(), arena),
+                                                   cloneAST(bin->right.get(), arena)));
+    if (auto *func = dynamic_cast<const FunctionNode*>(nd))
+        return ASTNodePtr(arena.make<FunctionNode>(func->getFunc(), cloneAST(func->getArg(), arena)));
+    if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<ASTNodePtr> args;
+        for (const ASTNodePtr& arg : call->getArgs())
+            args.push_back(cloneAST(arg.get(), arena));
+        return ASTNodePtr(arena.make<CallNode>(call->getDef(), std::move(args)));
+    }
+    if (auto *red = dynamic_cast<const ReductionNode*>(nd))
+        return ASTNodePtr(arena.make<ReductionNode>(
+            red->getKind(), cloneAST(red->getArg(), arena),
+            red->getArg2() ? cloneAST(red->getArg2(), arena) : nullptr, red->getOver()));
+    throw std::runtime_error("Unknown AST node");
+}
+
+namespace {
+ASTNodePtr substitute(const ASTNode* nd, const std::vector<ASTNodePtr>& args, Arena& arena) {
+    if (auto *var = dynamic_cast<const VariableNode*>(nd))
+        return cloneAST(args[var->getSlot()].get(), arena);
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd))
+        return ASTNodePtr(arena.make<BinaryOpNode>(bin->op, substitute(bin->left.get(), args, arena),
+                                                   substitute(bin->right.get(), args, arena)));
+    if (auto *func = dynamic_cast<const FunctionNode*>(nd))
+        return ASTNodePtr(arena.make<FunctionNode>(func->getFunc(), substitute(func->getArg(), args, arena)));
+    if (auto *call = dynamic_cast<const CallNode*>(nd)) {
+        std::vector<ASTNodePtr> inner;
+        for (const ASTNodePtr& arg : call->getArgs())
+            inner.push_back(substitute(arg.get(), args, arena));
+        return ASTNodePtr(arena.make<CallNode>(call->getDef(), std::move(inner)));
+    }
+    return cloneAST(nd, arena);
+}
+}
+
+ASTNodePtr inlineCall(const CallNode* call, Arena& arena) {
+    return substitute(call->getDef()->body.get(), call->getArgs(), arena);
+}
+
+namespace {
+const NumberNode* asNumber(const ASTNodePtr& n) {
+    return dynamic_cast<const NumberNode*>(n.get());
+}
+
+bool isNumber(const ASTNodePtr& n, double v) {
+    auto *num = asNumber(n);
+    return num && num->getValue() == v;
+}
+
+// Exactly +0 or exactly -0.
+bool isZero(const ASTNodePtr& n, bool negative) {
+    auto *num = asNumber(n);
+    return num && num->getValue() == 0 && std::signbit(num->getValue()) == negative;
+}
+
+// Whether evaluating n can raise a domain error: it divides, takes a sqrt or
+// log, or calls something that might. Rewrites that drop a subtree keep it
+// when this holds, so the error is still reported at run time.
+bool mayRaise(const ASTNode* n) {
+    if (auto *bin = dynamic_cast<const BinaryOpNode*>(n))
+        return bin->op == '/' || mayRaise(bin->left.get()) || mayRaise(bin->right.get());
+    if (auto *func = dynamic_cast<const FunctionNode*>(n))
+        return func->getFunc() == "sqrt" || func->getFunc() == "log" || mayRaise(func->getArg());
+    return dynamic_cast<const NumberNode*>(n) == nullptr
+        && dynamic_cast<const VariableNode*>(n) == nullptr;
+}
+
+struct Simplifier {
+    Arena& arena;
+    bool fastMath;
+
+    ASTNodePtr number(double v) { return ASTNodePtr(arena.make<NumberNode>(v)); }
+
+    ASTNodePtr binary(char op, ASTNodePtr l, ASTNodePtr r) {
+        return ASTNodePtr(arena.make<BinaryOpNode>(op, std::move(l), std::move(r)));
+    }
+
+    ASTNodePtr run(const ASTNode* nd) {
+        if (auto *bin = dynamic_cast<const BinaryOpNode*>(nd))
+            return rewriteBinary(bin->op, run(bin->left.get()), run(bin->right.get()));
+        if (auto *func = dynamic_cast<const FunctionNode*>(nd))
+            return rewriteFunction(func->getFunc(), run(func->getArg()));
+        if (auto *call = dynamic_cast<const CallNode*>(nd))
+            return rewriteCall(call);
+        if (auto *red = dynamic_cast<const ReductionNode*>(nd))
+            return ASTNodePtr(arena.make<ReductionNode>(
+                red->getKind(), run(red->getArg()), red->getArg2() ? run(red->getArg2()) : nullptr,
+                red->getOver()));
+        return cloneAST(nd, arena);
+    }
+
+    // Calls stay calls (the JIT inlines and specializes them), unless every
+    // argument is constant and the body can be evaluated without an error.
+    ASTNodePtr rewriteCall(const CallNode* call) {
+        std::vector<ASTNodePtr> args;
+        std::vector<double> frame;
+        for (const ASTNodePtr& arg : call->getArgs()) {
+            args.push_back(run(arg.get()));
+            if (auto *num = asNumber(args.back()))
+                frame.push_back(num->getValue());
+        }
+        if (frame.size() == args.size()) {
+            try {
+                return number(call->getDef()->body->evaluate(frame.data()));
+            } catch (const std::runtime_error&) {
+            }
+        }
+        return ASTNodePtr(arena.make<CallNode>(call->getDef(), std::move(args)));
+    }
+
+    // x^n by repeated squaring. Copies of x are merged again by CSE in the
+    // bytecode and JIT tiers.
+    ASTNodePtr power(const ASTNodePtr& x, int n) {
+        if (n == 1)
+            return cloneAST(x.get(), arena);
+        ASTNodePtr half = power(x, n / 2);
+        ASTNodePtr copy = cloneAST(half.get(), arena);
+        ASTNodePtr sq = binary('*', std::move(half), std::move(copy));
+        return n % 2 ? binary('*', std::move(sq), cloneAST(x.get(), arena)) : std::move(sq);
+    }
+
+    ASTNodePtr rewriteBinary(char op, ASTNodePtr l, ASTNodePtr r) {
+        auto *a = asNumber(l), *b = asNumber(r);
+        if (a && b) {
+            double x = a->getValue(), y = b->getValue();
+            switch (op) {
+                case '+': return number(x + y);
+                case '-': return number(x - y);
+                case '*': return number(x * y);
+                case '/': if (y != 0) return number(x / y); break;
+                case '^': return number(std::pow(x, y));
+            }
+            return binary(op, std::move(l), std::move(r));
+        }
+        switch (op) {
+            case '+':
+                if (isZero(r, true) || (fastMath && isZero(r, false))) return l;
+                if (isZero(l, true) || (fastMath && isZero(l, false))) return r;
+                break;
+            case '-':
+                if (isZero(r, false) || (fastMath && isZero(r, true))) return l;
+                if (fastMath && sameStructure(l.get(), r.get()) && !mayRaise(l.get())) return number(0);
+                break;
+            case '*':
+                if (isNumber(r, 1)) return l;
+                if (isNumber(l, 1)) return r;
+                if (fastMath && ((isNumber(l, 0) && !mayRaise(r.get()))
+                                 || (isNumber(r, 0) && !mayRaise(l.get()))))
+                    return number(0);
+                if (fastMath) {
+                    auto *sl = dynamic_cast<const FunctionNode*>(l.get());
+                    auto *sr = dynamic_cast<const FunctionNode*>(r.get());
+                    if (sl && sr && sl->getFunc() == "sqrt" && sr->getFunc() == "sqrt"
+                        && sameStructure(sl->getArg(), sr->getArg()))
+                        return cloneAST(sl->getArg(), arena);
+                }
+                break;
+            case '/':
+                if (isNumber(r, 1)) return l;
+                break;
+            case '^':
+                if (isNumber(r, 1)) return l;
+                if (isNumber(r, 0) && !mayRaise(l.get())) return number(1);
+                if (b && dynamic_cast<const VariableNode*>(l.get())) {
+                    double n = b->getValue();
+                    if (n == 2 || (fastMath && n >= 3 && n <= 8 && n == std::floor(n)))
+                        return power(l, (int)n);
+                }
+                break;
+        }
+        // (x op c1) op c2 -> x op (c1 op c2) for + and *.
+        if (fastMath && b && (op == '+' || op == '*')) {
+            auto *inner = dynamic_cast<BinaryOpNode*>(l.get());
+            if (inner && inner->op == op && asNumber(inner->right)) {
+                double c = asNumber(inner->right)->getValue();
+                double folded = op == '+' ? c + b->getValue() : c * b->getValue();
+                return rewriteBinary(op, std::move(inner->left), number(folded));
+            }
+        }
+        return binary(op, std::move(l), std::move(r));
+    }
+
+    ASTNodePtr rewriteFunction(const std::string& f, ASTNodePtr arg) {
+        if (auto *num = asNumber(arg)) {
+            double x = num->getValue();
+            if (f == "sin") return number(std::sin(x));
+            if (f == "cos") return number(std::cos(x));
+            if (f == "log" && x > 0) return number(std::log(x));
+            if (f == "sqrt" && x >= 0) return number(std::sqrt(x));
+        }
+        return ASTNodePtr(arena.make<FunctionNode>(f, std::move(arg)));
+    }
+};
+}
+
+ASTNodePtr simplify(const ASTNode* node, Arena& arena, bool fastMath) {
+    return Simplifier{arena, fastMath}.run(node);
+}
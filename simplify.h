@@ -0,0 +1,30 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "arena.h"
+#include "ast.h"
+
+// Rewrite an expression before it reaches any tier. Constant subexpressions
+// are folded with the same operations the tree interpreter uses, except where
+// that would raise a domain error (left for run time, so it is still
+// reported). Identities are applied only where they give the same result for
+// every input under IEEE rules, including -0, infinities and NaN: x*1, x/1,
+// x-0, x+(-0), x^1, x^0, and x^2 -> x*x for a variable x. Rewrites that drop
+// an operand (x^0, and x*0 and x-x below) keep it if it could raise.
+//
+// With fastMath, also x+0, x*0, x-x, sqrt(x)*sqrt(x) -> x, reassociation of
+// constants ((x*2)*3 -> x*6) and x^n -> multiplies for variables and
+// 3 <= n <= 8. These assume no NaNs, infinities or signed zeros, as fast-math
+// codegen does.
+//
+// The result is a new tree allocated in arena; node is left untouched.
+ASTNodePtr simplify(const ASTNode* node, Arena& arena, bool fastMath);
+
+// Deep copy of an expression into arena.
+ASTNodePtr cloneAST(const ASTNode* node, Arena& arena);
+
+// The body of call's function with copies of the arguments in place of the
+// parameters. Calls inside the body are kept.
+ASTNodePtr inlineCall(const CallNode* call, Arena& arena);
+
+#endif
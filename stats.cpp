@@ -0,0 +1,86 @@
+#include "stats.h"
+#include <cstdio>
+
+#ifndef DSL_NO_STATS
+std::atomic<uint64_t> statCounters[(int)Counter::Count];
+std::atomic<uint64_t> statPhaseNs[(int)Phase::Count];
+std::atomic<bool> statTimingOn{false};
+
+uint64_t statCount(Counter c) { return statCounters[(int)c].load(std::memory_order_relaxed); }
+uint64_t statNs(Phase p) { return statPhaseNs[(int)p].load(std::memory_order_relaxed); }
+
+void resetStats() {
+    for (auto& c : statCounters)
+        c.store(0, std::memory_order_relaxed);
+    for (auto& t : statPhaseNs)
+        t.store(0, std::memory_order_relaxed);
+}
+#else
+uint64_t statCount(Counter) { return 0; }
+uint64_t statNs(Phase) { return 0; }
+void resetStats() {}
+#endif
+
+const char* counterName(Counter c) {
+    switch (c) {
+        case Counter::Statements: return "statements";
+        case Counter::Tokens: return "tokens";
+        case Counter::AstNodes: return "ast_nodes";
+        case Counter::ArenaBytes: return "arena_bytes";
+        case Counter::JitModules: return "jit_modules";
+        case Counter::JitCacheHits: return "jit_cache_hits";
+        case Counter::JitCacheMisses: return "jit_cache_misses";
+        case Counter::ObjectBytes: return "object_bytes";
+        case Counter::EvalTree: return "eval_tree";
+        case Counter::EvalVM: return "eval_vm";
+        case Counter::EvalJIT: return "eval_jit";
+        case Counter::Promotions: return "promotions";
+        case Counter::BatchRows: return "batch_rows";
+        case Counter::DumpBytes: return "dump_bytes";
+        default: return "?";
+    }
+}
+
+const char* phaseName(Phase p) {
+    switch (p) {
+        case Phase::Lex: return "lex";
+        case Phase::Parse: return "parse";
+        case Phase::Run: return "run";
+        case Phase::Codegen: return "codegen";
+        case Phase::Optimize: return "optimize";
+        case Phase::Native: return "native";
+        case Phase::Dump: return "dump";
+        default: return "?";
+    }
+}
+
+void printStats(std::ostream& out) {
+    if (!statsEnabled()) {
+        out << "Statistics are not built in (DSL_NO_STATS)\n";
+        return;
+    }
+    char line[96];
+    for (int i = 0; i < (int)Phase::Count; ++i) {
+        std::snprintf(line, sizeof line, "  %-18s %12.3f ms\n", phaseName((Phase)i),
+                      statNs((Phase)i) * 1e-6);
+        out << line;
+    }
+    for (int i = 0; i < (int)Counter::Count; ++i) {
+        std::snprintf(line, sizeof line, "  %-18s %12llu\n", counterName((Counter)i),
+                      (unsigned long long)statCount((Counter)i));
+        out << line;
+    }
+    if (!statsTiming())
+        out << "  (timing off: lexing counts as parse, dump writes are not timed)\n";
+}
+
+void writeStatsJSON(std::ostream& out) {
+    out << "{\"enabled\": " << (statsEnabled() ? "true" : "false")
+        << ", \"timing\": " << (statsTiming() ? "true" : "false") << ", \"phases_ns\": {";
+    for (int i = 0; i < (int)Phase::Count; ++i)
+        out << (i ? ", " : "") << "\"" << phaseName((Phase)i) << "\": " << statNs((Phase)i);
+    out << "}, \"counters\": {";
+    for (int i = 0; i < (int)Counter::Count; ++i)
+        out << (i ? ", " : "") << "\"" << counterName((Counter)i) << "\": " << statCount((Counter)i);
+    out << "}}\n";
+}
@@ -0,0 +1,99 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Process-wide counters and phase times, for finding out where a run spends
+// its time (:stats, --stats). Counters are bumped once per statement, compile,
+// batch or dump write, never per row or node, with relaxed atomic adds. Times
+// the JIT measures anyway are always recorded; the timers that cost extra
+// clock reads (lexing apart from parsing, dump writes) only run while
+// setStatsTiming(true). Building with -DDSL_NO_STATS (make STATS=0) compiles
+// every call out.
+
+enum class Counter {
+    Statements,      // statements run, directives included
+    Tokens,
+    AstNodes,        // objects made in the scripts' arenas
+    ArenaBytes,
+    JitModules,      // LLVM modules handed to the JIT
+    JitCacheHits,    // formulas and kernels found already compiled
+    JitCacheMisses,
+    ObjectBytes,     // native code emitted (or loaded from the object cache)
+    EvalTree,        // statement evaluations, by tier
+    EvalVM,
+    EvalJIT,
+    Promotions,      // tier promotions
+    BatchRows,       // rows of batch, sweep and reduction kernels
+    DumpBytes,       // written to tokens.txt, ast.txt and ir.ll
+    Count
+};
+
+enum class Phase {
+    Lex,       // only while timing; otherwise included in Parse
+    Parse,     // scanning and parsing, statements excluded
+    Run,       // running statements, the JIT's phases below included
+    Codegen,   // building IR
+    Optimize,  // the pass pipeline
+    Native,    // emitting native code
+    Dump,      // handing debug output to the writer threads, within the phases
+               // above (only while timing)
+    Count
+};
+
+#ifndef DSL_NO_STATS
+extern std::atomic<uint64_t> statCounters[(int)Counter::Count];
+extern std::atomic<uint64_t> statPhaseNs[(int)Phase::Count];
+extern std::atomic<bool> statTimingOn;
+
+inline void statAdd(Counter c, uint64_t n = 1) {
+    statCounters[(int)c].fetch_add(n, std::memory_order_relaxed);
+}
+inline void statTime(Phase p, uint64_t ns) {
+    statPhaseNs[(int)p].fetch_add(ns, std::memory_order_relaxed);
+}
+inline bool statsTiming() { return statTimingOn.load(std::memory_order_relaxed); }
+inline void setStatsTiming(bool on) { statTimingOn.store(on, std::memory_order_relaxed); }
+constexpr bool statsEnabled() { return true; }
+#else
+inline void statAdd(Counter, uint64_t = 1) {}
+inline void statTime(Phase, uint64_t) {}
+constexpr bool statsTiming() { return false; }
+inline void setStatsTiming(bool) {}
+constexpr bool statsEnabled() { return false; }
+#endif
+
+uint64_t statCount(Counter c);
+uint64_t statNs(Phase p);
+void resetStats();
+const char* counterName(Counter c);
+const char* phaseName(Phase p);
+// A table for people, and one JSON object for tools.
+void printStats(std::ostream& out);
+void writeStatsJSON(std::ostream& out);
+
+// Adds the time until it goes out of scope to a phase, if timing is on.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(Phase phase) : phase(phase), on(statsTiming()) {
+        if (on)
+            start = std::chrono::steady_clock::now();
+    }
+    ~PhaseTimer() {
+        if (on)
+            statTime(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start).count());
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    Phase phase;
+    bool on;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
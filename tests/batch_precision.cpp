@@ -0,0 +1,53 @@
+// The tree-interpreter batch fallback must round like the JIT batch kernels
+// at each precision, so results do not depend on which tier ran.
+
+#include <cstdio>
+#include <vector>
+#include "batch.h"
+#include "jit.h"
+
+int main() {
+    // sqrt(x) * 0.1 + y / 3
+    Arena arena;
+    auto var = [&](const char* name) { return ASTNodePtr(arena.make<VariableNode>(name)); };
+    auto num = [&](double v) { return ASTNodePtr(arena.make<NumberNode>(v)); };
+    ASTNodePtr formula(arena.make<BinaryOpNode>(
+        '+',
+        ASTNodePtr(arena.make<BinaryOpNode>('*', ASTNodePtr(arena.make<FunctionNode>("sqrt", var("x"))),
+                                            num(0.1))),
+        ASTNodePtr(arena.make<BinaryOpNode>('/', var("y"), num(3)))));
+
+    const size_t rows = 1000;
+    std::vector<double> xs(rows), ys(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        xs[i] = 1 + i * 0.37;
+        ys[i] = 2 - i * 0.011;
+    }
+    std::vector<Column> columns{Column("x", xs.data()), Column("y", ys.data())};
+
+    JITSession jit;
+    jit.setOptLevel(2);
+    std::vector<double> f64(rows);
+    evaluateBatchInterpreted(formula.get(), columns, f64.data(), rows);
+    for (Precision p : {Precision::F32, Precision::Mixed}) {
+        jit.setPrecision(p);
+        std::vector<double> tree(rows), compiled(rows);
+        evaluateBatchInterpreted(formula.get(), columns, tree.data(), rows, p);
+        evaluateBatch(jit, formula.get(), columns, compiled.data(), rows);
+        size_t rounded = 0;
+        for (size_t i = 0; i < rows; ++i) {
+            if (tree[i] != compiled[i]) {
+                std::fprintf(stderr, "%s row %zu: interpreted %.17g, JIT %.17g\n", precisionName(p), i,
+                             tree[i], compiled[i]);
+                return 1;
+            }
+            rounded += tree[i] != f64[i];
+        }
+        if (!rounded) {
+            std::fprintf(stderr, "%s: no row differs from f64\n", precisionName(p));
+            return 1;
+        }
+    }
+    std::printf("ok   tests/batch_precision\n");
+    return 0;
+}
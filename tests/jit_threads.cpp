@@ -0,0 +1,50 @@
+// Two sessions on the shared JIT: one thread compiles formulas while the other
+// makes the first call to formulas it compiled, which compiles their bodies
+// lazily in the same LLVM context.
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dslmath.h"
+
+static const int Formulas = 200;
+
+// The i'th formula, and its value at x.
+static std::string formula(int i, const char* tag) {
+    return "sin(x) * " + std::to_string(i) + " + x^2 + " + tag;
+}
+static double expected(int i, double x, double tag) {
+    return std::sin(x) * i + x * x + tag;
+}
+
+static bool check(Session& session, const char* tag, double tagValue, bool callNow) {
+    session.set(tag, tagValue);
+    session.set("x", 0.5);
+    std::vector<Formula> pending;
+    for (int i = 0; i < Formulas; ++i) {
+        pending.push_back(session.compile(formula(i, tag)));
+        if (!callNow)
+            continue;
+        double got = pending.back().eval();
+        if (std::fabs(got - expected(i, 0.5, tagValue)) > 1e-12) {
+            std::fprintf(stderr, "%s: formula %d gave %g\n", tag, i, got);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    Session compiling, calling;
+    bool compiledOk = true, calledOk = true;
+    std::thread a([&] { compiledOk = check(compiling, "a", 1, false); });
+    std::thread b([&] { calledOk = check(calling, "b", 2, true); });
+    a.join();
+    b.join();
+    if (!compiledOk || !calledOk)
+        return 1;
+    std::printf("ok   tests/jit_threads\n");
+    return 0;
+}
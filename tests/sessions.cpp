@@ -0,0 +1,44 @@
+// Two sessions on the shared JIT define a function of the same name. Calls
+// must run each session's own definition, on every path that compiles them.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "dslmath.h"
+
+static bool expect(const char* what, double got, double want) {
+    if (got == want)
+        return true;
+    std::fprintf(stderr, "%s: got %g, expected %g\n", what, got, want);
+    return false;
+}
+
+int main() {
+    Session a, b;
+    a.run("func f(x) = x + 1;");
+    b.run("func f(x) = x * 100;");
+    bool ok = true;
+
+    ok &= expect("a scalar", a.compile("f(y)").eval({2}), 3);
+    ok &= expect("b scalar", b.compile("f(y)").eval({2}), 200);
+
+    double ys[2] = {2, 3}, out[2];
+    std::vector<Column> columns{Column("y", ys)};
+    a.compile("f(y)").eval(columns, out, 2);
+    ok &= expect("a batch", out[1], 4);
+    b.compile("f(y)").eval(columns, out, 2);
+    ok &= expect("b batch", out[1], 300);
+
+    // Statements go through the tiered evaluator, which promotes hot ones.
+    for (int i = 0; i < 20; ++i) {
+        a.run("var r = f(2);");
+        b.run("var r = f(2);");
+    }
+    ok &= expect("a statement", a.get("r"), 3);
+    ok &= expect("b statement", b.get("r"), 200);
+
+    if (!ok)
+        return 1;
+    std::printf("ok   tests/sessions\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i)
+        queues.push_back(std::make_unique<Queue>());
+    for (unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : workers)
+        t.join();
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0)
+        return;
+    std::lock_guard<std::mutex> jobLock(jobMutex);
+    {
+        std::lock_guard<std::mutex> lock(m);
+        job = &task;
+        error = nullptr;
+        remaining = count;
+        // Contiguous runs per queue keep neighbouring chunks on one core
+        // unless they get stolen.
+        size_t n = queues.size();
+        for (size_t q = 0; q < n; ++q) {
+            std::lock_guard<std::mutex> qlock(queues[q]->m);
+            for (size_t i = count * q / n; i < count * (q + 1) / n; ++i)
+                queues[q]->items.push_back(i);
+        }
+        ++generation;
+    }
+    wake.notify_all();
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(m);
+    done.wait(lock, [this] { return remaining == 0; });
+    job = nullptr;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void ThreadPool::workerLoop(size_t self) {
+    size_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        runTasks(self);
+    }
+}
+
+// Own deque first (newest item, still warm in cache), then steal the oldest
+// item of the next non-empty deque.
+bool ThreadPool::pop(size_t self, size_t& item) {
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.m);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); ++k) {
+        Queue& victim = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.m);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::runTasks(size_t self) {
+    size_t item;
+    while (pop(self, item)) {
+        try {
+            (*job)(item);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m);
+            if (!error)
+                error = std::current_exception();
+        }
+        if (--remaining == 0) {
+            std::lock_guard<std::mutex> lock(m);
+            done.notify_all();
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads with one task deque per worker. A
+// parallelFor spreads its task indices over the deques; each worker pops from
+// the back of its own deque and, once that is empty, steals from the front of
+// the others, so uneven tasks still keep every core busy. The calling thread
+// works alongside the pool while it waits.
+class ThreadPool {
+public:
+    // threads == 0 uses one thread per hardware core (counting the caller).
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads that run tasks, including the caller of parallelFor.
+    unsigned size() const { return (unsigned)queues.size(); }
+
+    // Run task(i) for every i in [0, count) and wait for all of them. Only one
+    // parallelFor runs at a time; the first exception thrown by a task is
+    // rethrown here once the rest have finished.
+    void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<size_t> items;
+    };
+
+    void workerLoop(size_t self);
+    void runTasks(size_t self);
+    bool pop(size_t self, size_t& item);
+
+    std::vector<std::unique_ptr<Queue>> queues; // [0] belongs to the caller
+    std::vector<std::thread> workers;
+    std::mutex jobMutex;                        // serializes parallelFor calls
+    std::mutex m;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t generation = 0;
+    std::atomic<size_t> remaining{0};
+    std::exception_ptr error;
+    bool stopping = false;
+};
+
+#endif
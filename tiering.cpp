@@ -0,0 +1,80 @@
+#include "tiering.h"
+#include "stats.h"
+
+const char* tierName(Tier tier) {
+    switch (tier) {
+        case Tier::Tree: return "tree";
+        case Tier::VM: return "vm";
+        case Tier::JIT: return "jit";
+    }
+    return "?";
+}
+
+// Formulas are tracked per precision: each has its own code.
+uint64_t TieredEvaluator::entryKey(const ASTNode* node, std::string& key) const {
+    key = precisionName(jit.getPrecision());
+    key += ':';
+    appendFormulaKey(node, key);
+    return hashCombine(node->hash(), (uint64_t)jit.getPrecision());
+}
+
+Tier TieredEvaluator::currentTier(const ASTNode* node) const {
+    std::string key;
+    auto it = entries.find(entryKey(node, key));
+    return it == entries.end() || it->second.key != key ? Tier::Tree : it->second.tier;
+}
+
+// The formula's entry, created (or taken over from a colliding formula) if needed.
+TieredEvaluator::Entry* TieredEvaluator::find(const ASTNode* node) {
+    uint64_t hash = entryKey(node, scratch);
+    auto it = entries.find(hash);
+    if (it != entries.end()) {
+        if (it->second.key != scratch) {
+            it->second = Entry();
+            it->second.key = scratch;
+            collectSlots(node, it->second.bind);
+        }
+        return &it->second;
+    }
+    // Forget the oldest formulas rather than growing without bound; they
+    // start over in the tree interpreter if they come back.
+    if (entries.size() >= capacity) {
+        entries.erase(order.front());
+        order.pop_front();
+    }
+    Entry& e = entries[hash];
+    order.push_back(hash);
+    e.key = scratch;
+    collectSlots(node, e.bind);
+    return &e;
+}
+
+void TieredEvaluator::promote(Entry& e, Tier to, const ASTNode* node) {
+    if (to == Tier::VM)
+        e.vm.reset(new BytecodeProgram(node, jit.getPrecision()));
+    else
+        e.native = jit.compile(node, tierPolicy.jitOptLevel);
+    statAdd(Counter::Promotions);
+    if (tierPolicy.trace) {
+        *tierPolicy.trace << "[tier] " << tierName(e.tier) << " -> " << tierName(to)
+                          << " after " << e.count - 1 << " runs: ";
+        *tierPolicy.trace << e.key << "\n";
+    }
+    e.tier = to;
+}
+
+double TieredEvaluator::evaluate(const ASTNode* node, SymbolTable& symbols) {
+    Entry& e = *find(node);
+    ++e.count;
+    if (e.tier != Tier::JIT && e.count >= tierPolicy.jitThreshold)
+        promote(e, Tier::JIT, node);
+    else if (e.tier == Tier::Tree && e.count >= tierPolicy.vmThreshold)
+        promote(e, Tier::VM, node);
+
+    last = e.tier;
+    switch (e.tier) {
+        case Tier::JIT: return e.native->call(symbols.values(), e.bind);
+        case Tier::VM: return e.vm->call(symbols.values(), e.bind);
+        default: return evaluateAt(node, symbols, jit.getPrecision());
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TIERING_H
+#define TIERING_H
+
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include "ast.h"
+#include "bytecode.h"
+#include "jit.h"
+
+enum class Tier { Tree, VM, JIT };
+
+const char* tierName(Tier tier);
+
+// When to move an expression to the next tier. Counts are executions of the
+// same formula (by structural key), including the one that triggers the move.
+struct TierPolicy {
+    unsigned vmThreshold = 2;     // tree interpreter below this, bytecode from here
+    unsigned jitThreshold = 1000; // JIT from here
+    int jitOptLevel = 2;          // optimization level for promoted formulas
+    std::ostream* trace = nullptr; // if set, every promotion is logged here
+};
+
+// Runs each formula on the cheapest tier that pays off: one-off statements
+// stay in the tree interpreter, repeated ones get flattened to bytecode, and
+// hot ones are JIT-compiled with optimization. Every tier runs at the JIT
+// session's precision.
+class TieredEvaluator {
+public:
+    explicit TieredEvaluator(JITSession& jit) : jit(jit) {}
+
+    // node must have been resolved against symbols. Argument slots are bound
+    // when a formula is first seen, so one evaluator serves one SymbolTable.
+    double evaluate(const ASTNode* node, SymbolTable& symbols);
+
+    TierPolicy& policy() { return tierPolicy; }
+    // Tier the formula would run on next; Tree if it has not been seen.
+    Tier currentTier(const ASTNode* node) const;
+    // Tier used by the last evaluate().
+    Tier lastTier() const { return last; }
+
+private:
+    struct Entry {
+        std::string key;  // appendFormulaKey, to confirm a hash match
+        unsigned count = 0;
+        Tier tier = Tier::Tree;
+        std::vector<int> bind;  // argument slots, in parameter order
+        std::unique_ptr<BytecodeProgram> vm;
+        CompiledFunctionPtr native;
+    };
+
+    void promote(Entry& e, Tier to, const ASTNode* node);
+    Entry* find(const ASTNode* node);
+    uint64_t entryKey(const ASTNode* node, std::string& key) const;
+
+    JITSession& jit;
+    TierPolicy tierPolicy;
+    // Keyed by structural hash. On a collision the newer formula takes the
+    // entry over and starts again from the tree interpreter.
+    std::unordered_map<uint64_t, Entry> entries;
+    std::deque<uint64_t> order;
+    std::string scratch;  // reused for keys so that lookups do not allocate
+    size_t capacity = 65536;
+    Tier last = Tier::Tree;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "trace.h"
+#include "stats.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+std::unique_ptr<TraceSink> tokenDump;
+std::unique_ptr<TraceSink> astDump;
+
+TraceSink::TraceSink(const std::string& path, size_t capacity)
+    : path(path), file(std::fopen(path.c_str(), "w")), ring(new char[capacity]),
+      capacity(capacity) {
+    if (!file)
+        throw std::runtime_error("Failed to open " + path);
+    writer = std::thread(&TraceSink::writerLoop, this);
+}
+
+TraceSink::~TraceSink() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stopping = true;
+    }
+    dataReady.notify_one();
+    writer.join();
+    std::fclose(file);
+}
+
+void TraceSink::write(const char* data, size_t size) {
+    PhaseTimer t(Phase::Dump);
+    statAdd(Counter::DumpBytes, size);
+    std::unique_lock<std::mutex> lock(m);
+    while (size) {
+        spaceReady.wait(lock, [&] { return head - tail < capacity; });
+        // Copy as much as fits before the end of the ring or the free space.
+        size_t at = head % capacity;
+        size_t n = std::min({size, capacity - (head - tail), capacity - at});
+        std::memcpy(ring.get() + at, data, n);
+        head += n;
+        data += n;
+        size -= n;
+        dataReady.notify_one();
+    }
+}
+
+// The range [tail, head) is only touched by this thread until tail moves, so
+// it is written out without holding the lock.
+void TraceSink::writerLoop() {
+    std::unique_lock<std::mutex> lock(m);
+    for (;;) {
+        dataReady.wait(lock, [&] { return stopping || head != tail; });
+        if (head == tail) {
+            if (stopping)
+                break;
+            continue;
+        }
+        size_t at = tail % capacity;
+        size_t n = std::min(head - tail, capacity - at);
+        bool drained = n == head - tail;
+        lock.unlock();
+        std::fwrite(ring.get() + at, 1, n, file);
+        // Keep the file current whenever we catch up.
+        if (drained)
+            std::fflush(file);
+        lock.lock();
+        tail += n;
+        spaceReady.notify_all();
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Append-only debug file written by a background thread. write() copies into a
+// ring buffer and returns; the file I/O happens off the calling thread. A
+// writer only waits if it gets a full buffer ahead of the disk.
+class TraceSink {
+public:
+    // Truncates path. Throws std::runtime_error if it cannot be opened.
+    explicit TraceSink(const std::string& path, size_t capacity = 1 << 20);
+    // Drains the buffer and closes the file.
+    ~TraceSink();
+    TraceSink(const TraceSink&) = delete;
+    TraceSink& operator=(const TraceSink&) = delete;
+
+    void write(const char* data, size_t size);
+    void write(const std::string& text) { write(text.data(), text.size()); }
+
+    const std::string& getPath() const { return path; }
+
+private:
+    void writerLoop();
+
+    std::string path;
+    FILE* file;
+    std::unique_ptr<char[]> ring;
+    size_t capacity;
+    size_t head = 0;  // total bytes ever written into the ring
+    size_t tail = 0;  // total bytes ever flushed to the file
+    bool stopping = false;
+    std::mutex m;
+    std::condition_variable dataReady;
+    std::condition_variable spaceReady;
+    std::thread writer;
+};
+
+// Debug dumps, all off (null) unless enabled with --dump-* or :dump.
+extern std::unique_ptr<TraceSink> tokenDump;  // tokens.txt
+extern std::unique_ptr<TraceSink> astDump;    // ast.txt
+
+#endif